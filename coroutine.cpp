@@ -1,9 +1,11 @@
 #include "coroutine.h"
 #include "profiler.h"
+#include "mpu.h"
 #include "pico/stdlib.h"
 #include "pico/critical_section.h"
 #include "hardware/clocks.h"
 #include "hardware/structs/mpu.h"
+#include "hardware/structs/systick.h"
 #include "hardware/regs/syscfg.h"
 #include "hardware/structs/syscfg.h"
 #include <string.h>
@@ -15,15 +17,28 @@
 #define SCHEDFUNC(f)    f
 #endif
 
+#if PICORO_COMPACT_HEADER
+// same as LinkedList but linking by coro handle.
+struct CoroList
+{
+    coro_handle_t   head;
+    coro_handle_t   tail;
+};
+#else
+typedef struct LinkedList   CoroList;
+#endif
+
 // head is currently running.
-static struct LinkedList    ready2run;
-static struct LinkedList    waiting4timer;
+static CoroList             ready2run;
+static CoroList             waiting4timer;
 static critical_section_t   lock;
 #if PICORO_TRACK_EXECUTION_TIME
 static absolute_time_t      headrunningsince;   // Head of ready2run running since this timestamp, in microseconds. Used to update timespentexecuting.
 #endif
 
 #define FLAGS_DO_NOT_RESCHEDULE     (1 << 1)        // Once the coro ends up in the scheduler it will not be rescheduled, effectively exiting it.
+#define FLAGS_SHARED_STACK          (1 << 2)        // Coro is a SharedStackCoroutineHeader, executing on a SharedStack.
+#define FLAGS_WAIT_FOREVER          (1 << 3)        // Compact header only: wakeuptime is at_the_end_of_time, which does not fit into 32 bits.
 
 // only needs the header, no need for stack.
 static CoroutineHeader     initialisercoro;
@@ -40,33 +55,333 @@ static uint32_t scheduler_stack[256]  __attribute__((aligned(32)));
 static_assert(sizeof(uint32_t*) == sizeof(uint32_t));
 // arm docs say that stack pointer should be 8 byte aligned, at a public interface.
 // FIXME ...which is not what this assert here checks. 
-static_assert((offsetof(struct Coroutine<>, stack) % 32) == 0);
+static_assert((offsetof(struct Coroutine<>, stack) % PICORO_STACK_ALIGNMENT) == 0);
 //static_assert(((int32_t) &((Coroutine<>*) 0)->stack[0]) % 8 == 0);
 
 
+#if PICORO_ROTATING_STACK_GUARD
+static int              rotatingguardregion = -1;
+static uint32_t         rotatingguardswitches = 0;
+static uint64_t         rotatingguardcycles = 0;
+#endif
+
 static alarm_id_t       soonestalarmid = 0;
 static absolute_time_t  soonesttime2wake = at_the_end_of_time;
 
+#if PICORO_SOFTWARE_TIMERS
+// sorted by wakeuptime, soonest first.
+// not reset in init_scheduler(), zero-init is an empty list already.
+static struct LinkedList    timers;
+// true while a timer callback runs. nothing in there must yield.
+static bool                 intimercallback = false;
+#endif
+
 // forward decls
-static void prime_scheduler_timer_locked();
+static bool prime_scheduler_timer_locked();
 static void wakeup_locked(CoroutineHeader* coro);
 static bool is_live(CoroutineHeader* storage, int stacksize);
 static void uninstall_stack_guard(void* stacktop);
+#if PICORO_ROTATING_STACK_GUARD
+static void rotate_stack_guard(CoroutineHeader* upnext);
+#endif
+#if PICORO_SHARED_STACKS
+static void swapin_shared_stack_locked(SharedStackCoroutineHeader* coro);
+#endif
+
+#if PICORO_COMPACT_HEADER
+static uint32_t             exitcode4scheduler;     // passes the exit code from yield_and_exit() to schedule_next(), which stores it in the dead stack.
+#endif
 
 
-static int64_t SCHEDFUNC(timeouthandler)(alarm_id_t id, CoroutineHeader* coro)
+// the header fields are different depending on PICORO_COMPACT_HEADER.
+// these helpers hide that, so that the scheduler logic itself can stay the same.
+
+/** @internal Returns &stack[0] of the coro. */
+static inline uint32_t* stack_top(const CoroutineHeader* coro)
 {
-    PROFILE_THIS_FUNC;
+#if PICORO_SHARED_STACKS
+    // the coro's stack pointer is only ever in the shared stack. (even if its contents are currently parked in the save area.)
+    if (coro->flags & FLAGS_SHARED_STACK)
+        return ((const SharedStackCoroutineHeader*) coro)->sharedstack->stack;
+#endif
+    return &((Coroutine<>*) coro)->stack[0];
+}
 
-    assert(coro != NULL);
+#if PICORO_COMPACT_HEADER
+static inline CoroutineHeader* coro_from_handle(coro_handle_t handle)
+{
+    if (handle == 0)
+        return NULL;
+    return (CoroutineHeader*) (SRAM_BASE + ((uint32_t) (handle - 1) << 3));
+}
 
-    critical_section_enter_blocking(&lock);
+static inline coro_handle_t handle_from_coro(const CoroutineHeader* coro)
+{
+    if (coro == NULL)
+        return 0;
+    // coros need to live in sram, otherwise the handle cannot reach them.
+    assert(((uint32_t) coro >= SRAM_BASE) && ((uint32_t) coro < SRAM_END));
+    assert(((uint32_t) coro & 0x07) == 0);
+    return (coro_handle_t) ((((uint32_t) coro - SRAM_BASE) >> 3) + 1);
+}
+static_assert(((SRAM_END - SRAM_BASE) >> 3) < 0xFFFF);
 
-    // this should be the case.
-    // but might not be guaranteed???
-    assert(&coro->llentry == ll_peek_head(&waiting4timer));
+static inline volatile uint32_t* get_sp(const CoroutineHeader* coro)
+{
+    return stack_top(coro) + coro->sp;
+}
 
-    wakeup_locked(coro);
+static inline void set_sp(CoroutineHeader* coro, volatile uint32_t* sp)
+{
+    coro->sp = (uint16_t) (sp - stack_top(coro));
+}
+
+static inline void set_sp_invalid(CoroutineHeader* coro)
+{
+    // zero is never a valid offset, there's always the initial frame on the stack.
+    coro->sp = 0;
+}
+
+static inline CoroutineHeader* get_waitchain(const Waitable* waitable)
+{
+    return coro_from_handle(waitable->waitchain);
+}
+
+static inline void set_waitchain(Waitable* waitable, CoroutineHeader* coro)
+{
+    waitable->waitchain = handle_from_coro(coro);
+}
+
+static inline absolute_time_t get_wakeuptime(const CoroutineHeader* coro)
+{
+    if (coro->flags & FLAGS_WAIT_FOREVER)
+        return at_the_end_of_time;
+    // everything we store is at most PICORO_COMPACT_MAX_SLEEP_US in the future, or a little bit in the past (overdue).
+    // so the signed difference to now gets us back the full timestamp.
+    const uint64_t now = time_us_64();
+    return from_us_since_boot(now + (int32_t) (coro->wakeuptime - (uint32_t) now));
+}
+
+static inline void set_wakeuptime(CoroutineHeader* coro, absolute_time_t t)
+{
+    if (is_at_the_end_of_time(t))
+    {
+        coro->flags |= FLAGS_WAIT_FOREVER;
+        coro->wakeuptime = 0;
+        return;
+    }
+
+    coro->flags &= ~FLAGS_WAIT_FOREVER;
+    coro->wakeuptime = (uint32_t) to_us_since_boot(t);
+}
+
+static inline void cl_init_list(CoroList* list)
+{
+    list->head = 0;
+    list->tail = 0;
+}
+
+static inline bool cl_is_empty(CoroList* list)
+{
+    if (list->head == 0)
+        return true;
+    assert(list->tail != 0);
+    return false;
+}
+
+static inline CoroutineHeader* cl_peek_head(CoroList* list)
+{
+    return coro_from_handle(list->head);
+}
+
+static inline void cl_push_back(CoroList* list, CoroutineHeader* coro)
+{
+    const coro_handle_t handle = handle_from_coro(coro);
+    // catch easy mistake: a coro can only be in one list at a time.
+    assert(handle != list->head);
+    assert(handle != list->tail);
+
+    coro->next = 0;
+    if (list->head == 0)
+    {
+        assert(list->tail == 0);
+        list->head = list->tail = handle;
+        return;
+    }
+
+    coro_from_handle(list->tail)->next = handle;
+    list->tail = handle;
+}
+
+static inline CoroutineHeader* cl_pop_front(CoroList* list)
+{
+    CoroutineHeader* coro = coro_from_handle(list->head);
+    if (coro == NULL)
+    {
+        assert(list->tail == 0);
+        return NULL;
+    }
+
+    list->head = coro->next;
+    if (list->head == 0)
+        list->tail = 0;
+
+    return coro;
+}
+
+// behaves fine if coro is not in the list, see ll_remove().
+static inline void cl_remove(CoroList* list, CoroutineHeader* coro)
+{
+    const coro_handle_t handle = handle_from_coro(coro);
+
+    for (coro_handle_t i = list->head, p = 0; i != 0; p = i, i = coro_from_handle(i)->next)
+    {
+        if (i == handle)
+        {
+            if (i == list->head)
+                list->head = coro->next;
+            if (i == list->tail)
+                list->tail = p;
+            if (p != 0)
+                coro_from_handle(p)->next = coro->next;
+            return;
+        }
+    }
+}
+
+// same as ll_sorted_insert() on wakeuptime. but comparing 32-bit timestamps needs to take wrap-around into account.
+static inline void cl_sorted_insert(CoroList* list, CoroutineHeader* coro)
+{
+    assert(!(coro->flags & FLAGS_WAIT_FOREVER));
+
+    const coro_handle_t handle = handle_from_coro(coro);
+
+    for (coro_handle_t i = list->head, p = 0; i != 0; p = i, i = coro_from_handle(i)->next)
+    {
+        CoroutineHeader* other = coro_from_handle(i);
+        // waiting forever is later than any real time.
+        if ((other->flags & FLAGS_WAIT_FOREVER) || ((int32_t) (coro->wakeuptime - other->wakeuptime) <= 0))
+        {
+            // insert before the current node i
+            if (p == 0)
+                list->head = handle;
+            else
+                coro_from_handle(p)->next = handle;
+            coro->next = i;
+            return;
+        }
+    }
+
+    cl_push_back(list, coro);
+}
+
+#else // if PICORO_COMPACT_HEADER
+
+static inline volatile uint32_t* get_sp(const CoroutineHeader* coro)
+{
+    return coro->sp;
+}
+
+static inline void set_sp(CoroutineHeader* coro, volatile uint32_t* sp)
+{
+    coro->sp = sp;
+}
+
+static inline void set_sp_invalid(CoroutineHeader* coro)
+{
+    coro->sp = (uint32_t*) 1;
+}
+
+static inline CoroutineHeader* get_waitchain(const Waitable* waitable)
+{
+    return waitable->waitchain;
+}
+
+static inline void set_waitchain(Waitable* waitable, CoroutineHeader* coro)
+{
+    waitable->waitchain = coro;
+}
+
+static inline absolute_time_t get_wakeuptime(const CoroutineHeader* coro)
+{
+    return coro->wakeuptime;
+}
+
+static inline void set_wakeuptime(CoroutineHeader* coro, absolute_time_t t)
+{
+    coro->wakeuptime = t;
+}
+
+static inline void cl_init_list(CoroList* list)
+{
+    ll_init_list(list);
+}
+
+static inline bool cl_is_empty(CoroList* list)
+{
+    return ll_is_empty(list);
+}
+
+static inline CoroutineHeader* cl_peek_head(CoroList* list)
+{
+    CoroutineHeader* coro = LL_ACCESS(coro, llentry, ll_peek_head(list));
+    return coro;
+}
+
+static inline void cl_push_back(CoroList* list, CoroutineHeader* coro)
+{
+    ll_push_back(list, &coro->llentry);
+}
+
+static inline CoroutineHeader* cl_pop_front(CoroList* list)
+{
+    CoroutineHeader* coro = LL_ACCESS(coro, llentry, ll_pop_front(list));
+    return coro;
+}
+
+static inline void cl_remove(CoroList* list, CoroutineHeader* coro)
+{
+    ll_remove(list, &coro->llentry);
+}
+
+static inline void cl_sorted_insert(CoroList* list, CoroutineHeader* coro)
+{
+    ll_sorted_insert<offsetof(CoroutineHeader, wakeuptime) - offsetof(CoroutineHeader, llentry), uint64_t>(list, &coro->llentry);
+}
+#endif // if PICORO_COMPACT_HEADER
+
+/** @internal Where the exit code is kept, once coro has exited. */
+static inline uint32_t* exitcode_slot(CoroutineHeader* coro)
+{
+#if PICORO_COMPACT_HEADER
+    // the stack is dead, we can recycle it.
+    // the bottom end is never covered by a stack guard.
+#if PICORO_SHARED_STACKS
+    if (coro->flags & FLAGS_SHARED_STACK)
+        return &((SharedStackCoroutineHeader*) coro)->savearea[0];
+#endif
+    return &((Coroutine<>*) coro)->stack[coro->stacksize - 1];
+#else
+    return &coro->exitcode;
+#endif
+}
+
+
+static int64_t SCHEDFUNC(timeouthandler)(alarm_id_t id, void* unused)
+{
+    PROFILE_THIS_FUNC;
+
+    critical_section_enter_blocking(&lock);
+
+    // the alarm is for whatever was due soonest. that might have been a coro (or more than one) or a software timer.
+    // timers are not run from here, that's schedule_next()'s job. getting it out of idle_lightsleep() is enough.
+    const uint64_t now = time_us_64();
+    for (CoroutineHeader* coro = cl_peek_head(&waiting4timer); coro != NULL; coro = cl_peek_head(&waiting4timer))
+    {
+        if (to_us_since_boot(get_wakeuptime(coro)) > now)
+            break;
+        wakeup_locked(coro);
+    }
 
     // we'll have to re-arm the timer with whatever the next up timeout is!
     soonesttime2wake = at_the_end_of_time;
@@ -80,31 +395,57 @@ static int64_t SCHEDFUNC(timeouthandler)(alarm_id_t id, CoroutineHeader* coro)
 }
 
 // assumes it gets called with lock held (or an equivalent of that).
-static void SCHEDFUNC(prime_scheduler_timer_locked)()
+// returns true if a software timer is overdue already: there's no alarm for it then, so don't go to sleep.
+static bool SCHEDFUNC(prime_scheduler_timer_locked)()
 {
     PROFILE_THIS_FUNC;
 
+    bool timeroverdue = false;
+
+#if PICORO_SOFTWARE_TIMERS
+    // needs to come before the coros: if the timer is overdue it resets soonesttime2wake, which would lose the alarm for a coro.
+    SoftwareTimer* timer = LL_ACCESS(timer, llentry, ll_peek_head(&timers));
+    if (timer != NULL)
+    {
+        if (to_us_since_boot(timer->wakeuptime) < to_us_since_boot(soonesttime2wake))
+        {
+            if (soonestalarmid != 0)
+                cancel_alarm(soonestalarmid);
+            soonesttime2wake = timer->wakeuptime;
+            soonestalarmid = add_alarm_at(soonesttime2wake, (alarm_callback_t) timeouthandler, NULL, false);
+            assert(soonestalarmid != -1);   // error
+            if (soonestalarmid == 0)
+            {
+                // overdue already. schedule_next() will run it next time round, no alarm needed for that.
+                soonesttime2wake = at_the_end_of_time;
+                timeroverdue = true;
+            }
+        }
+    }
+#endif
+
     while (true)
     {
-        CoroutineHeader* waiting4timeoutcoro = LL_ACCESS(waiting4timeoutcoro, llentry, ll_peek_head(&waiting4timer));
+        CoroutineHeader* waiting4timeoutcoro = cl_peek_head(&waiting4timer);
         if (waiting4timeoutcoro != NULL)
         {
-            if (to_us_since_boot(waiting4timeoutcoro->wakeuptime) < to_us_since_boot(soonesttime2wake))
+            const absolute_time_t wakeuptime = get_wakeuptime(waiting4timeoutcoro);
+            if (to_us_since_boot(wakeuptime) < to_us_since_boot(soonesttime2wake))
             {
                 if (soonestalarmid != 0)
                     cancel_alarm(soonestalarmid);
-                soonesttime2wake = waiting4timeoutcoro->wakeuptime;
+                soonesttime2wake = wakeuptime;
                 // FIXME: replace sdk alarm stuff with raw hw alarm.
-                soonestalarmid = add_alarm_at(soonesttime2wake, (alarm_callback_t) timeouthandler, waiting4timeoutcoro, false);
+                soonestalarmid = add_alarm_at(soonesttime2wake, (alarm_callback_t) timeouthandler, NULL, false);
                 assert(soonestalarmid != -1);   // error
                 if (soonestalarmid == 0)
                 {
                     // timeout has expired already, back on the run queue.
-                    ll_pop_front(&waiting4timer);
+                    cl_pop_front(&waiting4timer);
                     // it may be tempting to put waiting4timeoutcoro in the front of ready2run, given that it's already late for its turn.
                     // BUT: the head of ready2run may currently be executing! and we've been called from a timer irq.
                     // cannot just swap out the currently running task! that'd be preemptive multitasking. we are doing cooperative multitasking.
-                    ll_push_back(&ready2run, &waiting4timeoutcoro->llentry);
+                    cl_push_back(&ready2run, waiting4timeoutcoro);
                     // the equivalent of wakeup(). someone put the coro on the wait queue and inc'd sleepcount. if we take it off we need to dec!
                     waiting4timeoutcoro->sleepcount--;
                     // need to set up a timer for the coro waiting next up!
@@ -115,8 +456,101 @@ static void SCHEDFUNC(prime_scheduler_timer_locked)()
         }
         break;
     }
+
+    return timeroverdue;
+}
+
+#if PICORO_SOFTWARE_TIMERS
+// assumes it gets called with lock held. but will release it while a callback runs.
+static void SCHEDFUNC(run_due_timers_locked)()
+{
+    PROFILE_THIS_FUNC;
+
+    // only what's due now. otherwise a periodic timer whose callback takes longer than its period would never let us go.
+    const uint64_t now = time_us_64();
+
+    while (true)
+    {
+        SoftwareTimer* timer = LL_ACCESS(timer, llentry, ll_peek_head(&timers));
+        if (timer == NULL || to_us_since_boot(timer->wakeuptime) > now)
+            break;
+
+        ll_pop_front(&timers);
+        const timerfp_t func  = timer->func;
+        const uint32_t  param = timer->param;
+
+        // re-arm before calling: the callback might want to cancel or restart its own timer.
+        if (timer->period_us != 0)
+        {
+            // fixed schedule. if we are late by more than a period then skip the missed ones.
+            uint64_t next = to_us_since_boot(timer->wakeuptime) + timer->period_us;
+            if (next <= now)
+                next += ((now - next) / timer->period_us + 1) * timer->period_us;
+            update_us_since_boot(&timer->wakeuptime, next);
+            ll_sorted_insert<offsetof(SoftwareTimer, wakeuptime) - offsetof(SoftwareTimer, llentry), uint64_t>(&timers, &timer->llentry);
+        }
+        else
+            timer->armed = false;
+
+        critical_section_exit(&lock);
+        intimercallback = true;
+        func(param);
+        intimercallback = false;
+        critical_section_enter_blocking(&lock);
+    }
 }
 
+static void SCHEDFUNC(arm_timer)(SoftwareTimer* timer, absolute_time_t when, uint32_t period_us, timerfp_t func, uint32_t param)
+{
+    PROFILE_THIS_FUNC;
+
+    // needs the lock, i.e. the scheduler needs to be up and running.
+    assert(initialised);
+    assert(func != NULL);
+
+    critical_section_enter_blocking(&lock);
+    if (timer->armed)
+        ll_remove(&timers, &timer->llentry);
+
+    timer->wakeuptime = when;
+    timer->func = func;
+    timer->param = param;
+    timer->period_us = period_us;
+    timer->armed = true;
+    ll_sorted_insert<offsetof(SoftwareTimer, wakeuptime) - offsetof(SoftwareTimer, llentry), uint64_t>(&timers, &timer->llentry);
+
+    prime_scheduler_timer_locked();
+    critical_section_exit(&lock);
+}
+
+void SCHEDFUNC(start_timer_oneshot)(SoftwareTimer* timer, absolute_time_t when, timerfp_t func, uint32_t param)
+{
+    PROFILE_THIS_FUNC;
+
+    arm_timer(timer, when, 0, func, param);
+}
+
+void SCHEDFUNC(start_timer_periodic)(SoftwareTimer* timer, uint32_t period_us, timerfp_t func, uint32_t param)
+{
+    PROFILE_THIS_FUNC;
+
+    assert(period_us > 0);
+    arm_timer(timer, make_timeout_time_us(period_us), period_us, func, param);
+}
+
+void SCHEDFUNC(cancel_timer)(SoftwareTimer* timer)
+{
+    PROFILE_THIS_FUNC;
+
+    critical_section_enter_blocking(&lock);
+    if (timer->armed)
+        ll_remove(&timers, &timer->llentry);
+    timer->armed = false;
+    // no need to cancel the alarm. if it fires for nothing then that's just a spurious wakeup.
+    critical_section_exit(&lock);
+}
+#endif // if PICORO_SOFTWARE_TIMERS
+
 static void SCHEDFUNC(idle_lightsleep)()
 {
     PROFILE_THIS_FUNC;
@@ -143,12 +577,12 @@ extern "C" volatile uint32_t* SCHEDFUNC(schedule_next)(volatile uint32_t* curren
     critical_section_enter_blocking(&lock);
 
     // there should always be at least the currently running coro in ready2run.
-    assert(!ll_is_empty(&ready2run));
+    assert(!cl_is_empty(&ready2run));
 
     // scoping to avoid too much reach for currentcoro.
     {
-        struct CoroutineHeader* currentcoro = LL_ACCESS(currentcoro, llentry, ll_pop_front(&ready2run));
-        currentcoro->sp = current_sp;
+        struct CoroutineHeader* currentcoro = cl_pop_front(&ready2run);
+        set_sp(currentcoro, current_sp);
 #if PICORO_TRACK_EXECUTION_TIME
         currentcoro->timespentexecuting += absolute_time_diff_us(headrunningsince, get_absolute_time());
 #endif
@@ -165,64 +599,105 @@ extern "C" volatile uint32_t* SCHEDFUNC(schedule_next)(volatile uint32_t* curren
             // mark stack pointer as invalid.
             // trying to resume this will crash very quickly.
             // and, this makes sure that is_live() doesnt randomly stumble over old values we left in ram from a previous run.
-            currentcoro->sp = (uint32_t*) 1;
+            set_sp_invalid(currentcoro);
+
+#if PICORO_COMPACT_HEADER
+            // initialisercoro has got no stack to put this into. it's not like anyone would care for its exit code anyway.
+            if (currentcoro != &initialisercoro)
+                *exitcode_slot(currentcoro) = exitcode4scheduler;
+#endif
 
             // when a coro exits the semaphore count doesnt matter: anyone who waits will be woken up.
             currentcoro->waitable.semaphore = 0x7F;
-            if (currentcoro->waitable.waitchain)
+            if (get_waitchain(&currentcoro->waitable))
             {
-                wakeup_locked(currentcoro->waitable.waitchain);  // FIXME: do proper chain stuff!
-                currentcoro->waitable.waitchain = NULL;
+                wakeup_locked(get_waitchain(&currentcoro->waitable));  // FIXME: do proper chain stuff!
+                set_waitchain(&currentcoro->waitable, NULL);
             }
 
-#if PICO_USE_STACK_GUARDS
-            uninstall_stack_guard((void*) &((Coroutine<>*) currentcoro)->stack[0]);
+#if PICORO_SHARED_STACKS
+            if (currentcoro->flags & FLAGS_SHARED_STACK)
+            {
+                // a dead coro's stack is not worth saving. whoever runs next on the shared stack can have it straight away.
+                // the stack guard stays, it belongs to the shared stack.
+                SharedStackHeader* sharedstack = ((SharedStackCoroutineHeader*) currentcoro)->sharedstack;
+                if (sharedstack->owner == currentcoro)
+                    sharedstack->owner = NULL;
+            }
+            else
 #endif
+            {
+#if PICO_USE_STACK_GUARDS && !PICORO_ROTATING_STACK_GUARD
+                uninstall_stack_guard((void*) &((Coroutine<>*) currentcoro)->stack[0]);
+#endif
+            }
         }
 
         if (is_sleeping)
         {
             is_resched = false;
 
-            if (is_at_the_end_of_time(currentcoro->wakeuptime))
-                ll_push_back(&waiting4timer, &currentcoro->llentry);
+            if (is_at_the_end_of_time(get_wakeuptime(currentcoro)))
+                cl_push_back(&waiting4timer, currentcoro);
             else
-                ll_sorted_insert<offsetof(CoroutineHeader, wakeuptime) - offsetof(CoroutineHeader, llentry), uint64_t>(&waiting4timer, &currentcoro->llentry);
+                cl_sorted_insert(&waiting4timer, currentcoro);
         }
 
         if (is_resched)
-            ll_push_back(&ready2run, &currentcoro->llentry);
+            cl_push_back(&ready2run, currentcoro);
     } // scoping for var visibility
 
-    prime_scheduler_timer_locked();
+#if PICORO_SOFTWARE_TIMERS
+    run_due_timers_locked();
+#endif
+    // a timer can fall due in between the two. typically a periodic one whose callback took longer than the gap to its next slot.
+    bool timeroverdue = prime_scheduler_timer_locked();
 
-    while (ll_is_empty(&ready2run))
+    while (cl_is_empty(&ready2run))
     {
         // if we are spinning here because no coro is ready-to-run then we'd
         // expect there to be a coro waiting on a timeout maybe...
         // if there isn't it means we are stuck, will loop forever here.
         // during debugging, that is probably something we want to break on.
-        assert(!ll_is_empty(&waiting4timer));
+#if PICORO_SOFTWARE_TIMERS
+        assert(!cl_is_empty(&waiting4timer) || !ll_is_empty(&timers));
+#else
+        assert(!cl_is_empty(&waiting4timer));
+#endif
 
         critical_section_exit(&lock);
 
         check_debugger_attached();
-        idle_lightsleep();
+        // nothing would wake us up for an overdue timer.
+        if (!timeroverdue)
+            idle_lightsleep();
 
         critical_section_enter_blocking(&lock);
 
         // remember: this is all single threaded, so the only functions that could have modified the lists are interrupt handlers.
         // things like wakeup().
+
+#if PICORO_SOFTWARE_TIMERS
+        run_due_timers_locked();
+        timeroverdue = prime_scheduler_timer_locked();
+#endif
     }
 
-    struct CoroutineHeader* upnext = LL_ACCESS(upnext, llentry, ll_peek_head(&ready2run));
+    struct CoroutineHeader* upnext = cl_peek_head(&ready2run);
     assert(upnext->sleepcount <= 0);
+#if PICORO_SHARED_STACKS
+    if (upnext->flags & FLAGS_SHARED_STACK)
+        swapin_shared_stack_locked((SharedStackCoroutineHeader*) upnext);
+#endif
+#if PICORO_ROTATING_STACK_GUARD
+    rotate_stack_guard(upnext);
+#endif
 #if PICORO_TRACK_EXECUTION_TIME
     headrunningsince = get_absolute_time();
 #endif
     critical_section_exit(&lock);
     check_debugger_attached();
-    return upnext->sp;
+    return get_sp(upnext);
 }
 
 void __attribute__ ((naked)) SCHEDFUNC(yield1)(volatile uint32_t* schedsp)
@@ -270,6 +745,11 @@ void SCHEDFUNC(yield)()
 {
     PROFILE_THIS_FUNC;
 
+#if PICORO_SOFTWARE_TIMERS
+    // timer callbacks run on the scheduler stack already, yielding from there would trash it.
+    assert(!intimercallback);
+#endif
+
     // ugh, the asm syntax is beyond me... by calling another func we are at least (guaranteed?) to get this value in r0.
     // at least thats what the calling convention says.
     volatile uint32_t* schedsp = &scheduler_stack[count_of(scheduler_stack)];
@@ -296,26 +776,55 @@ static bool SCHEDFUNC(is_live)(CoroutineHeader* storage, int stacksize)
 {
     PROFILE_THIS_FUNC;
 
-    Coroutine<>*    ptrhelper = (Coroutine<>*) storage;
+#if PICORO_COMPACT_HEADER
+    // stack pointer should point to somewhere within the stack.
+    bool is_below_top    = storage->sp > 0;
+    bool is_above_bottom = storage->sp < stacksize;
+#else
+    const uint32_t* stacktop = stack_top(storage);
 
     // stack pointer should point to somewhere within the stack.
-    bool is_below_top    = ptrhelper->sp > &ptrhelper->stack[0];
-    bool is_above_bottom = ptrhelper->sp < &ptrhelper->stack[stacksize];
+    bool is_below_top    = storage->sp > &stacktop[0];
+    bool is_above_bottom = storage->sp < &stacktop[stacksize];
+#endif
 
     return is_below_top && is_above_bottom;
 }
 
 #if PICO_USE_STACK_GUARDS
+/** @internal Region attributes for a guard over the 32 bytes at stacktop. */
+static inline uint32_t stack_guard_rasr(const void* stacktop)
+{
+    // each region has chunks of 32 bytes for which the access permissions can be turned on or off.
+    // find out which 32-byte-chunk the requested address falls into.
+    const uint32_t    subregdisable = 0xFF ^ (1 << (((uint32_t) stacktop >> 5) & 0x07));
+
+    return
+        M0PLUS_MPU_RASR_ENABLE_BITS |       // enable
+        (7 << M0PLUS_MPU_RASR_SIZE_LSB) |   // size of region is 2^(7+1) = 256 bytes, the minimum.
+        (subregdisable << M0PLUS_MPU_RASR_SRD_LSB) |
+        0x10000000;       // attributes: no read/write access at all, and no instruction fetch.
+}
+
 static void SCHEDFUNC(uninstall_stack_guard)(void* stacktop)
 {
     PROFILE_THIS_FUNC;
 
-    static const int numregions = 8;
     const uint32_t   regionaddr = (uint32_t) stacktop & M0PLUS_MPU_RBAR_ADDR_BITS;
+    const uint32_t   claimed = get_claimed_mpu_regions();
 
     // find the region that we may have configured for that address.
-    for (int i = 0; i < numregions; ++i)
+    for (int i = 0; i < 8; ++i)
     {
+        // only look at regions we (or someone else going through mpu.h) claimed.
+        // the pico-sdk's own mainflow stack guard is none of our business.
+        if (!(claimed & (1 << i)))
+            continue;
+#if PICORO_ROTATING_STACK_GUARD
+        if (i == rotatingguardregion)
+            continue;
+#endif
+
         mpu_hw->rnr = i;
         // is region in use?
         if (mpu_hw->rasr & M0PLUS_MPU_RASR_ENABLE_BITS)
@@ -324,8 +833,7 @@ static void SCHEDFUNC(uninstall_stack_guard)(void* stacktop)
             // we specifically do not try to do funny games with multiple subregions.
             if (regionaddr == (mpu_hw->rbar & M0PLUS_MPU_RBAR_ADDR_BITS))
             {
-                // disable
-                mpu_hw->rasr = 0;
+                unclaim_mpu_region(i);
                 break;
             }
         }
@@ -336,46 +844,54 @@ static void SCHEDFUNC(install_stack_guard)(void* stacktop)
 {
     PROFILE_THIS_FUNC;
 
-#ifndef NDEBUG
-    // the pico cpu has 8 mpu regions.
-    const int numregions = (mpu_hw->type & M0PLUS_MPU_TYPE_DREGION_BITS) >> M0PLUS_MPU_TYPE_DREGION_LSB;
-    assert(numregions >= 8);
-#else
-    static const int numregions = 8;
-#endif
+    // all our alignment pragma and stuff should have made sure of this.
+    // stack address should be aligned to 32 byte or more.
+    assert(((uint32_t) stacktop & 0x01F) == 0);
 
-    // find us an unused region.
-    // the last region will have been used by the pico-sdk to setup the mainflow stack guard, see pico-sdk/src/rp2_common/pico_runtime/runtime.c
-    for (int i = 0; i < numregions; ++i)
-    {
-        mpu_hw->rnr = i;
-        // region already in use?
-        if (mpu_hw->rasr & M0PLUS_MPU_RASR_ENABLE_BITS)
-            continue;
+    const int region = claim_mpu_region();
+    // out of regions: this stack stays unguarded. PICORO_ROTATING_STACK_GUARD does not have that problem.
+    if (region == -1)
+        return;
+
+    // the region is addressed in chunks of 256 bytes.
+    // NOTE: we make no attempt at trying to minimise region use by squeezing multiple subregions into one.
+    const uint32_t    regionaddr = (uint32_t) stacktop & M0PLUS_MPU_RBAR_ADDR_BITS;
+
+    mpu_hw->rnr = region;
+    mpu_hw->rbar = regionaddr | 0 | 0;  // set addr but none of the other fields.
+    mpu_hw->rasr = stack_guard_rasr(stacktop);
+}
 
-        // region is free, use it!
+#if PICORO_ROTATING_STACK_GUARD
+// moves the one guard region over to upnext's stack.
+static void SCHEDFUNC(rotate_stack_guard)(CoroutineHeader* upnext)
+{
+    PROFILE_THIS_FUNC;
 
-        // all our alignment pragma and stuff should have made sure of this.
-        // stack address should be aligned to 32 byte or more.
-        assert(((uint32_t) stacktop & 0x01F) == 0);
+    // systick only if the app has it running, we don't want to take it over just for this.
+    const bool measure = systick_hw->csr & M0PLUS_SYST_CSR_ENABLE_BITS;
+    const uint32_t startcycles = systick_hw->cvr;
 
-        // the region is addressed in chunks of 256 bytes.
-        // NOTE: we make no attempt at trying to minimise region use by squeezing multiple subregions into one.
-        const uint32_t    regionaddr = (uint32_t) stacktop & M0PLUS_MPU_RBAR_ADDR_BITS;
-        // each region has chunks of 32 bytes for which the access permissions can be turned on or off.
-        // find out which 32-byte-chunk the requested address falls into.
-        const uint32_t    subregdisable = 0xFF ^ (1 << (((uint32_t) stacktop >> 5) & 0x07));
+    const void* stacktop = stack_top(upnext);
+    const uint32_t rbar = ((uint32_t) stacktop & M0PLUS_MPU_RBAR_ADDR_BITS) | M0PLUS_MPU_RBAR_VALID_BITS | rotatingguardregion;
+    const uint32_t rasr = stack_guard_rasr(stacktop);
 
-        mpu_hw->rbar = regionaddr | 0 | 0;  // set addr but none of the other fields.
-        mpu_hw->rasr = 
-            M0PLUS_MPU_RASR_ENABLE_BITS |       // enable
-            (7 << M0PLUS_MPU_RASR_SIZE_LSB) |   // size of region is 2^(7+1) = 256 bytes, the minimum.
-            (subregdisable << M0PLUS_MPU_RASR_SRD_LSB) |
-            0x10000000;       // attributes: no read/write access at all, and no instruction fetch.
+    // select our region before touching rasr: rnr is whatever was configured last (irq stack guard, flash blocker...)
+    // and clearing that one's rasr would silently switch it off.
+    mpu_hw->rnr = rotatingguardregion;
+    // disable first: the new address with the old subregion bits could otherwise block something for a moment.
+    mpu_hw->rasr = 0;
+    mpu_hw->rbar = rbar;
+    mpu_hw->rasr = rasr;
 
-        break;
+    if (measure)
+    {
+        // systick counts down, and wraps at 24 bits.
+        rotatingguardcycles += (startcycles - systick_hw->cvr) & M0PLUS_SYST_CVR_CURRENT_BITS;
+        rotatingguardswitches++;
     }
 }
+#endif
 #endif // if PICO_USE_STACK_GUARDS
 
 /** @internal */
@@ -385,48 +901,86 @@ static void fill_stack(uint32_t* stacktopptr, unsigned int stacksize)
         stacktopptr[i] = 0xdeadbeef;
 }
 
-void SCHEDFUNC(yield_and_start_ex)(coroutinefp_t func, uint32_t param, CoroutineHeader* storage, int stacksize)
+/**
+ * @internal
+ * @param sp points to *past* the last element of the stack.
+ * @return stack pointer for the new coro.
+ */
+static volatile uint32_t* init_stack_frame(volatile uint32_t* sp, coroutinefp_t func, uint32_t param)
 {
-    PROFILE_THIS_FUNC;
+    // "push" some values onto the stack.
+    // this needs to match what yield() does!
+    *--sp = (uint32_t) entry_point_wrapper;
+    *--sp = 0;
+    *--sp = 0;
+    *--sp = 0;
+    *--sp = 0;
+    *--sp = 0;
+    *--sp = 0;
+    *--sp = param;             // r1
+    *--sp = (uint32_t) func;   // r0
+    *--sp = 0;
+    *--sp = 0;
+    *--sp = 0;
+    *--sp = 0;
+    *--sp = 0;
+
+    return sp;
+}
 
-    if (is_live(storage, stacksize))
-    {
-        yield();
-        return;
-    }
+static void SCHEDFUNC(init_scheduler)()
+{
+    PROFILE_THIS_FUNC;
 
-    if (!initialised)
-    {
-        initialised = true;
-        ll_init_list(&ready2run);
-        ll_init_list(&waiting4timer);
-        critical_section_init(&lock);
+    initialised = true;
+    cl_init_list(&ready2run);
+    cl_init_list(&waiting4timer);
+    critical_section_init(&lock);
 
-        soonesttime2wake = at_the_end_of_time;
-        soonestalarmid = 0;
+    soonesttime2wake = at_the_end_of_time;
+    soonestalarmid = 0;
 
 #ifndef NDEBUG
-        fill_stack(&scheduler_stack[0], count_of(scheduler_stack));
+    fill_stack(&scheduler_stack[0], count_of(scheduler_stack));
 #endif
 
 #if PICO_USE_STACK_GUARDS
-        // we basically loose 32 bytes of otherwise usable stack space.
-        install_stack_guard((void*) &scheduler_stack[0]);
+    // we basically loose 32 bytes of otherwise usable stack space.
+    install_stack_guard((void*) &scheduler_stack[0]);
+#endif
+
+#if PICORO_ROTATING_STACK_GUARD
+    // one region for all the coros. schedule_next() moves it to whoever runs next.
+    rotatingguardregion = claim_mpu_region();
+    assert(rotatingguardregion != -1);
 #endif
 
 #if PICORO_TRACK_EXECUTION_TIME
-        headrunningsince = get_absolute_time();
+    headrunningsince = get_absolute_time();
 #endif
 
-        // i need initialisercoro in ready2run.head so that schedule_next() does the right thing.
-        // remember: head is currently executing.
-        // yield() and schedule_next() will write sp of the coro in ready2run.
-        // initialisercoro is basically just a bit dump to receive that sp we'll never need again.
-        ll_push_back(&ready2run, &initialisercoro.llentry);
-        // with this flag it'll fall off the end and never bother us again.
-        initialisercoro.flags |= FLAGS_DO_NOT_RESCHEDULE;
+    // i need initialisercoro in ready2run.head so that schedule_next() does the right thing.
+    // remember: head is currently executing.
+    // yield() and schedule_next() will write sp of the coro in ready2run.
+    // initialisercoro is basically just a bit dump to receive that sp we'll never need again.
+    cl_push_back(&ready2run, &initialisercoro);
+    // with this flag it'll fall off the end and never bother us again.
+    initialisercoro.flags |= FLAGS_DO_NOT_RESCHEDULE;
+}
+
+void SCHEDFUNC(yield_and_start_ex)(coroutinefp_t func, uint32_t param, CoroutineHeader* storage, int stacksize, capturefp_t capturefunc, void* capture, int capturesize)
+{
+    PROFILE_THIS_FUNC;
+
+    if (is_live(storage, stacksize))
+    {
+        yield();
+        return;
     }
 
+    if (!initialised)
+        init_scheduler();
+
     Coroutine<>*    ptrhelper = (Coroutine<>*) storage;
     assert(((int32_t) &ptrhelper->stack[0]) % 8 == 0);
 
@@ -434,7 +988,7 @@ void SCHEDFUNC(yield_and_start_ex)(coroutinefp_t func, uint32_t param, Coroutine
     fill_stack(&ptrhelper->stack[0], stacksize);
 #endif
 
-    storage->waitable.waitchain = NULL;
+    set_waitchain(&storage->waitable, NULL);
     storage->waitable.semaphore = 0;
     storage->flags = 0;
     storage->sleepcount = 0;
@@ -442,46 +996,165 @@ void SCHEDFUNC(yield_and_start_ex)(coroutinefp_t func, uint32_t param, Coroutine
     storage->timespentexecuting = 0;
 #endif
     storage->stacksize = stacksize;
-    const int bottom_element = stacksize;
+    int bottom_element = stacksize;
+
+    if (capturefunc != NULL)
+    {
+        // round up to 8 bytes to keep the stack pointer aligned.
+        const int capturewords = ((capturesize + 7) / 8) * 2;
+        assert(capturewords + 64 <= stacksize);
+
+        bottom_element -= capturewords;
+        capturefunc((void*) &ptrhelper->stack[bottom_element], capture);
+        param = (uint32_t) &ptrhelper->stack[bottom_element];
+    }
+
     // points to *past* the last element!
-    storage->sp = &ptrhelper->stack[bottom_element];
-    // "push" some values onto the stack.
-    // this needs to match what yield() does!
-    *--storage->sp = (uint32_t) entry_point_wrapper;
-    *--storage->sp = 0;
-    *--storage->sp = 0;
-    *--storage->sp = 0;
-    *--storage->sp = 0;
-    *--storage->sp = 0;
-    *--storage->sp = 0;
-    *--storage->sp = param;             // r1
-    *--storage->sp = (uint32_t) func;   // r0
-    *--storage->sp = 0;
-    *--storage->sp = 0;
-    *--storage->sp = 0;
-    *--storage->sp = 0;
-    *--storage->sp = 0;
+    set_sp(storage, init_stack_frame(&ptrhelper->stack[bottom_element], func, param));
 
     critical_section_enter_blocking(&lock);
-#if PICO_USE_STACK_GUARDS
+#if PICO_USE_STACK_GUARDS && !PICORO_ROTATING_STACK_GUARD
     // not sure whether we need to do this under lock.
     install_stack_guard((void*) &ptrhelper->stack[0]);
 #endif
-    ll_push_back(&ready2run, &storage->llentry);
+    cl_push_back(&ready2run, storage);
+    critical_section_exit(&lock);
+
+    yield();
+}
+
+#if PICORO_SHARED_STACKS
+void SCHEDFUNC(yield_and_start_shared_ex)(coroutinefp_t func, uint32_t param, SharedStackCoroutineHeader* storage, int saveareasize, SharedStackHeader* sharedstack)
+{
+    PROFILE_THIS_FUNC;
+
+    if ((storage->flags & FLAGS_SHARED_STACK) && is_live(storage, storage->stacksize))
+    {
+        yield();
+        return;
+    }
+
+    if (!initialised)
+        init_scheduler();
+
+    if (!sharedstack->isinitialised)
+    {
+        sharedstack->isinitialised = true;
+        sharedstack->owner = NULL;
+        assert(((int32_t) &sharedstack->stack[0]) % 8 == 0);
+
+#ifndef NDEBUG  // for debugging
+        fill_stack(&sharedstack->stack[0], sharedstack->stacksize);
+#endif
+
+#if PICO_USE_STACK_GUARDS && !PICORO_ROTATING_STACK_GUARD
+        // one guard for the whole group. it stays for as long as the shared stack lives, ie forever.
+        install_stack_guard((void*) &sharedstack->stack[0]);
+#endif
+    }
+
+    set_waitchain(&storage->waitable, NULL);
+    storage->waitable.semaphore = 0;
+    storage->flags = FLAGS_SHARED_STACK;
+    storage->sleepcount = 0;
+#if PICORO_TRACK_EXECUTION_TIME
+    storage->timespentexecuting = 0;
+#endif
+    storage->stacksize = sharedstack->stacksize;
+    storage->sharedstack = sharedstack;
+    storage->saveareasize = saveareasize;
+    memset(&storage->stats, 0, sizeof(storage->stats));
+    storage->stats.saveareawords = saveareasize;
+    storage->stats.sharedwords = sharedstack->stacksize;
+
+    // the initial frame goes straight into the save area, as if the coro had been running and got swapped out.
+    // writing it into the shared stack would trample over whoever owns that right now.
+    storage->savearea = ((SharedStackCoroutine<>*) storage)->savearea;
+    volatile uint32_t* savesp = init_stack_frame(&storage->savearea[14], func, param);
+    assert(savesp == &storage->savearea[0]);
+    storage->savedwords = 14;
+    storage->stats.maxlivewords = 14;
+    // once running, the coro's stack lives at the bottom of the shared stack.
+    set_sp(storage, &sharedstack->stack[sharedstack->stacksize - 14]);
+
+    critical_section_enter_blocking(&lock);
+    cl_push_back(&ready2run, storage);
     critical_section_exit(&lock);
 
     yield();
 }
 
+/** @internal */
+static void SCHEDFUNC(swapin_shared_stack_locked)(SharedStackCoroutineHeader* coro)
+{
+    PROFILE_THIS_FUNC;
+
+    SharedStackHeader* sharedstack = coro->sharedstack;
+    coro->stats.numswitches++;
+
+    // most of the time it'll be the same coro running again, or only coros with dedicated stacks in between.
+    if (sharedstack->owner == coro)
+        return;
+
+    const uint32_t  starttime = time_us_32();
+    const uint32_t* stackbottom = &sharedstack->stack[sharedstack->stacksize];
+
+    if (sharedstack->owner != NULL)
+    {
+        SharedStackCoroutineHeader* prev = (SharedStackCoroutineHeader*) sharedstack->owner;
+        // remember: we are running on scheduler_stack, so nothing is touching the shared stack right now.
+        const int livewords = stackbottom - (const uint32_t*) get_sp(prev);
+        // if this fires then the save area is too small for what the coro has on its stack right now.
+        // there's nothing sensible we could do about it here, prev will have to be given a bigger save area.
+        assert(livewords >= 0 && livewords <= prev->saveareasize);
+        // not only an assert: with NDEBUG the memcpy would quietly run over whatever comes after the save area.
+        if (livewords < 0 || livewords > prev->saveareasize)
+            __breakpoint();
+        memcpy(prev->savearea, (const void*) get_sp(prev), livewords * sizeof(uint32_t));
+        prev->savedwords = livewords;
+
+        prev->stats.numsaves++;
+        prev->stats.wordscopied += livewords;
+        if (livewords > prev->stats.maxlivewords)
+            prev->stats.maxlivewords = livewords;
+    }
+
+    // the live portion goes back to exactly where it was, so any pointers into the stack are still valid.
+    assert(stackbottom - (const uint32_t*) get_sp(coro) == coro->savedwords);
+    // same here: a trashed header would otherwise copy past the save area, or below the shared stack.
+    if ((stackbottom - (const uint32_t*) get_sp(coro) != coro->savedwords) || (coro->savedwords > coro->saveareasize))
+        __breakpoint();
+    memcpy((void*) get_sp(coro), coro->savearea, coro->savedwords * sizeof(uint32_t));
+    sharedstack->owner = coro;
+
+    coro->stats.numrestores++;
+    coro->stats.wordscopied += coro->savedwords;
+    // the time for saving prev is accounted to coro. it's the one that caused the copying.
+    coro->stats.copytime_us += time_us_32() - starttime;
+}
+
+void get_shared_stack_stats(const SharedStackCoroutineHeader* coro, SharedStackStats* stats)
+{
+    critical_section_enter_blocking(&lock);
+    *stats = coro->stats;
+    critical_section_exit(&lock);
+}
+#endif // if PICORO_SHARED_STACKS
+
 void SCHEDFUNC(yield_and_exit)(uint32_t exitcode)
 {
     PROFILE_THIS_FUNC;
 
     critical_section_enter_blocking(&lock);
     {
-        struct CoroutineHeader* self = LL_ACCESS(self, llentry, ll_peek_head(&ready2run));
+        struct CoroutineHeader* self = cl_peek_head(&ready2run);
         self->flags |= FLAGS_DO_NOT_RESCHEDULE;
+#if PICORO_COMPACT_HEADER
+        // we are still running on the stack that's going to store this. so schedule_next() will have to do it.
+        exitcode4scheduler = exitcode;
+#else
         self->exitcode = exitcode;
+#endif
         // note to self: schedule_next sets semaphore to max value, so everyone who's waiting can wake up.
     }
     critical_section_exit(&lock);
@@ -493,11 +1166,23 @@ void SCHEDFUNC(yield_and_wait4time)(absolute_time_t until)
 {
     PROFILE_THIS_FUNC;
 
+#if PICORO_COMPACT_HEADER
+    // wakeup times are only 32 bits wide. anything further out than that we sleep through in chunks.
+    while (!is_at_the_end_of_time(until) && (absolute_time_diff_us(get_absolute_time(), until) > PICORO_COMPACT_MAX_SLEEP_US))
+    {
+        const absolute_time_t chunkend = make_timeout_time_us(PICORO_COMPACT_MAX_SLEEP_US);
+        yield_and_wait4time(chunkend);
+        // woken up early by someone? then that counts for the whole wait, not just this chunk.
+        if (absolute_time_diff_us(get_absolute_time(), chunkend) > 0)
+            return;
+    }
+#endif
+
     critical_section_enter_blocking(&lock);
     {
-        struct CoroutineHeader* self = LL_ACCESS(self, llentry, ll_peek_head(&ready2run));
+        struct CoroutineHeader* self = cl_peek_head(&ready2run);
         self->sleepcount++;
-        self->wakeuptime = until;
+        set_wakeuptime(self, until);
     }
     critical_section_exit(&lock);
 
@@ -538,10 +1223,10 @@ void SCHEDFUNC(yield_and_wait4signal)(Waitable* other)
     struct CoroutineHeader* oldself = 0;
     critical_section_enter_blocking(&lock);
     {
-        oldself = LL_ACCESS(oldself, llentry, ll_peek_head(&ready2run));
+        oldself = cl_peek_head(&ready2run);
 
         // FIXME: for the time being, only 1 coro can wait. so better check that there isnt one waiting already.
-        assert(other->waitchain == NULL);
+        assert(get_waitchain(other) == NULL);
     }
     critical_section_exit(&lock);
 #endif
@@ -553,17 +1238,17 @@ void SCHEDFUNC(yield_and_wait4signal)(Waitable* other)
             if (other->semaphore > 0)
             {
                 // see signal(). this is currently handled by signal() and should always be the case.
-                assert(other->waitchain == NULL);
+                assert(get_waitchain(other) == NULL);
 
                 other->semaphore--;
                 critical_section_exit(&lock);
                 break;
             }
-            struct CoroutineHeader* self = LL_ACCESS(self, llentry, ll_peek_head(&ready2run));
+            struct CoroutineHeader* self = cl_peek_head(&ready2run);
             assert(self == oldself);
 
             // there is a "race" condition: coro1 and coro2 both wait for coro3 to exit, coro1 wakes first and rescheds coro3, then could happen that coro2 never wakes up.
-            other->waitchain = self;        // FIXME: do proper chain stuff!
+            set_waitchain(other, self);     // FIXME: do proper chain stuff!
         }
         critical_section_exit(&lock);
 
@@ -586,16 +1271,16 @@ static void SCHEDFUNC(wakeup_locked)(CoroutineHeader* coro)
     // beware: wakeup() might have been called too soon, before schedule_next() has had a chance to put it on waiting4timer.
     // e.g. from an irq handler. that actually happens quite often.
     coro->sleepcount--;
-    coro->wakeuptime = nil_time;
-    // ll_remove() behaves fine if coro is not actually on waiting4timer (yet), it just does nothing.
-    ll_remove(&waiting4timer, &coro->llentry);
+    set_wakeuptime(coro, nil_time);
+    // cl_remove() behaves fine if coro is not actually on waiting4timer (yet), it just does nothing.
+    cl_remove(&waiting4timer, coro);
 
     // the current coro might not have had a chance yet to call yield_and_wait4wakeup() and is thus still running.
-    if (ll_peek_head(&ready2run) != &coro->llentry)
+    if (cl_peek_head(&ready2run) != coro)
     {
         // FIXME: this could make coro the head of the queue! which to schedule_next() means it's running.
         //        i dont know yet what that will mean...
-        ll_push_back(&ready2run, &coro->llentry);
+        cl_push_back(&ready2run, coro);
     }
 }
 
@@ -618,7 +1303,7 @@ void SCHEDFUNC(signal)(Waitable* waitable)
 
     critical_section_enter_blocking(&lock);
     waitable->semaphore++;
-    if (waitable->waitchain != NULL)
+    if (get_waitchain(waitable) != NULL)
     {
         // FIXME: what happens if the same waitable is signaled twice?
         //        semaphore count goes up, sure.
@@ -626,14 +1311,40 @@ void SCHEDFUNC(signal)(Waitable* waitable)
         //        at face value that should be fine.
         //        but our impl for the runqueue might choke...
         // FIXME: i suppose the question is: who manages waitchain, signal() or yield_and_wait4other()...
-        wakeup_locked(waitable->waitchain);
+        wakeup_locked(get_waitchain(waitable));
 
         // ...putting this here makes things easy, for now. i think.
-        waitable->waitchain = NULL; // FIXME: do proper chain stuff!
+        set_waitchain(waitable, NULL);  // FIXME: do proper chain stuff!
     }
     critical_section_exit(&lock);
 }
 
+#if PICORO_ROTATING_STACK_GUARD
+void get_rotating_stack_guard_stats(uint32_t* numswitches, uint64_t* numcycles)
+{
+    critical_section_enter_blocking(&lock);
+    *numswitches = rotatingguardswitches;
+    *numcycles = rotatingguardcycles;
+    critical_section_exit(&lock);
+}
+#endif
+
+uint32_t get_exitcode(const CoroutineHeader* coro)
+{
+    // the exit code is only valid once the coro is dead.
+    assert(!is_live((CoroutineHeader*) coro, coro->stacksize));
+
+    return *exitcode_slot((CoroutineHeader*) coro);
+}
+
+CoroutineHeader* get_current_coroutine()
+{
+    critical_section_enter_blocking(&lock);
+    CoroutineHeader* self = cl_peek_head(&ready2run);
+    critical_section_exit(&lock);
+    return self;
+}
+
 bool SCHEDFUNC(check_debugger_attached)()
 {
     PROFILE_THIS_FUNC;
@@ -1,4 +1,7 @@
 #pragma once
+#include <new>
+#include <utility>
+#include <type_traits>
 #include "linkedlist.h"
 #include "pico/stdlib.h"
 
@@ -13,13 +16,67 @@
 #define PICORO_SCHEDFUNC_IN_RAM         0
 #endif
 
+// if defined then coroutines can opt into running on a stack shared with others, see SharedStack.
+// costs a flag check per context switch, so off by default.
+#ifndef PICORO_SHARED_STACKS
+#define PICORO_SHARED_STACKS            0
+#endif
+
+// if defined then CoroutineHeader is squeezed into 16 bytes (instead of 32):
+// coros are referred to by 16-bit handles, run queues link by handle and wakeup times are only 32 bits wide.
+// the catch: coros need to live in sram (no surprise there) and sleeps longer than PICORO_COMPACT_MAX_SLEEP_US are split up.
+#ifndef PICORO_COMPACT_HEADER
+#define PICORO_COMPACT_HEADER           0
+#endif
+
+#if PICORO_COMPACT_HEADER
+// half of the 32-bit range, so that there's plenty of room left to compare wakeup times that are overdue.
+#define PICORO_COMPACT_MAX_SLEEP_US     (1u << 30)
+#endif
+
+// if defined then SoftwareTimer callbacks can be used for light-weight periodic stuff, without spending a whole coro stack on it.
+// costs a check for due timers per context switch, so off by default.
+#ifndef PICORO_SOFTWARE_TIMERS
+#define PICORO_SOFTWARE_TIMERS          0
+#endif
+
+// stack guards need stacks on a 32-byte boundary (mpu subregion granularity). otherwise the 8 bytes of the arm abi will do.
+#if PICO_USE_STACK_GUARDS
+#define PICORO_STACK_ALIGNMENT          32
+#else
+#define PICORO_STACK_ALIGNMENT          8
+#endif
+
+// if defined then all coros share a single mpu region for their stack guard, which schedule_next() moves to the coro that runs next.
+// instead of one region per coro, which run out quickly: there are only 8 and others want some too.
+// costs a handful of cycles per context switch, see get_rotating_stack_guard_stats().
+#ifndef PICORO_ROTATING_STACK_GUARD
+#define PICORO_ROTATING_STACK_GUARD     0
+#endif
+#if PICORO_ROTATING_STACK_GUARD && !PICO_USE_STACK_GUARDS
+#error PICORO_ROTATING_STACK_GUARD needs PICO_USE_STACK_GUARDS
+#endif
+
 
 // forward decl
 struct CoroutineHeader;
 
+#if PICORO_COMPACT_HEADER
+/**
+ * @brief Refers to a coroutine by its position in sram, in units of 8 bytes.
+ * That way all of sram is the table the handle indexes into, and there's no need for a separate one.
+ * Zero means "no coroutine", like NULL.
+ */
+typedef uint16_t coro_handle_t;
+#endif
+
 struct Waitable
 {
+#if PICORO_COMPACT_HEADER
+    coro_handle_t       waitchain;
+#else
     CoroutineHeader*    waitchain;
+#endif
     // FIXME: i'm not sure i want a counting semaphore... i'm pretty sure i dont want one!
     int8_t              semaphore;      // >0 means signalled.
 
@@ -31,16 +88,30 @@ struct Waitable
     Waitable& operator=(const Waitable& assign) = delete;
 };
 
+#if PICORO_COMPACT_HEADER
+// handles count in units of 8 bytes, so every header needs to start on such a boundary.
+struct __attribute__((aligned(8))) CoroutineHeader
+#else
 struct CoroutineHeader
+#endif
 {
     Waitable                waitable;
+#if PICORO_COMPACT_HEADER
+    uint16_t                sp;         // in units of uint32_t, relative to the top of the stack (ie &stack[0]).
+    coro_handle_t           next;       // instead of a LinkedListEntry.
+    uint32_t                wakeuptime; // lower 32 bits of an absolute_time_t, only meaningful relative to "now".
+#else
     volatile uint32_t*      sp;
     struct LinkedListEntry  llentry;
     absolute_time_t         wakeuptime;
+#endif
 #if PICORO_TRACK_EXECUTION_TIME
     uint64_t                timespentexecuting; // in microseconds.
 #endif
-    uint32_t                exitcode;   // there's prob a way that we could recycle the stack to store this, given that the stack is no longer useful (coro exited, remember)
+#if !PICORO_COMPACT_HEADER
+    // the compact header recycles the (by then dead) stack to store this.
+    uint32_t                exitcode;
+#endif
     uint16_t                stacksize;  // ideally we wouldnt need this one.
     uint8_t                 flags;
     int8_t                  sleepcount;
@@ -55,6 +126,9 @@ struct CoroutineHeader
     CoroutineHeader(const CoroutineHeader& copy) = delete;
     CoroutineHeader& operator=(const CoroutineHeader& assign) = delete;
 };
+#if PICORO_COMPACT_HEADER && !PICORO_TRACK_EXECUTION_TIME
+static_assert(sizeof(CoroutineHeader) == 16);
+#endif
 
 template <int StackSize_ = 256>
 struct Coroutine : CoroutineHeader
@@ -65,7 +139,7 @@ struct Coroutine : CoroutineHeader
     // BUT: if you want to use printf you need lots more than 128*4=512 bytes of stack!
     // the absolute minium stack size is 64*4=256 bytes. which is just enough to call yield_and_start() to start off a bunch of other coros.
     // BEWARE: the time/timer/sleep functions in the pico-sdk need a lot of stack! 150*4=600 bytes or more!
-    uint32_t       stack[StackSize]  __attribute__((aligned(32)));
+    uint32_t       stack[StackSize]  __attribute__((aligned(PICORO_STACK_ALIGNMENT)));
 
 #if PICO_USE_STACK_GUARDS
     // if we have stack guards then we loose 32 bytes of stack space (the guard area).
@@ -75,16 +149,119 @@ struct Coroutine : CoroutineHeader
 #endif
 };
 
+#if PICORO_SHARED_STACKS
+/**
+ * @brief Execution stack that a group of coroutines takes turns on.
+ * Only one coroutine of the group has its stack contents in here at any one time. All the others have
+ * their live portion (from their sp to the bottom of the stack) parked in their own, much smaller, save area.
+ * The copying happens in the scheduler, only when a different member of the group is about to run.
+ */
+struct SharedStackHeader
+{
+    CoroutineHeader*    owner;      // whose stack contents are currently in stack[]. NULL if nobody's.
+    uint32_t*           stack;
+    uint16_t            stacksize;  // in units of uint32_t.
+    bool                isinitialised;
+
+    SharedStackHeader(uint32_t* stack_, int stacksize_)
+        : owner(NULL), stack(stack_), stacksize(stacksize_), isinitialised(false)
+    {
+    }
+    SharedStackHeader(const SharedStackHeader& copy) = delete;
+    SharedStackHeader& operator=(const SharedStackHeader& assign) = delete;
+};
+
+template <int StackSize_ = 1024>
+struct SharedStack : SharedStackHeader
+{
+    static constexpr int StackSize = StackSize_;
+
+    // needs to be as big as the deepest callstack of any coroutine in the group.
+    uint32_t       stackstorage[StackSize]  __attribute__((aligned(PICORO_STACK_ALIGNMENT)));
+
+    SharedStack()
+        : SharedStackHeader(&stackstorage[0], StackSize)
+    {
+    }
+
+#if PICO_USE_STACK_GUARDS
+    static_assert(StackSize >= 64 + (32 / 4));
+#else
+    static_assert(StackSize >= 64);
+#endif
+};
+
+/**
+ * @brief Numbers to decide whether a coroutine is better off with a dedicated or a shared stack.
+ * Memory saved is (sharedwords - saveareawords) * 4 bytes, compared to giving the coro a dedicated stack of the same depth.
+ * What that costs is wordscopied and copytime_us.
+ * All sizes are in units of uint32_t.
+ */
+struct SharedStackStats
+{
+    uint32_t    numswitches;    // how often the coro has been scheduled.
+    uint32_t    numsaves;       // how often its live stack had to be parked in the save area...
+    uint32_t    numrestores;    // ...and how often it had to be copied back.
+    uint32_t    wordscopied;    // total, both directions.
+    uint32_t    copytime_us;    // total, both directions. rounded to microseconds per copy, so only ballpark.
+    uint16_t    maxlivewords;   // high-water mark of the live stack, ie what the save area needs to be able to hold.
+    uint16_t    saveareawords;
+    uint16_t    sharedwords;
+};
+
+struct SharedStackCoroutineHeader : CoroutineHeader
+{
+    SharedStackHeader*      sharedstack;
+    uint32_t*               savearea;
+    uint16_t                saveareasize;   // capacity, in units of uint32_t.
+    uint16_t                savedwords;     // how much of savearea is currently in use.
+    SharedStackStats        stats;
+
+    SharedStackCoroutineHeader()
+        : sharedstack(NULL), savearea(NULL), saveareasize(0), savedwords(0)
+    {
+    }
+};
+
+/**
+ * @brief Coroutine that executes on a SharedStack, instead of its own.
+ * The save area needs to hold whatever the coro has on its stack whenever it yields (plus 14 words for the registers).
+ * Blocking in shallow functions keeps this small. Use get_shared_stack_stats() to find the right size.
+ *
+ * @warning Never hand out pointers to stack variables of a shared-stack coroutine to anyone else (other coroutines,
+ *          drivers, irq handlers)! While the coro is not running, that memory belongs to another member of the group.
+ *          The usual "I2CRequest req; bool success; queue_cmds(&req, ..., &success);" pattern will corrupt someone else's stack.
+ */
+template <int SaveAreaSize_ = 64>
+struct SharedStackCoroutine : SharedStackCoroutineHeader
+{
+    static constexpr int SaveAreaSize = SaveAreaSize_;
+
+    uint32_t       savearea[SaveAreaSize];
+
+    // minimum is what the scheduler pushes on first start.
+    static_assert(SaveAreaSize >= 14);
+};
+#endif // if PICORO_SHARED_STACKS
+
 /**
  * Entry-point for our coroutine.
  * Looks like \code uint32_t myfunc(uint32_t param) \endcode
- * The return value is the exit code, which can be queried later via FIXME.
+ * The return value is the exit code, which can be queried later via get_exitcode().
  */
 typedef uint32_t (*coroutinefp_t)(uint32_t);
 static_assert(sizeof(uint32_t) >= sizeof(void*));
 
-// stacksize unit is number of uint32_ts
-extern void yield_and_start_ex(coroutinefp_t func, uint32_t param, CoroutineHeader* storage, int stacksize);
+/**
+ * Constructs a copy of the object at src into the (uninitialised) memory at dst.
+ * Used to move a callable's captures onto the coroutine's stack, see yield_and_start(F&&, Coroutine<>*).
+ */
+typedef void (*capturefp_t)(void* dst, void* src);
+
+// stacksize unit is number of uint32_ts, capturesize is bytes.
+// if capturefunc is non-null then it's called to put capturesize bytes at the bottom end of the new coro's stack.
+// the coro's entry point will then get a pointer to that as its param (instead of param).
+extern void yield_and_start_ex(coroutinefp_t func, uint32_t param, CoroutineHeader* storage, int stacksize, capturefp_t capturefunc = NULL, void* capture = NULL, int capturesize = 0);
 
 /**
  * @brief Exits the currently running coroutine by taking it off the scheduler and yielding.
@@ -93,6 +270,19 @@ extern void yield_and_start_ex(coroutinefp_t func, uint32_t param, CoroutineHead
  * @param exitcode 
  */
 extern void yield_and_exit(uint32_t exitcode = 0);
+
+/**
+ * @brief Returns the value that an exited coroutine passed to yield_and_exit() (or returned from its entry point).
+ * @warning Meaningless while the coroutine is still live.
+ */
+extern uint32_t get_exitcode(const CoroutineHeader* coro);
+
+/**
+ * @brief Returns the coroutine that's running right now, i.e. the caller.
+ * Call from a coro only (from an IRQ handler the answer is just whoever got interrupted).
+ */
+extern CoroutineHeader* get_current_coroutine();
+
 extern void yield_and_wait4time(absolute_time_t until);
 extern void yield_and_wait4wakeup();
 extern void yield();
@@ -117,6 +307,71 @@ void yield_and_start(coroutinefp_t func, uint32_t param, struct Coroutine<StackS
     yield_and_start_ex(func, param, storage, StackSize);
 }
 
+/** @internal Glue for yield_and_start(F&&, Coroutine<>*). */
+template <typename Callable, typename F>
+void construct_callable_capture(void* dst, void* src)
+{
+    // forward: rvalues get moved in, lvalues get copied.
+    new (dst) Callable(std::forward<F>(*(typename std::remove_reference<F>::type*) src));
+}
+
+/** @internal Glue for yield_and_start(F&&, Coroutine<>*). */
+template <typename Callable>
+uint32_t callable_entry_point(uint32_t param)
+{
+    Callable*   callable = (Callable*) param;
+    uint32_t    exitcode = 0;
+    if constexpr (std::is_void<decltype((*callable)())>::value)
+        (*callable)();
+    else
+        exitcode = (*callable)();
+
+    // captures die with the coroutine.
+    callable->~Callable();
+    return exitcode;
+}
+
+/**
+ * @brief Same as yield_and_start() but takes any callable, e.g. a lambda with captures.
+ * The callable is moved (or copied, if it's an lvalue) into the bottom end of the coroutine's own stack,
+ * i.e. per-coro state does not need to live in globals and there's no heap involved.
+ * It needs to be callable without arguments and return either void or something convertible to uint32_t (the exit code).
+ * Captures are destroyed when the callable returns.
+ * 
+ * @warning yield_and_exit() does not return, so captures will not be destroyed if the coro exits that way.
+ * @warning The captures take away from the stack size. Keep them small.
+ */
+template <int StackSize, typename F>
+void yield_and_start(F&& func, struct Coroutine<StackSize>* storage)
+{
+    typedef typename std::decay<F>::type    Callable;
+    static_assert(alignof(Callable) <= 8, "stack only guarantees 8-byte alignment");
+    // leave at least the minimum stack size of 64 words for actually running the coro.
+    static_assert(sizeof(Callable) + 64 * sizeof(uint32_t) <= StackSize * sizeof(uint32_t), "captures too big for the stack");
+
+    yield_and_start_ex(callable_entry_point<Callable>, 0, storage, StackSize, construct_callable_capture<Callable, F>, (void*) &func, sizeof(Callable));
+}
+
+#if PICORO_SHARED_STACKS
+// saveareasize unit is number of uint32_ts
+extern void yield_and_start_shared_ex(coroutinefp_t func, uint32_t param, SharedStackCoroutineHeader* storage, int saveareasize, SharedStackHeader* sharedstack);
+
+/**
+ * @brief Same as yield_and_start() but the new coroutine will run on sharedstack.
+ * Any number of coroutines can share the same stack.
+ */
+template <int SaveAreaSize, int StackSize>
+void yield_and_start(coroutinefp_t func, uint32_t param, struct SharedStackCoroutine<SaveAreaSize>* storage, struct SharedStack<StackSize>* sharedstack)
+{
+    yield_and_start_shared_ex(func, param, storage, SaveAreaSize, sharedstack);
+}
+
+/**
+ * @brief Copies out the shared-stack statistics for coro.
+ */
+extern void get_shared_stack_stats(const SharedStackCoroutineHeader* coro, SharedStackStats* stats);
+#endif
+
 /**
  * @brief Yields execution until "other" has exited/signaled.
  */
@@ -139,6 +394,53 @@ extern void wakeup(CoroutineHeader* coro);
 // Beware: do not mix wakeup() and signal()! I.e. yield_and_wait4wakeup() and wakeup() is fine; yield_and_wait4signal() and signal() is fine; but don't mix!
 extern void signal(Waitable* waitable);
 
+#if PICORO_SOFTWARE_TIMERS
+/**
+ * Callback for SoftwareTimer.
+ * Runs on the scheduler's stack, in between two coros. So keep it short and do not block:
+ * calling any of the yield() functions from here is a bug (and will assert).
+ * wakeup(), signal() and the timer functions are fine to call.
+ */
+typedef void (*timerfp_t)(uint32_t param);
+
+/**
+ * A callback that the scheduler runs when its time has come.
+ * Shares the scheduler's timer queue, so costs only the few bytes here (instead of a whole Coroutine<>).
+ * Treat as opaque.
+ */
+struct SoftwareTimer
+{
+    struct LinkedListEntry  llentry;
+    absolute_time_t         wakeuptime;     // needs to follow llentry, for ll_sorted_insert().
+    timerfp_t               func;
+    uint32_t                param;
+    uint32_t                period_us;      // zero for one-shot.
+    bool                    armed;
+};
+
+/**
+ * @brief Runs func(param) once, at (or shortly after) when.
+ * (Re-)starting a timer that is already armed moves it to the new time.
+ * Safe to call from IRQ handler.
+ */
+extern void start_timer_oneshot(SoftwareTimer* timer, absolute_time_t when, timerfp_t func, uint32_t param);
+
+/**
+ * @brief Runs func(param) every period_us, the first time period_us from now.
+ * Runs on a fixed schedule (not accumulating lateness). If the scheduler falls behind by more than a period
+ * the missed runs are skipped, they do not pile up.
+ * Safe to call from IRQ handler.
+ */
+extern void start_timer_periodic(SoftwareTimer* timer, uint32_t period_us, timerfp_t func, uint32_t param);
+
+/**
+ * @brief Disarms timer. Does nothing if it was not armed.
+ * Fine to call from the timer's own callback, e.g. to stop a periodic timer.
+ * Safe to call from IRQ handler. But note that a timer that is already due might still run one last time.
+ */
+extern void cancel_timer(SoftwareTimer* timer);
+#endif
+
 // FIXME: considered but prob a bad idea. too much caller specific application logic needs to happen in the right order to not loose an irq.
 //extern void yield_and_wait4irq(uint irqnum, volatile bool* handlercalledalready);
 
@@ -152,6 +454,15 @@ extern void signal(Waitable* waitable);
  */
 extern bool check_debugger_attached();
 
+#if PICORO_ROTATING_STACK_GUARD
+/**
+ * @brief How many context switches moved the stack guard, and the cycles that took in total.
+ * Only counts while SysTick is running (with the processor clock, and not wrapping more than once per switch).
+ * The app needs to start it, picoro will not.
+ */
+extern void get_rotating_stack_guard_stats(uint32_t* numswitches, uint64_t* numcycles);
+#endif
+
 /**
  * @brief Sets up a separate stack for IRQs.
  * SP_main (aka MSP) will be used for IRQs.
@@ -4,11 +4,19 @@
 #include "hardware/dma.h"
 #include "hardware/sync.h"
 #include "coroutine.h"
+#if PICORO_I2C_SIM
+#include "i2c.h"
+#include "i2csim.h"
+#endif
 
 
 struct Coroutine<>    block1;
 struct Coroutine<>    block2;
 struct Coroutine<>    block3;
+struct Coroutine<>    block4;
+#if PICORO_I2C_SIM
+struct Coroutine<>    block5;
+#endif
 
 static int dmawritechannel = -1;
 
@@ -69,6 +77,56 @@ static uint32_t coroutine_3(uint32_t param)
     return 0;
 }
 
+#if PICORO_I2C_SIM
+static I2CSimBus        simbus;
+static I2CSimRegFile    simregs;
+static I2CSimFaulty     simfaulty;
+
+/** Example coro to run the i2c driver against a simulated bus: a nak and the abort that follows, then a full queue. */
+static uint32_t coroutine_5(uint32_t param)
+{
+    i2csim_init_bus(&simbus, 400000);
+    i2csim_init_regfile(&simregs, 0x68);
+    // every 4th address phase gets nak'd, and 2 us of clock stretching per byte.
+    i2csim_init_faulty(&simfaulty, &simregs, 4, 0, 2);
+    i2csim_add_device(&simbus, &simfaulty);
+    attach_i2c_sim(i2c0, &simbus);
+
+    static constexpr auto   readregs = i2c_read_regs<2>(0x10);
+
+    // nobody at 0x69: the controller aborts, the driver carries on with the next one.
+    I2CRequest  req;
+    uint8_t     result[2];
+    bool        success = true;
+    yield_and_wait4signal(queue_cmds(&req, i2c0, 0x69, readregs, result, &success));
+    printf("i2csim: 0x69 %s\n", success ? "acked?!" : "aborted");
+
+    // more than the queue takes, without waiting in between. with PICORO_I2C_QUEUE_LIMIT below that, queue_cmds() yields
+    // until the driver has made room, and that shows up as numblocked.
+    static I2CRequest   reqs[16];
+    static uint8_t      results[16][2];
+    static bool         successes[16];
+    Waitable*           done[16];
+    for (int i = 0; i < 16; ++i)
+        done[i] = queue_cmds(&reqs[i], i2c0, 0x68, readregs, results[i], &successes[i]);
+    int numfailed = 0;
+    for (int i = 0; i < 16; ++i)
+    {
+        yield_and_wait4signal(done[i]);
+        numfailed += successes[i] ? 0 : 1;
+    }
+
+    AsyncQueueStats queuestats;
+    get_i2c_queue_stats(i2c0, &queuestats);
+    I2CSimStats     simstats;
+    i2csim_get_stats(&simbus, &simstats);
+    printf("i2csim: %d of 16 failed, %lu blocked, max depth %lu, %lu aborts (%lu addr naks), %llu us busy\n",
+        numfailed, queuestats.numblocked, queuestats.maxdepth, simstats.numaborts, simstats.numaddrnaks, simstats.busytime_us);
+
+    return 0;
+}
+#endif
+
 /** Example coro to count down, exit when done. */
 static uint32_t coroutine_2(uint32_t param)
 {
@@ -89,6 +147,21 @@ static uint32_t coroutine_1(uint32_t param)
 {
     yield_and_start(coroutine_2, 50, &block2);
 
+    // example for a lambda coro: the captures live on block4's stack, no need for globals.
+    yield_and_start([count = 20, delay_ms = 700]() mutable
+    {
+        while (count > 0)
+        {
+            printf("C: %d\n", count);
+            --count;
+            yield_and_wait4time(make_timeout_time_ms(delay_ms));
+        }
+    }, &block4);
+
+#if PICORO_I2C_SIM
+    yield_and_start(coroutine_5, 0, &block5);
+#endif
+
     while (param > 0)
     {
         printf("A: %ld\n", param);
@@ -6,8 +6,15 @@
 #include <string.h>
 #include "coroutine.h"
 #include "profiler.h"
-#define RINGBUFFER_SIZE 4
-#include "ringbuffer.h"
+#include "requestqueue.h"
+#if PICORO_I2C_SIM
+#include "i2csim.h"
+#endif
+#if PICORO_I2C_TIMEOUT
+#include "hardware/gpio.h"
+#include "hardware/resets.h"
+#include "pico/time.h"
+#endif
 
 
 #if PICORO_I2CDRV_IN_RAM
@@ -22,41 +29,143 @@
 
 static const unsigned int        dmairq[2] = {1, 1};
 
-struct CmdRingbufferEntry
+#if PICORO_I2C_CHAIN_DMA
+static_assert(PICORO_I2C_CHAIN_SETTLE >= 11, "the settle needs to cover the last byte and the stop, see run_chain()");
+
+// a chain is a list of "pokes": small dma transfers that each write a few words somewhere (an i2c register, a dma channel's registers, a flag).
+// the control channel copies one poke at a time into the poke channel's registers, which triggers it. the poke channel chains back when done.
+// the poke that kicks off a transaction's data channels does not chain back though: the data channel that finishes last does that.
+struct ChainPoke
+{
+    const volatile void*    read_addr;
+    volatile void*          write_addr;
+    uint32_t                transfer_count;
+    uint32_t                ctrl;           // all zero is a null trigger, that's where the chain stops.
+};
+
+// whatever the pokes of one transaction read from.
+struct ChainTransaction
 {
-    int                 numcmds;
-    const uint16_t*     cmds;
-    int                 numresults;
-    uint8_t*            results;
-    Waitable            waitable;
-    bool*               success;
-    int8_t              address;
+    uint32_t        tar;
+    uint32_t        readprog[4];    // read_addr, write_addr, transfer_count, ctrl_trig of the read channel.
+    uint32_t        writeprog[4];   // same for the write channel.
+    uint32_t        done;           // index + 1, ends up in ChainState::done.
 };
 
+// fence, settle, done marker, force irq, tar, enable, read program, write program.
+#define CHAIN_POKES_PER_TRANSACTION     8
+// fence, settle, done marker, force irq, terminator.
+#define CHAIN_POKES_AT_END              5
+
+struct ChainState
+{
+    int                 controlchannel;
+    int                 pokechannel;
+    int                 settletimer;
+
+    // ctrl values for the different kinds of pokes.
+    uint32_t            ctrlfence;
+    uint32_t            ctrlsettle;
+    uint32_t            ctrlword;
+    uint32_t            ctrlprog;
+    uint32_t            ctrlproglast;
+
+    // constants for pokes to read from.
+    uint32_t            zero;
+    uint32_t            one;
+    uint32_t            forceirq;
+
+    volatile uint32_t   done;           // how many transactions of the running chain have gone through.
+    volatile bool       active;
+
+    ChainTransaction    transactions[PICORO_I2C_CHAIN_MAX];
+    ChainPoke           pokes[PICORO_I2C_CHAIN_MAX * CHAIN_POKES_PER_TRANSACTION + CHAIN_POKES_AT_END];
+};
+#endif
+
 static struct DriverState
 {
     int                 dmareadchannel;
     int                 dmawritechannel;
 
-    RingBuffer          cmdindices;
+    AsyncQueue<I2CRequest>  queue;
     Coroutine<256>      i2cdriverblock;
-    Waitable            newcmdswaitable;
-
-    CmdRingbufferEntry  cmdringbuffer[RINGBUFFER_SIZE];
 
     volatile bool*      wasaborted;
     volatile bool       datareadcaused;
     volatile bool       datawritecaused;
     volatile bool       haswokenup;
 
-    bool                drivershouldexit;
+#if PICORO_I2C_CHAIN_DMA
+    dma_channel_config  readcfg;
+    dma_channel_config  writecfg;
+    ChainState          chain;
+    I2CChainStats       stats;
+#endif
+
+#if PICORO_I2C_INLINE
+    volatile bool       inlinebusy;
+    int                 inlinemaxcmds;
+    I2CInlineStats      inlinestats;
+#endif
+
+#if PICORO_I2C_SIM
+    I2CSimBus*          sim;
+    bool                simrunning;
+#endif
+
+#if PICORO_I2C_TIMEOUT
+    volatile bool       timedout;
+    uint32_t            timeout_us;
+    int                 sdapin;         // -1 if unknown.
+    int                 sclpin;
+    I2CRecoveryStats    recoverystats;
+#endif
+
+#if PICORO_I2C_STATS
+    volatile uint32_t   abortsource;    // tx_abrt_source of the failed transfer, from the irq handler.
+    uint32_t            bustime_us;     // of the request in flight, summed over its rounds.
+    I2CTrafficStats     busstats;
+    uint32_t            numuntracked;
+    int                 numaddresses;
+    I2CAddressStats     addressstats[PICORO_I2C_STATS_MAXADDRESSES];
+    HashTable<I2CAddressStats, uint8_t, &I2CAddressStats::address, PICORO_I2C_STATS_MAXADDRESSES * 2>  addresstable;
+#endif
 
     DriverState()
         : dmareadchannel(-1)
+#if PICORO_I2C_INLINE
+        , inlinebusy(false), inlinemaxcmds(PICORO_I2C_INLINE_MAXCMDS)
+#endif
+#if PICORO_I2C_SIM
+        , sim(NULL), simrunning(false)
+#endif
+#if PICORO_I2C_TIMEOUT
+        , timedout(false), timeout_us(PICORO_I2C_TIMEOUT_US), sdapin(-1), sclpin(-1)
+#endif
     {
     }
 }           driverstate[2];
 
+static inline bool is_simulated(int i2cindex)
+{
+#if PICORO_I2C_SIM
+    return driverstate[i2cindex].sim != NULL;
+#else
+    return false;
+#endif
+}
+
+// whether the driver coro is up, on the hardware or a simulated bus (which never claims dma).
+static inline bool is_running(int i2cindex)
+{
+#if PICORO_I2C_SIM
+    if (driverstate[i2cindex].simrunning)
+        return true;
+#endif
+    return driverstate[i2cindex].dmareadchannel != -1;
+}
+
 
 static __force_inline i2c_inst_t* i2cinst_from_index(int index)
 {
@@ -88,6 +197,15 @@ static void __no_inline_not_in_flash_func(i2chandler)()
 
             *driverstate[I].wasaborted = true;
 
+#if PICORO_I2C_CHAIN_DMA
+            // stop the chain first, otherwise it would just carry on with the next transaction.
+            if (driverstate[I].chain.active)
+            {
+                dma_channel_abort(driverstate[I].chain.controlchannel);
+                dma_channel_abort(driverstate[I].chain.pokechannel);
+            }
+#endif
+
             // we've got a race with i2c having been aborted and cancelling
             // the dma transfer. post-abort we may still end up stuff more tx bits in!
             // so disable i2c dma here.
@@ -98,6 +216,11 @@ static void __no_inline_not_in_flash_func(i2chandler)()
             dma_channel_abort(driverstate[I].dmareadchannel);
             dma_channel_abort(driverstate[I].dmawritechannel);
 
+#if PICORO_I2C_STATS
+            // reading clr_tx_abrt below clears this too.
+            driverstate[I].abortsource |= i2c_get_hw(i2c)->tx_abrt_source;
+#endif
+
             // need to read to clear the irq (it always reads as zero, nothing useful to do with the result).
             // but clear only once dma has been cancelled!
             // i2c chip keeps the fifos clear as long as the abort is in progress. if we clear it too early
@@ -136,6 +259,23 @@ static void __no_inline_not_in_flash_func(dma_irq_handler)()
 
         assert((__get_current_exception() - 16) == (DMA_IRQ_0 + dmairq[I]));
 
+#if PICORO_I2C_CHAIN_DMA
+        // the chain forces the control channel's irq after each transaction, see run_chain().
+        // (the control channel itself is quiet, so that's the only way its bit gets set.)
+        if (driverstate[I].chain.active && dma_irqn_get_channel_status(dmairq[I], driverstate[I].chain.controlchannel))
+        {
+            // forced bits don't go away by acknowledging, they need clearing in intf.
+            // atomic clear: the chain might be forcing the next one right now.
+            hw_clear_bits((dmairq[I] == 0) ? &dma_hw->intf0 : &dma_hw->intf1, 1u << driverstate[I].chain.controlchannel);
+
+            if (!driverstate[I].haswokenup)
+            {
+                driverstate[I].haswokenup = true;
+                wakeup(&driverstate[I].i2cdriverblock);
+            }
+        }
+#endif
+
         bool r = dma_irqn_get_channel_status(dmairq[I], driverstate[I].dmareadchannel);
         bool w = dma_irqn_get_channel_status(dmairq[I], driverstate[I].dmawritechannel);
         if (r)
@@ -168,7 +308,15 @@ static void DRVFUNC(deinit)(int i2cindex)
     PROFILE_THIS_FUNC;
 
     // should only be called once all queued up cmds have been drained.
-    assert(rb_is_empty(&driverstate[i2cindex].cmdindices));
+    assert(aq_peek_next(&driverstate[i2cindex].queue) == NULL);
+
+#if PICORO_I2C_SIM
+    if (is_simulated(i2cindex))
+    {
+        driverstate[i2cindex].simrunning = false;
+        return;
+    }
+#endif
 
     // we do have exclusive use of the i2c irq.
     int i2cirq = i2cindex + I2C0_IRQ;
@@ -183,89 +331,751 @@ static void DRVFUNC(deinit)(int i2cindex)
     driverstate[i2cindex].dmareadchannel = -1;
     dma_channel_unclaim(driverstate[i2cindex].dmawritechannel);
     driverstate[i2cindex].dmawritechannel = -1;
+
+#if PICORO_I2C_CHAIN_DMA
+    dma_irqn_set_channel_enabled(dmairq[i2cindex], driverstate[i2cindex].chain.controlchannel, false);
+    dma_channel_unclaim(driverstate[i2cindex].chain.controlchannel);
+    dma_channel_unclaim(driverstate[i2cindex].chain.pokechannel);
+    dma_timer_unclaim(driverstate[i2cindex].chain.settletimer);
+#endif
 }
 
-static uint32_t DRVFUNC(i2cdriver_func)(uint32_t param)
+#if PICORO_I2C_INLINE
+static_assert(PICORO_I2C_INLINE_MAXCMDS <= 16, "inline transactions need to fit into the fifo");
+
+static void record_small_latency(DriverState* ds, const I2CRequest* c)
 {
-    PROFILE_THIS_FUNC;
+    if (c->numcmds <= ds->inlinemaxcmds)
+    {
+        ds->inlinestats.numsmallqueued++;
+        ds->inlinestats.smallqueuedlatency_us += time_us_32() - c->queuedtime;
+    }
+}
+#endif
 
-    i2c_inst_t* i2c = (i2c_inst_t*) param;
-    int         i2cindex = i2c_hw_index(i2c);
+#if PICORO_SOFTWARE_TIMERS
+// a sample of a periodic job came in: flip its buffers and tell the consumer, if it's waiting.
+static void finish_periodic(I2CPeriodicJob* job, bool success)
+{
+    if (!success)
+    {
+        job->numfailed++;
+        return;
+    }
 
-    while (true)
+    const int back = job->front ^ 1;
+    if (job->onlyonchange && (job->numsamples > 0) && (memcmp(job->buffers[back], job->buffers[job->front], job->request.numresults) == 0))
     {
-        if (!rb_is_empty(&driverstate[i2cindex].cmdindices))
+        // same as before, just read into the same back buffer again next time.
+        job->numunchanged++;
+        return;
+    }
+
+    job->front = back;
+    job->numsamples++;
+    job->request.results = job->buffers[back ^ 1];
+
+    // only signal if asked for, see wait_i2c_periodic(). otherwise the semaphore would count up with every sample.
+    if (job->consumerwaiting)
+    {
+        job->consumerwaiting = false;
+        signal(&job->waitable);
+    }
+}
+#endif
+
+// everything that needs doing once c has gone through the bus (or not).
+#if PICORO_I2C_STATS
+static void add_traffic(I2CTrafficStats* t, const I2CRequest* c, bool success, uint32_t abortsource, uint32_t bustime, uint32_t waittime, uint32_t latency)
+{
+    t->numtransactions++;
+    t->numbyteswritten += c->numcmds - c->numresults;
+    t->numbytesread += c->numresults;
+
+    if (!success)
+    {
+        t->numaborted++;
+        for (int i = 0; i < I2C_STATS_NUMABORTBITS; ++i)
+            t->abortsources[i] += (abortsource >> i) & 1;
+    }
+
+    t->waittime_us += waittime;
+    t->bustime_us += bustime;
+    if (bustime > t->maxbustime_us)
+        t->maxbustime_us = bustime;
+    t->latency_us += latency;
+    if (latency > t->maxlatency_us)
+        t->maxlatency_us = latency;
+
+    // bit length, i.e. log2 roughly. 5 bits is under 32 us.
+    const int bucket = (32 - __builtin_clz(latency | 1)) - 5;
+    t->latencyhistogram[MAX(0, MIN(bucket, I2C_STATS_NUMBUCKETS - 1))]++;
+}
+
+static void record_traffic(DriverState* ds, const I2CRequest* c, bool success)
+{
+    // in a chain the abort can come in before earlier transactions have been reported. those went through, not theirs.
+    const uint32_t abortsource = success ? 0 : ds->abortsource;
+    const uint32_t waittime = c->servicestart - c->queuedtime;
+    const uint32_t latency = time_us_32() - c->queuedtime;
+
+    add_traffic(&ds->busstats, c, success, abortsource, ds->bustime_us, waittime, latency);
+
+    I2CAddressStats* a = ht_find(&ds->addresstable, (uint8_t) c->address);
+    if ((a == NULL) && (ds->numaddresses < PICORO_I2C_STATS_MAXADDRESSES))
+    {
+        a = &ds->addressstats[ds->numaddresses++];
+        memset(a, 0, sizeof(*a));
+        a->address = c->address;
+        ht_insert(&ds->addresstable, a);
+    }
+    if (a != NULL)
+        add_traffic(&a->traffic, c, success, abortsource, ds->bustime_us, waittime, latency);
+    else
+        ds->numuntracked++;
+
+    if (!success)
+        ds->abortsource = 0;
+    ds->bustime_us = 0;
+}
+#endif
+
+static void complete_request(DriverState* ds, I2CRequest* c, bool success)
+{
+    if (c->success != NULL)
+        *c->success = success;
+
+#if PICORO_I2C_INLINE
+    record_small_latency(ds, c);
+#endif
+#if PICORO_I2C_STATS
+    record_traffic(ds, c, success);
+#endif
+#if PICORO_SOFTWARE_TIMERS
+    if (c->job != NULL)
+        finish_periodic(c->job, success);
+#endif
+
+    aq_complete(&ds->queue, c);
+}
+
+#if PICORO_I2C_CHAIN_DMA
+// roughly how many scl clocks c keeps the bus busy for: 9 per byte (incl ack), an address byte per (re)start, plus start and stop.
+static uint32_t count_bus_bits(const I2CRequest* c)
+{
+    uint32_t restarts = 0;
+    for (int i = 1; i < c->numcmds; ++i)
+        restarts += (c->cmds[i] & I2C_RESTART) ? 1 : 0;
+    return 9 * (c->numcmds + 1 + restarts) + 2;
+}
+#endif
+
+#if PICORO_I2C_TIMEOUT
+// runs in the timer irq. same as the i2c irq handler: wake the driver, once.
+static int64_t __no_inline_not_in_flash_func(timeout_alarm)(alarm_id_t id, void* param)
+{
+    uint32_t save = save_and_disable_interrupts();
+    {
+        DriverState& ds = driverstate[(int) (intptr_t) param];
+        // too late if the transfer has finished already, just not been looked at yet.
+        if (!ds.haswokenup)
         {
-            // tx fifo should be empty! we make sure of that after each transfer.
-            assert(i2c_get_hw(i2c)->raw_intr_stat & I2C_IC_RAW_INTR_STAT_TX_EMPTY_BITS);
+            ds.timedout = true;
+            ds.haswokenup = true;
+            wakeup(&ds.i2cdriverblock);
+        }
+    }
+    restore_interrupts(save);
+    // one-shot.
+    return 0;
+}
 
-            // not empty, so do the thing.
-            CmdRingbufferEntry&  c = driverstate[i2cindex].cmdringbuffer[rb_peek_front(&driverstate[i2cindex].cmdindices)];
+static alarm_id_t DRVFUNC(arm_timeout)(int i2cindex, uint32_t timeout_us)
+{
+    driverstate[i2cindex].timedout = false;
+    if (timeout_us == 0)
+        return 0;
+    return add_alarm_in_us(timeout_us, timeout_alarm, (void*) (intptr_t) i2cindex, true);
+}
 
-            // we will always have to do some writes.
-            driverstate[i2cindex].datawritecaused = false;
-            // but reads are optional. so if there are no reads then we pretend the read dma has finished already.
-            driverstate[i2cindex].datareadcaused = c.numresults == 0;
+static void DRVFUNC(disarm_timeout)(alarm_id_t alarm)
+{
+    // fine if it has fired already.
+    if (alarm > 0)
+        cancel_alarm(alarm);
+}
 
-            bool    wasaborted = false;
-            driverstate[i2cindex].wasaborted = &wasaborted;
-            driverstate[i2cindex].haswokenup = false;
+static uint32_t get_timeout(int i2cindex, const I2CRequest* c)
+{
+    return (c->timeout_us != 0) ? c->timeout_us : driverstate[i2cindex].timeout_us;
+}
+
+// pins are open-drain by hand: drive low, or let the pull-ups have them.
+static void release_pin(uint pin, bool release)
+{
+    gpio_set_dir(pin, !release);
+}
+
+// clocks scl until the device lets go of sda (max 9, a whole byte plus ack), then makes a stop. returns false if sda is still stuck low.
+static bool DRVFUNC(clock_out_bus)(uint sda, uint scl)
+{
+    gpio_put(sda, 0);
+    gpio_put(scl, 0);
+    release_pin(sda, true);
+    release_pin(scl, true);
+    gpio_set_function(sda, GPIO_FUNC_SIO);
+    gpio_set_function(scl, GPIO_FUNC_SIO);
+
+    // about 100 khz, slowest common denominator.
+    for (int i = 0; (i < 9) && !gpio_get(sda); ++i)
+    {
+        release_pin(scl, false);
+        busy_wait_us_32(5);
+        release_pin(scl, true);
+        busy_wait_us_32(5);
+    }
 
-            i2c_get_hw(i2c)->enable = 0;
-            i2c_get_hw(i2c)->tar = c.address;
-            i2c_get_hw(i2c)->intr_mask = I2C_IC_INTR_MASK_M_TX_ABRT_BITS;
-            // explicitly switch on tx/rx dma signals on the i2c side.
-            // we may have disabled those earlier. so re-enable.
-            i2c_get_hw(i2c)->dma_cr = I2C_IC_DMA_CR_TDMAE_BITS | I2C_IC_DMA_CR_RDMAE_BITS;
-            i2c_get_hw(i2c)->enable = 1;
+    // stop: sda goes high while scl is high.
+    release_pin(scl, false);
+    busy_wait_us_32(5);
+    release_pin(sda, false);
+    busy_wait_us_32(5);
+    release_pin(scl, true);
+    busy_wait_us_32(5);
+    release_pin(sda, true);
+    busy_wait_us_32(5);
+
+    const bool free = gpio_get(sda);
+    gpio_set_function(sda, GPIO_FUNC_I2C);
+    gpio_set_function(scl, GPIO_FUNC_I2C);
+    return free;
+}
 
-            const int i2cirq = i2c_hw_index(i2c) + I2C0_IRQ;
-            irq_set_enabled(i2cirq, true);
+// the transfer in flight is stuck. get back to where run_transfer() expects things: dma idle, controller enabled and empty.
+static void DRVFUNC(recover)(int i2cindex, i2c_inst_t* i2c, uint32_t starttime)
+{
+    PROFILE_THIS_FUNC;
+
+    DriverState&    ds = driverstate[i2cindex];
+    i2c_hw_t*       hw = i2c_get_hw(i2c);
+
+    // nothing of the old transfer should make it into the next one. wasaborted points to a stack that's about to go away.
+    irq_set_enabled(i2c_hw_index(i2c) + I2C0_IRQ, false);
+    hw->intr_mask = 0;
+    hw->dma_cr = 0;
+#if PICORO_I2C_CHAIN_DMA
+    if (ds.chain.active)
+    {
+        dma_channel_abort(ds.chain.controlchannel);
+        dma_channel_abort(ds.chain.pokechannel);
+    }
+#endif
+    dma_channel_abort(ds.dmareadchannel);
+    dma_channel_abort(ds.dmawritechannel);
+    dma_irqn_acknowledge_channel(dmairq[i2cindex], ds.dmareadchannel);
+    dma_irqn_acknowledge_channel(dmairq[i2cindex], ds.dmawritechannel);
+    ds.datareadcaused = false;
+    ds.datawritecaused = false;
+
+    ds.recoverystats.numtimeouts++;
+    if (ds.sdapin >= 0)
+    {
+        ds.recoverystats.numbusrecoveries++;
+        if (!clock_out_bus(ds.sdapin, ds.sclpin))
+            ds.recoverystats.numstuck++;
+    }
+
+    // the controller might be stuck mid-byte, a reset is the only sure way out. but it forgets its timing config.
+    const uint32_t con = hw->con;
+    const uint32_t sshcnt = hw->ss_scl_hcnt;
+    const uint32_t sslcnt = hw->ss_scl_lcnt;
+    const uint32_t fshcnt = hw->fs_scl_hcnt;
+    const uint32_t fslcnt = hw->fs_scl_lcnt;
+    const uint32_t sdahold = hw->sda_hold;
+    const uint32_t spklen = hw->fs_spklen;
+    const uint32_t txtl = hw->tx_tl;
+    const uint32_t rxtl = hw->rx_tl;
+    const uint32_t tdlr = hw->dma_tdlr;
+    const uint32_t rdlr = hw->dma_rdlr;
+
+    const uint32_t resetbits = (i2c_hw_index(i2c) == 0) ? RESETS_RESET_I2C0_BITS : RESETS_RESET_I2C1_BITS;
+    reset_block(resetbits);
+    unreset_block_wait(resetbits);
+
+    hw->enable = 0;
+    hw->con = con;
+    hw->ss_scl_hcnt = sshcnt;
+    hw->ss_scl_lcnt = sslcnt;
+    hw->fs_scl_hcnt = fshcnt;
+    hw->fs_scl_lcnt = fslcnt;
+    hw->sda_hold = sdahold;
+    hw->fs_spklen = spklen;
+    hw->tx_tl = txtl;
+    hw->rx_tl = rxtl;
+    hw->dma_tdlr = tdlr;
+    hw->dma_rdlr = rdlr;
+    hw->intr_mask = 0;
+    hw->enable = 1;
+
+    const uint32_t timelost = time_us_32() - starttime;
+    ds.recoverystats.timelost_us += timelost;
+    if (timelost > ds.recoverystats.maxtimelost_us)
+        ds.recoverystats.maxtimelost_us = timelost;
+#if PICORO_I2C_STATS
+    ds.bustime_us += timelost;
+#endif
+}
+#endif
 
-            if (c.numresults > 0)
+#if PICORO_I2C_SIM
+// stands in for the dma round and the irqs: the simulated bus does the work, we sleep for as long as the real thing would take.
+static bool DRVFUNC(run_sim_transfer)(int i2cindex, I2CRequest* c)
+{
+    PROFILE_THIS_FUNC;
+
+    uint32_t        abortsource;
+    const uint32_t  duration = i2csim_run(driverstate[i2cindex].sim, c->address, c->cmds, c->numcmds, c->results, c->numresults, &abortsource);
+    yield_and_wait4time(make_timeout_time_us(duration));
+
+#if PICORO_I2C_STATS
+    driverstate[i2cindex].abortsource |= abortsource;
+    driverstate[i2cindex].bustime_us += duration;
+#endif
+
+    return abortsource == 0;
+}
+#endif
+
+// one dma round for the cmds (and results) of c, then wait for the irqs. returns false if aborted.
+static bool DRVFUNC(run_transfer)(int i2cindex, i2c_inst_t* i2c, I2CRequest* c)
+{
+    PROFILE_THIS_FUNC;
+
+#if PICORO_I2C_SIM
+    if (is_simulated(i2cindex))
+        return run_sim_transfer(i2cindex, c);
+#endif
+
+    // tx fifo should be empty! we make sure of that after each transfer.
+    assert(i2c_get_hw(i2c)->raw_intr_stat & I2C_IC_RAW_INTR_STAT_TX_EMPTY_BITS);
+
+#if PICORO_I2C_CHAIN_DMA || PICORO_I2C_STATS || PICORO_I2C_TIMEOUT
+    const uint32_t starttime = time_us_32();
+#endif
+
+    // we will always have to do some writes.
+    driverstate[i2cindex].datawritecaused = false;
+    // but reads are optional. so if there are no reads then we pretend the read dma has finished already.
+    driverstate[i2cindex].datareadcaused = c->numresults == 0;
+
+    bool    wasaborted = false;
+    driverstate[i2cindex].wasaborted = &wasaborted;
+    driverstate[i2cindex].haswokenup = false;
+
+    i2c_get_hw(i2c)->enable = 0;
+    i2c_get_hw(i2c)->tar = c->address;
+    i2c_get_hw(i2c)->intr_mask = I2C_IC_INTR_MASK_M_TX_ABRT_BITS;
+    // explicitly switch on tx/rx dma signals on the i2c side.
+    // we may have disabled those earlier. so re-enable.
+    i2c_get_hw(i2c)->dma_cr = I2C_IC_DMA_CR_TDMAE_BITS | I2C_IC_DMA_CR_RDMAE_BITS;
+    i2c_get_hw(i2c)->enable = 1;
+
+    const int i2cirq = i2c_hw_index(i2c) + I2C0_IRQ;
+    irq_set_enabled(i2cirq, true);
+
+#if PICORO_I2C_TIMEOUT
+    const alarm_id_t alarm = arm_timeout(i2cindex, get_timeout(i2cindex, c));
+#endif
+
+    if (c->numresults > 0)
+    {
+        dma_channel_set_read_addr(driverstate[i2cindex].dmareadchannel, &i2c->hw->data_cmd, false);
+        dma_channel_set_write_addr(driverstate[i2cindex].dmareadchannel, &c->results[0], false);
+        dma_channel_set_trans_count(driverstate[i2cindex].dmareadchannel, c->numresults, false);
+        dma_channel_start(driverstate[i2cindex].dmareadchannel);
+    }
+    dma_channel_set_read_addr(driverstate[i2cindex].dmawritechannel, &c->cmds[0], false);
+    dma_channel_set_write_addr(driverstate[i2cindex].dmawritechannel, &i2c->hw->data_cmd, false);
+    dma_channel_set_trans_count(driverstate[i2cindex].dmawritechannel, c->numcmds, false);
+    dma_channel_start(driverstate[i2cindex].dmawritechannel);
+
+    yield_and_wait4wakeup();
+
+#if PICORO_I2C_TIMEOUT
+    disarm_timeout(alarm);
+    if (driverstate[i2cindex].timedout)
+    {
+        recover(i2cindex, i2c, starttime);
+        return false;
+    }
+#endif
+
+    // we should only ever get here until after all the bits in the tx fifo have been sent out!
+    assert(i2c_get_hw(i2c)->raw_intr_stat & I2C_IC_RAW_INTR_STAT_TX_EMPTY_BITS);
+
+    irq_set_enabled(i2cirq, false);
+
+#if PICORO_I2C_STATS
+    driverstate[i2cindex].bustime_us += time_us_32() - starttime;
+#endif
+#if PICORO_I2C_CHAIN_DMA
+    driverstate[i2cindex].stats.numsingle++;
+    driverstate[i2cindex].stats.singletime_us += time_us_32() - starttime;
+    driverstate[i2cindex].stats.singlebits += count_bus_bits(c);
+#endif
+
+    return !wasaborted;
+}
+
+// runs c on its own, including any further rounds its continuation asks for.
+static void DRVFUNC(run_single)(int i2cindex, i2c_inst_t* i2c, I2CRequest* c)
+{
+#if PICORO_I2C_STATS
+    driverstate[i2cindex].bustime_us = 0;
+#endif
+
+    bool success;
+    while ((success = run_transfer(i2cindex, i2c, c)) && (c->continuation != NULL) && c->continuation(c))
+        ;
+
+    complete_request(&driverstate[i2cindex], c, success);
+}
+
+#if PICORO_I2C_INLINE
+// runs c right here on the caller's coro, no dma, no irqs: stuff all cmds into the tx fifo, then poll.
+// only while the driver is idle. the driver holds off until we are done, see i2cdriver_func().
+static void DRVFUNC(run_inline)(int i2cindex, i2c_inst_t* i2c, I2CRequest* c)
+{
+    PROFILE_THIS_FUNC;
+
+    DriverState&    ds = driverstate[i2cindex];
+    i2c_hw_t*       hw = i2c_get_hw(i2c);
+    const uint32_t  starttime = time_us_32();
+
+    ds.inlinebusy = true;
+    aq_begin_direct(c);
+
+    // the driver leaves the tx fifo empty after each transfer.
+    assert(hw->raw_intr_stat & I2C_IC_RAW_INTR_STAT_TX_EMPTY_BITS);
+
+    hw->enable = 0;
+    hw->tar = c->address;
+    // we feed and drain the fifos ourselves.
+    hw->dma_cr = 0;
+    hw->enable = 1;
+
+    // fits in one go, see set_i2c_inline_threshold().
+    for (int i = 0; i < c->numcmds; ++i)
+        hw->data_cmd = c->cmds[i];
+
+    bool    wasaborted = false;
+    int     numreceived = 0;
+    while (true)
+    {
+        const uint32_t raw = hw->raw_intr_stat;
+        if (raw & I2C_IC_RAW_INTR_STAT_TX_ABRT_BITS)
+        {
+            wasaborted = true;
+#if PICORO_I2C_STATS
+            ds.abortsource |= hw->tx_abrt_source;
+#endif
+            // tx fifo stays flushed until we clear the abort.
+            hw->clr_tx_abrt;
+            break;
+        }
+
+        while ((numreceived < c->numresults) && (hw->rxflr > 0))
+            c->results[numreceived++] = (uint8_t) hw->data_cmd;
+
+        // tx empty is not enough: the last byte (and the stop) might still be going out.
+        if ((numreceived == c->numresults) && (raw & I2C_IC_RAW_INTR_STAT_TX_EMPTY_BITS) && !(hw->status & I2C_IC_STATUS_ACTIVITY_BITS))
+        {
+            // a nack on the very last byte only shows once the controller is done.
+            if (hw->raw_intr_stat & I2C_IC_RAW_INTR_STAT_TX_ABRT_BITS)
             {
-                dma_channel_set_read_addr(driverstate[i2cindex].dmareadchannel, &i2c->hw->data_cmd, false);
-                dma_channel_set_write_addr(driverstate[i2cindex].dmareadchannel, &c.results[0], false);
-                dma_channel_set_trans_count(driverstate[i2cindex].dmareadchannel, c.numresults, false);
-                dma_channel_start(driverstate[i2cindex].dmareadchannel);
+                wasaborted = true;
+#if PICORO_I2C_STATS
+                ds.abortsource |= hw->tx_abrt_source;
+#endif
+                hw->clr_tx_abrt;
             }
-            dma_channel_set_read_addr(driverstate[i2cindex].dmawritechannel, &c.cmds[0], false);
-            dma_channel_set_write_addr(driverstate[i2cindex].dmawritechannel, &i2c->hw->data_cmd, false);
-            dma_channel_set_trans_count(driverstate[i2cindex].dmawritechannel, c.numcmds, false);
-            dma_channel_start(driverstate[i2cindex].dmawritechannel);
+            break;
+        }
 
-            yield_and_wait4wakeup();
-            // we should only ever get here until after all the bits in the tx fifo have been sent out!
-            assert(i2c_get_hw(i2c)->raw_intr_stat & I2C_IC_RAW_INTR_STAT_TX_EMPTY_BITS);
+#if PICORO_I2C_TIMEOUT
+        const uint32_t timeout = get_timeout(i2cindex, c);
+        if ((timeout != 0) && ((time_us_32() - starttime) > timeout))
+        {
+            wasaborted = true;
+            recover(i2cindex, i2c, starttime);
+            break;
+        }
+#endif
 
-            irq_set_enabled(i2cirq, false);
+        ds.inlinestats.numpolls++;
+        yield();
+    }
 
-            if (c.success != NULL)
-                *c.success = !wasaborted;
+    if (c->success != NULL)
+        *c->success = !wasaborted;
 
-#ifndef NDEBUG
-            c.numcmds = 0;
-            c.cmds = (uint16_t*) 0xdeadbeef;
-            c.numresults = 0;
-            c.results = (uint8_t*) 0xdeadbeef;
+    ds.inlinestats.numinline++;
+    ds.inlinestats.inlinelatency_us += time_us_32() - starttime;
+
+#if PICORO_I2C_STATS
+    ds.bustime_us = time_us_32() - starttime;
+    record_traffic(&ds, c, !wasaborted);
+#endif
+
+    ds.inlinebusy = false;
+    aq_complete_direct(c);
+}
 #endif
-            signal(&c.waitable);
 
-            rb_pop_front(&driverstate[i2cindex].cmdindices);
+#if PICORO_I2C_CHAIN_DMA
+// the chain retargets the controller in between transactions, which needs the previous one to have let go of the bus.
+static bool is_chainable(const I2CRequest* c)
+{
+    // continuations need the driver in between.
+    return ((c->cmds[c->numcmds - 1] & I2C_STOP) != 0) && (c->continuation == NULL);
+}
+
+static void add_poke(ChainPoke* poke, const volatile void* src, volatile void* dst, uint32_t count, uint32_t ctrl)
+{
+    poke->read_addr = src;
+    poke->write_addr = dst;
+    poke->transfer_count = count;
+    poke->ctrl = ctrl;
+}
+
+/**
+ * Runs the n transactions in batch back-to-back, without the cpu in between.
+ * Per transaction the chain does:
+ *  - fence: disable the controller, paced by the tx dreq (with dma_tdlr = 0 that's "tx fifo empty").
+ *    the controller finishes the byte in flight, including the stop, before it actually goes disabled.
+ *  - settle: more disable writes, paced by a dma timer running at about scl rate. the fence fires as soon as the last byte
+ *    has moved into the shift register, so this needs to cover that byte (9 clocks, incl its ack/nak) and the stop.
+ *    otherwise the done marker, and a nak on that byte, would land on the wrong side of the next transaction.
+ *  - done marker for the previous transaction, and force the dma irq so that the driver can complete it.
+ *  - tar, enable.
+ *  - program and trigger the read channel (if any), then the write channel.
+ *    whichever of the two finishes last chains back to the control channel.
+ * An abort stops the whole chain, see i2chandler(). The driver then carries on with what's left.
+ */
+static void DRVFUNC(run_chain)(int i2cindex, i2c_inst_t* i2c, I2CRequest** batch, int n)
+{
+    PROFILE_THIS_FUNC;
+
+    assert(n > 1 && n <= PICORO_I2C_CHAIN_MAX);
+
+    DriverState&    ds = driverstate[i2cindex];
+    ChainState&     ch = ds.chain;
+    i2c_hw_t*       hw = i2c_get_hw(i2c);
+    const uint32_t  starttime = time_us_32();
+    // through the atomic set alias: only adds our bit, leaves whatever else is forced alone.
+    io_rw_32*       forceirq = hw_set_alias((dmairq[i2cindex] == 0) ? &dma_hw->intf0 : &dma_hw->intf1);
+
+    ChainPoke*      p = &ch.pokes[0];
+    for (int i = 0; i < n; ++i)
+    {
+        I2CRequest*         c = batch[i];
+        ChainTransaction&   t = ch.transactions[i];
+
+        add_poke(p++, &ch.zero, &hw->enable, 1, ch.ctrlfence);
+        add_poke(p++, &ch.zero, &hw->enable, PICORO_I2C_CHAIN_SETTLE, ch.ctrlsettle);
+        if (i > 0)
+        {
+            add_poke(p++, &ch.transactions[i - 1].done, &ch.done, 1, ch.ctrlword);
+            add_poke(p++, &ch.forceirq, forceirq, 1, ch.ctrlword);
         }
 
-        // FIXME: i think i need a timeout-able wait4signal, so that the driver can shutdown.
-        yield_and_wait4signal(&driverstate[i2cindex].newcmdswaitable);
-        if (driverstate[i2cindex].drivershouldexit && rb_is_empty(&driverstate[i2cindex].cmdindices))
+        t.tar = c->address;
+        t.done = i + 1;
+        add_poke(p++, &t.tar, &hw->tar, 1, ch.ctrlword);
+        add_poke(p++, &ch.one, &hw->enable, 1, ch.ctrlword);
+
+        dma_channel_config  readcfg = ds.readcfg;
+        dma_channel_config  writecfg = ds.writecfg;
+        // data channels stay quiet, the forced irq is all the driver needs.
+        channel_config_set_irq_quiet(&readcfg, true);
+        channel_config_set_irq_quiet(&writecfg, true);
+
+        if (c->numresults > 0)
+        {
+            // reads finish last: the last byte comes in after the last cmd went out.
+            channel_config_set_chain_to(&readcfg, ch.controlchannel);
+            t.readprog[0] = (uint32_t) &hw->data_cmd;
+            t.readprog[1] = (uint32_t) &c->results[0];
+            t.readprog[2] = c->numresults;
+            t.readprog[3] = channel_config_get_ctrl_value(&readcfg);
+            add_poke(p++, &t.readprog[0], &dma_hw->ch[ds.dmareadchannel].read_addr, 4, ch.ctrlprog);
+        }
+        else
+            channel_config_set_chain_to(&writecfg, ch.controlchannel);
+
+        t.writeprog[0] = (uint32_t) &c->cmds[0];
+        t.writeprog[1] = (uint32_t) &hw->data_cmd;
+        t.writeprog[2] = c->numcmds;
+        t.writeprog[3] = channel_config_get_ctrl_value(&writecfg);
+        add_poke(p++, &t.writeprog[0], &dma_hw->ch[ds.dmawritechannel].read_addr, 4, ch.ctrlproglast);
+    }
+    add_poke(p++, &ch.zero, &hw->enable, 1, ch.ctrlfence);
+    add_poke(p++, &ch.zero, &hw->enable, PICORO_I2C_CHAIN_SETTLE, ch.ctrlsettle);
+    add_poke(p++, &ch.transactions[n - 1].done, &ch.done, 1, ch.ctrlword);
+    add_poke(p++, &ch.forceirq, forceirq, 1, ch.ctrlword);
+    add_poke(p++, NULL, NULL, 0, 0);
+    assert(p <= &ch.pokes[count_of(ch.pokes)]);
+
+    bool    wasaborted = false;
+    ds.wasaborted = &wasaborted;
+    ds.haswokenup = false;
+    ch.done = 0;
+    ch.active = true;
+
+#if PICORO_I2C_TIMEOUT
+    // for the whole chain. any of them switched off means off.
+    uint32_t timeout = 0;
+    bool     notimeout = false;
+    for (int i = 0; i < n; ++i)
+    {
+        timeout += get_timeout(i2cindex, batch[i]);
+        notimeout |= get_timeout(i2cindex, batch[i]) == 0;
+    }
+    const alarm_id_t alarm = arm_timeout(i2cindex, notimeout ? 0 : timeout);
+#endif
+
+    hw->enable = 0;
+    hw->intr_mask = I2C_IC_INTR_MASK_M_TX_ABRT_BITS;
+    hw->dma_cr = I2C_IC_DMA_CR_TDMAE_BITS | I2C_IC_DMA_CR_RDMAE_BITS;
+    // the fence needs the tx dreq to mean "fifo empty".
+    const uint32_t oldtdlr = hw->dma_tdlr;
+    hw->dma_tdlr = 0;
+
+    const int i2cirq = i2c_hw_index(i2c) + I2C0_IRQ;
+    irq_set_enabled(i2cirq, true);
+
+    // 4 words per poke, the write side wraps around the poke channel's first 4 registers.
+    dma_channel_config  controlcfg = dma_channel_get_default_config(ch.controlchannel);
+    channel_config_set_read_increment(&controlcfg, true);
+    channel_config_set_write_increment(&controlcfg, true);
+    channel_config_set_transfer_data_size(&controlcfg, DMA_SIZE_32);
+    channel_config_set_ring(&controlcfg, true, 4);
+    channel_config_set_irq_quiet(&controlcfg, true);
+    dma_channel_configure(ch.controlchannel, &controlcfg, &dma_hw->ch[ch.pokechannel].read_addr, &ch.pokes[0], 4, true);
+
+    // completions come in order. report each as soon as the chain says it has gone through.
+    int reported = 0;
+#if PICORO_I2C_STATS
+    uint32_t lastreport = starttime;
+#endif
+    while (true)
+    {
+        const int done = ch.done;
+#if PICORO_I2C_STATS
+        // no per-transaction timestamps in a chain: those that finished since the last look share the time.
+        const uint32_t now = time_us_32();
+        const uint32_t share = (done > reported) ? (now - lastreport) / (done - reported) : 0;
+        if (done > reported)
+            lastreport = now;
+#endif
+        for (; reported < done; ++reported)
+        {
+#if PICORO_I2C_STATS
+            ds.bustime_us = share;
+#endif
+            complete_request(&ds, batch[reported], true);
+        }
+
+        if ((reported == n) || wasaborted)
+            break;
+#if PICORO_I2C_TIMEOUT
+        if (ds.timedout)
+        {
+            // counts like an abort of the transaction in flight.
+            recover(i2cindex, i2c, starttime);
+            wasaborted = true;
+            break;
+        }
+#endif
+
+        ds.haswokenup = false;
+        // might have missed an irq in between.
+        if ((ch.done != (uint32_t) reported) || wasaborted)
+            continue;
+        yield_and_wait4wakeup();
+    }
+#if PICORO_I2C_TIMEOUT
+    disarm_timeout(alarm);
+#endif
+
+    ch.active = false;
+    irq_set_enabled(i2cirq, false);
+    hw->dma_tdlr = oldtdlr;
+    // the chain left its own ctrl values in the data channels.
+    dma_channel_set_config(ds.dmareadchannel, &ds.readcfg, false);
+    dma_channel_set_config(ds.dmawritechannel, &ds.writecfg, false);
+
+    ds.stats.numchains++;
+    ds.stats.chaintime_us += time_us_32() - starttime;
+    for (int i = 0; i < reported; ++i)
+        ds.stats.chainbits += count_bus_bits(batch[i]);
+    ds.stats.numchained += reported;
+
+    if (wasaborted)
+    {
+        // the transaction in flight failed. the ones after it never started, run them one at a time.
+        // (without the chain's fence the controller might still be busy with the abort.)
+#if PICORO_I2C_STATS
+        ds.bustime_us = time_us_32() - lastreport;
+#endif
+        complete_request(&ds, batch[reported], false);
+
+        hw->enable = 0;
+        for (int i = reported + 1; i < n; ++i)
+            run_single(i2cindex, i2c, batch[i]);
+    }
+}
+#endif
+
+static uint32_t DRVFUNC(i2cdriver_func)(uint32_t param)
+{
+    PROFILE_THIS_FUNC;
+
+    i2c_inst_t* i2c = (i2c_inst_t*) param;
+    int         i2cindex = i2c_hw_index(i2c);
+
+    while (true)
+    {
+        I2CRequest* c = aq_wait_next(&driverstate[i2cindex].queue);
+        // queue has been closed and drained.
+        if (c == NULL)
             break;
 
-#ifndef NDEBUG
+#if PICORO_I2C_INLINE
+        // a caller might be in the middle of an inline transaction, see run_inline().
+        while (driverstate[i2cindex].inlinebusy)
+            yield();
+#endif
+
+#if PICORO_I2C_CHAIN_DMA
+        // grab whatever else is queued up already, and can go in the same chain.
+        I2CRequest* batch[PICORO_I2C_CHAIN_MAX];
+        int         n = 0;
+        batch[n++] = c;
+        if (is_chainable(c) && !is_simulated(i2cindex))
         {
-            // if we've been signaled that there's a new cmd than there better be a new command!
-            CmdRingbufferEntry&  c = driverstate[i2cindex].cmdringbuffer[rb_peek_front(&driverstate[i2cindex].cmdindices)];
-            assert(c.numcmds > 0);
+            for (I2CRequest* next = aq_peek_next(&driverstate[i2cindex].queue); (next != NULL) && (n < PICORO_I2C_CHAIN_MAX) && is_chainable(next); next = aq_peek_next(&driverstate[i2cindex].queue))
+                batch[n++] = aq_wait_next(&driverstate[i2cindex].queue);
+        }
+
+        if (n > 1)
+        {
+            run_chain(i2cindex, i2c, &batch[0], n);
+            continue;
         }
 #endif
+
+        run_single(i2cindex, i2c, c);
     }
 
     deinit(i2cindex);
@@ -279,9 +1089,22 @@ static void DRVFUNC(init)(int i2cindex)
     if (driverstate[i2cindex].dmareadchannel != -1)
         return;
 
-    driverstate[i2cindex].drivershouldexit = false;
-    rb_init_ringbuffer(&driverstate[i2cindex].cmdindices);
-    memset(&driverstate[i2cindex].newcmdswaitable, 0, sizeof(driverstate[i2cindex].newcmdswaitable));
+#if PICORO_I2C_SIM
+    // nothing to set up on the hardware side.
+    if (is_simulated(i2cindex))
+    {
+        if (driverstate[i2cindex].simrunning)
+            return;
+        driverstate[i2cindex].simrunning = true;
+
+        aq_init(&driverstate[i2cindex].queue, PICORO_I2C_QUEUE_LIMIT);
+        memset(&driverstate[i2cindex].i2cdriverblock, 0, sizeof(driverstate[i2cindex].i2cdriverblock));
+        yield_and_start(i2cdriver_func, (uint32_t) i2cinst_from_index(i2cindex), &driverstate[i2cindex].i2cdriverblock);
+        return;
+    }
+#endif
+
+    aq_init(&driverstate[i2cindex].queue, PICORO_I2C_QUEUE_LIMIT);
     memset(&driverstate[i2cindex].i2cdriverblock, 0, sizeof(driverstate[i2cindex].i2cdriverblock));
 
     // side note: caller should have called i2c_init(), which enables transmit/receive dreq on the i2c side.
@@ -323,6 +1146,59 @@ static void DRVFUNC(init)(int i2cindex)
         dma_irqn_set_channel_enabled(dmairq[i2cindex], driverstate[i2cindex].dmareadchannel, true);
     }
 
+#if PICORO_I2C_CHAIN_DMA
+    {
+        driverstate[i2cindex].readcfg = dma_channel_get_default_config(driverstate[i2cindex].dmareadchannel);
+        channel_config_set_read_increment(&driverstate[i2cindex].readcfg, false);
+        channel_config_set_write_increment(&driverstate[i2cindex].readcfg, true);
+        channel_config_set_transfer_data_size(&driverstate[i2cindex].readcfg, DMA_SIZE_8);
+        channel_config_set_dreq(&driverstate[i2cindex].readcfg, i2c_get_dreq(i2c, false));
+
+        driverstate[i2cindex].writecfg = dma_channel_get_default_config(driverstate[i2cindex].dmawritechannel);
+        channel_config_set_read_increment(&driverstate[i2cindex].writecfg, true);
+        channel_config_set_write_increment(&driverstate[i2cindex].writecfg, false);
+        channel_config_set_transfer_data_size(&driverstate[i2cindex].writecfg, DMA_SIZE_16);
+        channel_config_set_dreq(&driverstate[i2cindex].writecfg, i2c_get_dreq(i2c, true));
+
+        ChainState& ch = driverstate[i2cindex].chain;
+        ch.controlchannel = dma_claim_unused_channel(true);
+        ch.pokechannel = dma_claim_unused_channel(true);
+        ch.settletimer = dma_claim_unused_timer(true);
+        ch.zero = 0;
+        ch.one = 1;
+        ch.forceirq = 1u << ch.controlchannel;
+        ch.active = false;
+
+        // about one tick per scl period.
+        dma_timer_set_fraction(ch.settletimer, 1, i2c_get_hw(i2c)->fs_scl_hcnt + i2c_get_hw(i2c)->fs_scl_lcnt);
+
+        struct { uint32_t* ctrl; bool incr; int dreq; bool chain; } kinds[] = {
+            {&ch.ctrlfence,    false, (int) i2c_get_dreq(i2c, true),               true},
+            {&ch.ctrlsettle,   false, (int) dma_get_timer_dreq(ch.settletimer),    true},
+            {&ch.ctrlword,     false, -1,                                          true},
+            {&ch.ctrlprog,     true,  -1,                                          true},
+            {&ch.ctrlproglast, true,  -1,                                          false},
+        };
+        for (unsigned int k = 0; k < count_of(kinds); ++k)
+        {
+            dma_channel_config cfg = dma_channel_get_default_config(ch.pokechannel);
+            channel_config_set_read_increment(&cfg, kinds[k].incr);
+            channel_config_set_write_increment(&cfg, kinds[k].incr);
+            channel_config_set_transfer_data_size(&cfg, DMA_SIZE_32);
+            if (kinds[k].dreq >= 0)
+                channel_config_set_dreq(&cfg, kinds[k].dreq);
+            // chaining to itself means no chaining.
+            channel_config_set_chain_to(&cfg, kinds[k].chain ? ch.controlchannel : ch.pokechannel);
+            channel_config_set_irq_quiet(&cfg, true);
+            *kinds[k].ctrl = channel_config_get_ctrl_value(&cfg);
+        }
+
+        dma_irqn_acknowledge_channel(dmairq[i2cindex], ch.controlchannel);
+        // only ever forced, see run_chain().
+        dma_irqn_set_channel_enabled(dmairq[i2cindex], ch.controlchannel, true);
+    }
+#endif
+
     irq_add_shared_handler(DMA_IRQ_0 + dmairq[i2cindex], dmahandlers[i2cindex], PICO_SHARED_IRQ_HANDLER_DEFAULT_ORDER_PRIORITY);
     irq_set_enabled(DMA_IRQ_0 + dmairq[i2cindex], true);
 
@@ -333,48 +1209,133 @@ static void DRVFUNC(init)(int i2cindex)
     yield_and_start(i2cdriver_func, (uint32_t) i2c, &driverstate[i2cindex].i2cdriverblock);
 }
 
-Waitable* DRVFUNC(queue_cmds)(i2c_inst_t* i2c, int8_t address, int numcmds, const uint16_t* cmds, int numresults, uint8_t* results, bool* success)
+Waitable* DRVFUNC(queue_cmds)(I2CRequest* req, i2c_inst_t* i2c, int8_t address, int numcmds, const uint16_t* cmds, int numresults, uint8_t* results, bool* success)
+{
+    req->numcmds = numcmds;
+    req->cmds = cmds;
+    req->numresults = numresults;
+    req->results = results;
+    req->address = address;
+    req->success = success;
+    req->continuation = NULL;
+#if PICORO_SOFTWARE_TIMERS
+    req->job = NULL;
+#endif
+
+    return queue_request(req, i2c);
+}
+
+Waitable* DRVFUNC(queue_request)(I2CRequest* req, i2c_inst_t* i2c)
 {
     PROFILE_THIS_FUNC;
 
-    assert(numcmds > 0);
+    assert(req->numcmds > 0);
     // each read needs a read-command!
-    assert(numcmds >= numresults);
+    assert(req->numcmds >= req->numresults);
 
     const int i2cindex = i2c_hw_index(i2c);
 
     init(i2cindex);
 
-    while (rb_is_full(&driverstate[i2cindex].cmdindices))
+#if PICORO_I2C_INLINE
+    if ((req->numcmds <= driverstate[i2cindex].inlinemaxcmds) && (req->continuation == NULL) && !driverstate[i2cindex].inlinebusy && !is_simulated(i2cindex) && aq_is_idle(&driverstate[i2cindex].queue))
     {
-        // if cmd buffer is full then wait for current transfer to finish.
-        // note that this is a loop because there might be another coro waiting for this transfer already and it might be woken sooner than us and queue another transfer in front of us.
-        // FIXME: i dont think this works... what if a client of this driver is waiting on that waitable too?
-        __breakpoint();
-        yield_and_wait4signal(&driverstate[i2cindex].cmdringbuffer[rb_peek_front(&driverstate[i2cindex].cmdindices)].waitable);
+        run_inline(i2cindex, i2c, req);
+        return &req->waitable;
     }
+#endif
 
-    CmdRingbufferEntry&  c = driverstate[i2cindex].cmdringbuffer[rb_push_back(&driverstate[i2cindex].cmdindices)];
-    c.numcmds = numcmds;
-    c.cmds = cmds;
-    c.numresults = numresults;
-    c.results = results;
-    c.address = address;
-    c.success = success;
+    // wakes the driver if it's waiting for more.
+    return aq_submit(&driverstate[i2cindex].queue, req);
+}
+
+bool DRVFUNC(cancel_cmds)(i2c_inst_t* i2c, I2CRequest* req)
+{
+    PROFILE_THIS_FUNC;
 
-    // tell driver that there are new cmds waiting.
-    signal(&driverstate[i2cindex].newcmdswaitable);
+    return aq_cancel(&driverstate[i2c_hw_index(i2c)].queue, req);
+}
 
-    return &c.waitable;
+void DRVFUNC(get_i2c_queue_stats)(i2c_inst_t* i2c, AsyncQueueStats* stats)
+{
+    aq_get_stats(&driverstate[i2c_hw_index(i2c)].queue, stats);
 }
 
+#if PICORO_I2C_STATS
+// the driver only touches the stats on its coro (not in irqs), so copying them from another coro gets a consistent snapshot.
+void get_i2c_bus_stats(i2c_inst_t* i2c, I2CTrafficStats* stats, uint32_t* numuntracked)
+{
+    const DriverState& ds = driverstate[i2c_hw_index(i2c)];
+    *stats = ds.busstats;
+    if (numuntracked != NULL)
+        *numuntracked = ds.numuntracked;
+}
+
+int get_i2c_address_stats(i2c_inst_t* i2c, I2CAddressStats* stats, int maxaddresses)
+{
+    const DriverState& ds = driverstate[i2c_hw_index(i2c)];
+    for (int i = 0; i < MIN(maxaddresses, ds.numaddresses); ++i)
+        stats[i] = ds.addressstats[i];
+    return ds.numaddresses;
+}
+
+bool get_i2c_address_stats(i2c_inst_t* i2c, uint8_t address, I2CAddressStats* stats)
+{
+    DriverState& ds = driverstate[i2c_hw_index(i2c)];
+    const I2CAddressStats* a = ht_find(&ds.addresstable, address);
+    if (a == NULL)
+        return false;
+    *stats = *a;
+    return true;
+}
+
+void reset_i2c_stats(i2c_inst_t* i2c)
+{
+    DriverState& ds = driverstate[i2c_hw_index(i2c)];
+    memset(&ds.busstats, 0, sizeof(ds.busstats));
+    ds.numuntracked = 0;
+    ds.numaddresses = 0;
+    ht_init_table(&ds.addresstable);
+}
+#endif
+
+#if PICORO_I2C_TIMEOUT
+void set_i2c_timeout(i2c_inst_t* i2c, uint32_t timeout_us)
+{
+    driverstate[i2c_hw_index(i2c)].timeout_us = timeout_us;
+}
+
+void set_i2c_recovery_pins(i2c_inst_t* i2c, uint sda, uint scl)
+{
+    driverstate[i2c_hw_index(i2c)].sdapin = sda;
+    driverstate[i2c_hw_index(i2c)].sclpin = scl;
+}
+
+void get_i2c_recovery_stats(i2c_inst_t* i2c, I2CRecoveryStats* stats)
+{
+    *stats = driverstate[i2c_hw_index(i2c)].recoverystats;
+}
+#endif
+
+#if PICORO_I2C_SIM
+void attach_i2c_sim(i2c_inst_t* i2c, I2CSimBus* bus)
+{
+    const int i2cindex = i2c_hw_index(i2c);
+    // too late once the driver has set up the hardware.
+    assert(driverstate[i2cindex].dmareadchannel == -1);
+    assert(!driverstate[i2cindex].simrunning);
+
+    driverstate[i2cindex].sim = bus;
+}
+#endif
+
 const CoroutineHeader* DRVFUNC(get_driver_coro)(i2c_inst_t* i2c)
 {
     PROFILE_THIS_FUNC;
 
     const int i2cindex = i2c_hw_index(i2c);
 
-    if (driverstate[i2cindex].dmareadchannel == -1)
+    if (!is_running(i2cindex))
         return NULL;
 
     return &driverstate[i2cindex].i2cdriverblock;
@@ -384,15 +1345,122 @@ void DRVFUNC(stop_i2c_driver_async)()
 {
     PROFILE_THIS_FUNC;
 
-    if (driverstate[0].dmareadchannel != -1)
+    // drivers drain whatever is queued up, then exit.
+    if (is_running(0))
+        aq_close(&driverstate[0].queue);
+
+    if (is_running(1))
+        aq_close(&driverstate[1].queue);
+}
+
+#if PICORO_I2C_CHAIN_DMA
+void DRVFUNC(get_i2c_chain_stats)(i2c_inst_t* i2c, I2CChainStats* stats)
+{
+    *stats = driverstate[i2c_hw_index(i2c)].stats;
+}
+#endif
+
+#if PICORO_I2C_INLINE
+void DRVFUNC(set_i2c_inline_threshold)(i2c_inst_t* i2c, int maxcmds)
+{
+    assert(maxcmds >= 0 && maxcmds <= 16);
+    driverstate[i2c_hw_index(i2c)].inlinemaxcmds = maxcmds;
+}
+
+void DRVFUNC(get_i2c_inline_stats)(i2c_inst_t* i2c, I2CInlineStats* stats)
+{
+    *stats = driverstate[i2c_hw_index(i2c)].inlinestats;
+}
+#endif
+
+#if PICORO_SOFTWARE_TIMERS
+// runs on the scheduler's stack, see SoftwareTimer. queueing the request does not yield.
+static void periodic_timer_callback(uint32_t param)
+{
+    I2CPeriodicJob* job = (I2CPeriodicJob*) param;
+
+    // still busy with the previous sample. skip this one, rather than letting them pile up.
+    if ((job->request.status == AQ_QUEUED) || (job->request.status == AQ_ACTIVE))
+    {
+        job->numoverruns++;
+        return;
+    }
+
+    // a timer callback can't wait for room in the queue. that sample is lost too.
+    if (!aq_try_submit(&driverstate[i2c_hw_index(job->i2c)].queue, &job->request))
+        job->numoverruns++;
+}
+
+void DRVFUNC(start_i2c_periodic)(I2CPeriodicJob* job, i2c_inst_t* i2c, int8_t address, int numcmds, const uint16_t* cmds, int numresults, uint8_t* buffer0, uint8_t* buffer1, uint32_t period_us, bool onlyonchange)
+{
+    PROFILE_THIS_FUNC;
+
+    assert(numcmds > 0);
+    assert(numresults > 0 && numcmds >= numresults);
+    assert(period_us > 0);
+
+    init(i2c_hw_index(i2c));
+
+    job->i2c = i2c;
+    job->buffers[0] = buffer0;
+    job->buffers[1] = buffer1;
+    job->front = 0;
+    job->numsamples = 0;
+    job->numunchanged = 0;
+    job->numoverruns = 0;
+    job->numfailed = 0;
+    job->onlyonchange = onlyonchange;
+    job->consumerwaiting = false;
+    job->stopped = false;
+    job->waitable.semaphore = 0;
+
+    job->request.status = AQ_IDLE;
+    job->request.numcmds = numcmds;
+    job->request.cmds = cmds;
+    job->request.numresults = numresults;
+    job->request.results = buffer1;
+    job->request.address = address;
+    job->request.success = NULL;
+    job->request.continuation = NULL;
+    job->request.job = job;
+
+    start_timer_periodic(&job->timer, period_us, periodic_timer_callback, (uint32_t) job);
+}
+
+void DRVFUNC(stop_i2c_periodic)(I2CPeriodicJob* job)
+{
+    PROFILE_THIS_FUNC;
+
+    job->stopped = true;
+    cancel_timer(&job->timer);
+    aq_cancel(&driverstate[i2c_hw_index(job->i2c)].queue, &job->request);
+
+    // no more samples coming, the consumer would sleep forever otherwise.
+    if (job->consumerwaiting)
     {
-        driverstate[0].drivershouldexit = true;
-        signal(&driverstate[0].newcmdswaitable);
+        job->consumerwaiting = false;
+        signal(&job->waitable);
     }
 
-    if (driverstate[1].dmareadchannel != -1)
+    // the driver might be on it right now, it still needs the buffers until it's done.
+    while (job->request.status == AQ_ACTIVE)
+        yield();
+}
+
+const uint8_t* DRVFUNC(wait_i2c_periodic)(I2CPeriodicJob* job, uint32_t* lastseen)
+{
+    PROFILE_THIS_FUNC;
+
+    while (!job->stopped && (job->numsamples == *lastseen))
     {
-        driverstate[1].drivershouldexit = true;
-        signal(&driverstate[1].newcmdswaitable);
+        job->consumerwaiting = true;
+        yield_and_wait4signal(&job->waitable);
     }
+    // nothing more coming, and the app is about to take the buffers back.
+    if (job->stopped)
+        return NULL;
+
+    *lastseen = job->numsamples;
+    return job->buffers[job->front];
 }
+#endif
@@ -1,5 +1,6 @@
 #pragma once
 #include "coroutine.h"
+#include "requestqueue.h"
 #include "hardware/i2c.h"
 
 
@@ -8,6 +9,66 @@
 #define PICORO_I2CDRV_IN_RAM         0
 #endif
 
+// define to let the driver run several queued transactions back-to-back as one dma chain, without waking up in between.
+// needs two more dma channels and a dma timer per i2c instance.
+// only transactions that end with I2C_STOP are chained, the controller needs to let go of the bus before it can switch to another address.
+#ifndef PICORO_I2C_CHAIN_DMA
+#define PICORO_I2C_CHAIN_DMA         0
+#endif
+
+// max transactions per chain. each costs about 150 bytes of ram per i2c instance.
+#ifndef PICORO_I2C_CHAIN_MAX
+#define PICORO_I2C_CHAIN_MAX         4
+#endif
+
+// how many scl periods the chain waits after the last byte left the tx fifo, before it retargets the controller.
+// needs to cover that byte (9) and the stop (1). the first tick can come straight away, hence a bit more.
+#ifndef PICORO_I2C_CHAIN_SETTLE
+#define PICORO_I2C_CHAIN_SETTLE      12
+#endif
+
+// define to let small transactions run directly on the caller's coro, polling the fifos, whenever the driver has nothing else to do.
+// that skips the trip through the driver coro, dma and irqs, which for a 1-3 byte register read costs more than the transfer itself.
+#ifndef PICORO_I2C_INLINE
+#define PICORO_I2C_INLINE            0
+#endif
+
+// default size limit (in cmds) for the inline path, see set_i2c_inline_threshold().
+#ifndef PICORO_I2C_INLINE_MAXCMDS
+#define PICORO_I2C_INLINE_MAXCMDS    4
+#endif
+
+// define to have the driver keep traffic stats per bus and per target address, see get_i2c_bus_stats().
+#ifndef PICORO_I2C_STATS
+#define PICORO_I2C_STATS             0
+#endif
+
+// how many different target addresses per bus get their own stats. power of two. about 180 bytes each.
+#ifndef PICORO_I2C_STATS_MAXADDRESSES
+#define PICORO_I2C_STATS_MAXADDRESSES   8
+#endif
+
+// define to give each transaction a deadline. if it's not done by then (device holds sda low, stretches the clock forever, ...)
+// the driver aborts it, recovers the bus and carries on with the next one. uses an alarm from the sdk's default pool.
+#ifndef PICORO_I2C_TIMEOUT
+#define PICORO_I2C_TIMEOUT           0
+#endif
+
+// default per transaction, see set_i2c_timeout().
+#ifndef PICORO_I2C_TIMEOUT_US
+#define PICORO_I2C_TIMEOUT_US        10000
+#endif
+
+// how many requests the driver's queue takes before queue_cmds() has to yield for room. 0 for no limit.
+#ifndef PICORO_I2C_QUEUE_LIMIT
+#define PICORO_I2C_QUEUE_LIMIT       0
+#endif
+
+// define to be able to run the driver's queue side against a simulated bus (i2csim.h) instead of the hardware, see attach_i2c_sim().
+#ifndef PICORO_I2C_SIM
+#define PICORO_I2C_SIM               0
+#endif
+
 
 /*
 
@@ -21,30 +82,175 @@ static const uint16_t    cmds[] = {
 constexpr uint16_t I2C_START = 0;
 constexpr uint16_t I2C_STOP = I2C_IC_DATA_CMD_STOP_VALUE_ENABLE << I2C_IC_DATA_CMD_STOP_LSB;
 constexpr uint16_t I2C_WRITE(uint8_t value) { return ((uint16_t) value) | (I2C_IC_DATA_CMD_CMD_VALUE_WRITE << I2C_IC_DATA_CMD_CMD_LSB); }
-constexpr uint16_t I2C_READ(int ignored) { return I2C_IC_DATA_CMD_CMD_VALUE_READ << I2C_IC_DATA_CMD_CMD_LSB; }
+// reads don't take a value, the argument is only there for old code.
+constexpr uint16_t I2C_READ(int ignored = 0) { return I2C_IC_DATA_CMD_CMD_VALUE_READ << I2C_IC_DATA_CMD_CMD_LSB; }
 constexpr uint16_t I2C_RESTART = I2C_IC_DATA_CMD_RESTART_VALUE_ENABLE << I2C_IC_DATA_CMD_RESTART_LSB;
 
+constexpr bool i2c_is_read(uint16_t cmd) { return (cmd & I2C_READ()) != 0; }
+
+
+// command lists that carry their number of reads in the type, so that queue_cmds() can check the results buffer at compile time.
+// (a mismatch would otherwise hang the driver.) build them as static constexpr, they end up in flash, nothing is built at runtime:
+/*
+
+static constexpr auto   readaccel = i2c_read_regs<6>(0x3B);             // write 0x3B, restart, read 6.
+static constexpr auto   wakeup = i2c_write_regs(0x6B, {0x00, 0x07});    // write 0x6B, 0x00, 0x07.
+static constexpr auto   setup = i2c_concat(wakeup, i2c_write_regs(0x1A, {0x03}), readaccel);
+static constexpr auto   handmade = I2CCmds<I2C_START | I2C_WRITE(0x75), I2C_RESTART | I2C_READ() | I2C_STOP>::list;
+
+uint8_t     accel[6];
+queue_cmds(&req, i2c0, 0x68, readaccel, accel, &success);     // compile error if accel is not exactly 6 bytes.
+
+*/
+template <int NumCmds_, int NumResults_>
+struct I2CCmdList
+{
+    static constexpr int NumCmds = NumCmds_;
+    static constexpr int NumResults = NumResults_;
+    static_assert(NumCmds > 0);
+    static_assert(NumResults >= 0 && NumResults <= NumCmds);
+
+    uint16_t    cmds[NumCmds];
+};
+
+/**
+ * @brief Write register address reg, then restart and read N bytes (the device auto-increments).
+ */
+template <int N>
+constexpr I2CCmdList<N + 1, N> i2c_read_regs(uint8_t reg)
+{
+    static_assert(N > 0);
+    I2CCmdList<N + 1, N>    l {};
+    l.cmds[0] = I2C_START | I2C_WRITE(reg);
+    for (int i = 1; i <= N; ++i)
+        l.cmds[i] = I2C_READ();
+    l.cmds[1] |= I2C_RESTART;
+    l.cmds[N] |= I2C_STOP;
+    return l;
+}
+
+/**
+ * @brief Write register address reg, followed by values, as one burst.
+ */
+template <int N>
+constexpr I2CCmdList<N + 1, 0> i2c_write_regs(uint8_t reg, const uint8_t (& values)[N])
+{
+    I2CCmdList<N + 1, 0>    l {};
+    l.cmds[0] = I2C_START | I2C_WRITE(reg);
+    for (int i = 0; i < N; ++i)
+        l.cmds[1 + i] = I2C_WRITE(values[i]);
+    l.cmds[N] |= I2C_STOP;
+    return l;
+}
+
+/**
+ * @brief Lists one after the other, in one request. Each keeps its stops, results are in order.
+ */
+template <int C, int R>
+constexpr I2CCmdList<C, R> i2c_concat(const I2CCmdList<C, R>& a)
+{
+    return a;
+}
+
+template <int C1, int R1, int C2, int R2, typename... Rest>
+constexpr auto i2c_concat(const I2CCmdList<C1, R1>& a, const I2CCmdList<C2, R2>& b, const Rest&... rest)
+{
+    I2CCmdList<C1 + C2, R1 + R2>    l {};
+    for (int i = 0; i < C1; ++i)
+        l.cmds[i] = a.cmds[i];
+    for (int i = 0; i < C2; ++i)
+        l.cmds[C1 + i] = b.cmds[i];
+    return i2c_concat(l, rest...);
+}
+
+/**
+ * Hand-written commands, with the reads counted for you.
+ */
+template <uint16_t... Cmds>
+struct I2CCmds
+{
+    static constexpr I2CCmdList<sizeof...(Cmds), (0 + ... + (i2c_is_read(Cmds) ? 1 : 0))>  list = {{Cmds...}};
+};
+
+// forward decl
+struct I2CPeriodicJob;
+
+/**
+ * One i2c transaction. Caller-owned: needs to stay alive (and untouched) until its waitable has signalled.
+ * Can be reused once it has.
+ */
+struct I2CRequest : AsyncRequest
+{
+#if PICORO_SOFTWARE_TIMERS
+    I2CPeriodicJob*     job;        // non-null if the request belongs to a periodic job.
+#endif
+    // optional. runs on the driver coro once the transaction has gone through successfully.
+    // it can change cmds/results for another round and return true: that runs straight away, before anything else queued up.
+    // e.g. read-modify-write as one queued operation. must not yield.
+    bool                (*continuation)(I2CRequest* req);
+    const uint16_t*     cmds;
+    uint8_t*            results;
+    bool*               success;
+    int16_t             numcmds;
+    int16_t             numresults;
+    int8_t              address;
+#if PICORO_I2C_TIMEOUT
+    uint32_t            timeout_us;     // 0 for the bus' default.
+#endif
+
+    I2CRequest()
+#if PICORO_I2C_TIMEOUT
+        : timeout_us(0)
+#endif
+    {
+    }
+};
+
 // can yield_and_wait on the return value.
 // it's a mistake to specify a results buffer without including read commands! will cause a deadlock!
-// does not itself yield internally, unless internal ringbuffer is full.
-extern Waitable* queue_cmds(i2c_inst_t* i2c, int8_t address, int numcmds, const uint16_t* cmds, int numresults, uint8_t* results, bool* success);
+// does not itself yield internally, there's no limit on how many requests can be queued.
+// (except with PICORO_I2C_QUEUE_LIMIT: once the queue is at its limit it yields until there's room.)
+// (except with PICORO_I2C_INLINE: small transactions may run right here, yielding while polling. req is complete on return then.)
+extern Waitable* queue_cmds(I2CRequest* req, i2c_inst_t* i2c, int8_t address, int numcmds, const uint16_t* cmds, int numresults, uint8_t* results, bool* success);
+
+// lanes: aq_set_lane(&req, AQ_LANE_BULK) before queueing keeps e.g. eeprom page writes from holding up sensor reads. aq_set_deadline() orders within a lane.
+
+// same as queue_cmds(), for a req that has all its fields filled in already (incl continuation).
+extern Waitable* queue_request(I2CRequest* req, i2c_inst_t* i2c);
 
 template <int C, int R>
-Waitable* queue_cmds(i2c_inst_t* i2c, int8_t address, const uint16_t (& cmds)[C], uint8_t (& results)[R], bool* success)
+Waitable* queue_cmds(I2CRequest* req, i2c_inst_t* i2c, int8_t address, const uint16_t (& cmds)[C], uint8_t (& results)[R], bool* success)
+{
+    return queue_cmds(req, i2c, address, C, &cmds[0], R, &results[0], success);
+}
+template <int C>
+Waitable* queue_cmds(I2CRequest* req, i2c_inst_t* i2c, int8_t address, const uint16_t (& cmds)[C], uint8_t* results, bool* success)
 {
-    return queue_cmds(i2c, address, C, &cmds[0], R, &results[0], success);
+    return queue_cmds(req, i2c, address, C, &cmds[0], 1, results, success);
 }
 template <int C>
-Waitable* queue_cmds(i2c_inst_t* i2c, int8_t address, const uint16_t (& cmds)[C], uint8_t* results, bool* success)
+Waitable* queue_cmds(I2CRequest* req, i2c_inst_t* i2c, int8_t address, const uint16_t (& cmds)[C], bool* success)
 {
-    return queue_cmds(i2c, address, C, &cmds[0], 1, results, success);
+    return queue_cmds(req, i2c, address, C, &cmds[0], 0, NULL, success);
+}
+
+template <int C, int R>
+Waitable* queue_cmds(I2CRequest* req, i2c_inst_t* i2c, int8_t address, const I2CCmdList<C, R>& list, uint8_t (& results)[R], bool* success)
+{
+    return queue_cmds(req, i2c, address, C, &list.cmds[0], R, &results[0], success);
 }
 template <int C>
-Waitable* queue_cmds(i2c_inst_t* i2c, int8_t address, const uint16_t (& cmds)[C], bool* success)
+Waitable* queue_cmds(I2CRequest* req, i2c_inst_t* i2c, int8_t address, const I2CCmdList<C, 0>& list, bool* success)
 {
-    return queue_cmds(i2c, address, C, &cmds[0], 0, NULL, success);
+    return queue_cmds(req, i2c, address, C, &list.cmds[0], 0, NULL, success);
 }
 
+// takes req back out of the queue, if the driver has not started on it yet. its waitable signals then, success is not touched.
+extern bool cancel_cmds(i2c_inst_t* i2c, I2CRequest* req);
+
+// depth, wait and service times of the driver's queue, also per lane.
+extern void get_i2c_queue_stats(i2c_inst_t* i2c, AsyncQueueStats* stats);
+
 // FIXME: i need an explicit init()/deinit() so that the main app can shut everything down.
 
 
@@ -54,3 +260,152 @@ extern const CoroutineHeader* get_driver_coro(i2c_inst_t* i2c);
 
 // tells the drivers (both!) to stop, usually after their current commands have drained.
 extern void stop_i2c_driver_async();
+
+#if PICORO_I2C_TIMEOUT
+struct I2CRecoveryStats
+{
+    uint32_t    numtimeouts;
+    uint32_t    numbusrecoveries;   // ...where sda/scl got clocked by hand (pins known, see set_i2c_recovery_pins()).
+    uint32_t    numstuck;           // sda still low after that. controller gets reset anyway.
+    uint64_t    timelost_us;        // transaction start until recovered, summed.
+    uint32_t    maxtimelost_us;
+};
+
+// for transactions that don't set their own timeout_us. 0 switches timeouts off.
+extern void set_i2c_timeout(i2c_inst_t* i2c, uint32_t timeout_us);
+
+// the driver does not know which pins the app has given to i2c. without them, recovery is only a controller reset.
+// with them, it first clocks scl up to 9 times until the device lets go of sda, then makes a stop.
+extern void set_i2c_recovery_pins(i2c_inst_t* i2c, uint sda, uint scl);
+
+extern void get_i2c_recovery_stats(i2c_inst_t* i2c, I2CRecoveryStats* stats);
+#endif
+
+#if PICORO_I2C_SIM
+struct I2CSimBus;
+
+// from now on the driver for i2c talks to bus instead of the hardware: no dma, no irqs, it sleeps for as long as the bus would have been busy.
+// what runs for real is the queue side: queueing (incl the limit), cancelling, continuations, periodic jobs, completion,
+// and a nak'd transaction failing its request. what doesn't: run_transfer() and the irq handlers, and with them the
+// hardware's abort handling, chaining, the inline path and timeouts. still needs the device, the coro switcher is arm-only.
+// needs to happen before the first transaction on i2c, and stays that way.
+extern void attach_i2c_sim(i2c_inst_t* i2c, I2CSimBus* bus);
+#endif
+
+#if PICORO_I2C_CHAIN_DMA
+// to compare how busy the bus is kept with and without chaining.
+// bits are roughly how many scl clocks the transactions needed. divided by the baudrate and the time, that's the utilisation.
+struct I2CChainStats
+{
+    uint32_t    numsingle;          // transactions run on their own.
+    uint32_t    numchained;         // transactions run as part of a chain.
+    uint32_t    numchains;
+    uint64_t    singletime_us;      // from starting the dma until complete.
+    uint64_t    singlebits;
+    uint64_t    chaintime_us;       // from starting the chain until it's done.
+    uint64_t    chainbits;
+};
+
+extern void get_i2c_chain_stats(i2c_inst_t* i2c, I2CChainStats* stats);
+#endif
+
+#if PICORO_I2C_INLINE
+// to tune the inline threshold: compare latency of small transactions that ran inline with those that had to queue.
+struct I2CInlineStats
+{
+    uint32_t    numinline;
+    uint32_t    numpolls;               // yield() round trips while waiting for the fifos. that's the cpu cost, roughly.
+    uint64_t    inlinelatency_us;       // summed.
+    uint32_t    numsmallqueued;         // small enough for inline, but the driver was busy.
+    uint64_t    smallqueuedlatency_us;  // submit until complete, summed.
+};
+
+// transactions of up to maxcmds cmds run inline (if the driver is idle). 0 switches that off. max 16, the fifo depth.
+extern void set_i2c_inline_threshold(i2c_inst_t* i2c, int maxcmds);
+
+extern void get_i2c_inline_stats(i2c_inst_t* i2c, I2CInlineStats* stats);
+#endif
+
+#if PICORO_I2C_STATS
+// latency histogram: bucket 0 counts everything under 32 us, bucket i up to 32 << i us, the last one everything beyond.
+#define I2C_STATS_NUMBUCKETS        12
+// bits 0..16 of IC_TX_ABRT_SOURCE are the reasons.
+#define I2C_STATS_NUMABORTBITS      17
+
+struct I2CTrafficStats
+{
+    uint32_t    numtransactions;    // completed, incl aborted ones. cancelled ones never started and don't count.
+    uint32_t    numaborted;
+    uint32_t    abortsources[I2C_STATS_NUMABORTBITS];   // how often each IC_TX_ABRT_SOURCE bit was set, e.g. [0] is address nak.
+    uint32_t    numbyteswritten;    // of the (last round of the) transaction, whether it went through or not.
+    uint32_t    numbytesread;
+    uint64_t    waittime_us;        // queued until the driver picked it up, summed.
+    uint64_t    bustime_us;         // transfer started until done, summed. chained transactions share the chain's time.
+    uint32_t    maxbustime_us;
+    uint64_t    latency_us;         // submitted until complete, summed.
+    uint32_t    maxlatency_us;
+    uint32_t    latencyhistogram[I2C_STATS_NUMBUCKETS];
+};
+
+struct I2CAddressStats
+{
+    uint8_t             address;
+    I2CTrafficStats     traffic;
+};
+
+// everything on the bus. numuntracked: transactions to addresses beyond PICORO_I2C_STATS_MAXADDRESSES, only in here.
+extern void get_i2c_bus_stats(i2c_inst_t* i2c, I2CTrafficStats* stats, uint32_t* numuntracked = NULL);
+
+// copies up to maxaddresses entries, in order of first use. returns how many addresses there are.
+extern int get_i2c_address_stats(i2c_inst_t* i2c, I2CAddressStats* stats, int maxaddresses);
+
+// stats for one address. false if there are none (yet).
+extern bool get_i2c_address_stats(i2c_inst_t* i2c, uint8_t address, I2CAddressStats* stats);
+
+extern void reset_i2c_stats(i2c_inst_t* i2c);
+#endif
+
+#if PICORO_SOFTWARE_TIMERS
+/**
+ * The same transaction, over and over at a fixed rate. The driver queues it from a SoftwareTimer, no app coro involved.
+ * Results alternate between two buffers: one holds the latest sample, the driver reads the next one into the other.
+ * Caller-owned, needs to stay alive until stop_i2c_periodic(). Treat as opaque, apart from the counters.
+ */
+struct I2CPeriodicJob
+{
+    I2CRequest          request;
+    SoftwareTimer       timer;
+    i2c_inst_t*         i2c;
+    uint8_t*            buffers[2];
+    volatile uint8_t    front;          // which buffer has the latest sample.
+    bool                onlyonchange;
+    bool                consumerwaiting;
+    bool                stopped;
+    Waitable            waitable;
+    volatile uint32_t   numsamples;     // published samples.
+    uint32_t            numunchanged;   // samples not published because nothing changed (onlyonchange).
+    uint32_t            numoverruns;    // periods skipped because the previous sample was still queued or in flight, or the queue was full.
+    uint32_t            numfailed;      // aborted transactions, e.g. nack.
+};
+
+/**
+ * @brief Starts sampling: cmds go out every period_us, results end up alternately in buffer0 and buffer1.
+ * cmds and both buffers need to stay alive until stop_i2c_periodic().
+ * @param onlyonchange only publish a sample (and wake the consumer) if it differs from the previous one.
+ */
+extern void start_i2c_periodic(I2CPeriodicJob* job, i2c_inst_t* i2c, int8_t address, int numcmds, const uint16_t* cmds, int numresults, uint8_t* buffer0, uint8_t* buffer1, uint32_t period_us, bool onlyonchange = false);
+
+/**
+ * @brief Stops job. Yields if the driver is in the middle of a sample.
+ * A consumer waiting in wait_i2c_periodic() gets woken up, and gets NULL.
+ */
+extern void stop_i2c_periodic(I2CPeriodicJob* job);
+
+/**
+ * @brief Yields until there's a sample newer than *lastseen (start with 0), then returns it.
+ * The buffer stays valid until the consumer yields again: after that the driver may be reading the next-but-one sample into it.
+ * Only one consumer per job.
+ * @return NULL once the job has been stopped.
+ */
+extern const uint8_t* wait_i2c_periodic(I2CPeriodicJob* job, uint32_t* lastseen);
+#endif
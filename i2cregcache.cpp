@@ -0,0 +1,262 @@
+#include "i2cregcache.h"
+#include "coroutine.h"
+#include "profiler.h"
+#include <string.h>
+
+
+static bool test_bit(const uint32_t* bits, int index)
+{
+    return (bits[index / 32] & (1u << (index % 32))) != 0;
+}
+
+static void set_bit(uint32_t* bits, int index, bool value)
+{
+    if (value)
+        bits[index / 32] |= 1u << (index % 32);
+    else
+        bits[index / 32] &= ~(1u << (index % 32));
+}
+
+static int reg2index(const I2CRegCacheHeader* cache, uint8_t reg)
+{
+    const int index = (int) reg - cache->firstreg;
+    assert(index >= 0 && index < cache->numregs);
+    return index;
+}
+
+// whether values[index] is what the device has (or will have, once flushed).
+static bool is_cached(const I2CRegCacheHeader* cache, int index)
+{
+    return test_bit(cache->dirty, index) || (test_bit(cache->valid, index) && !test_bit(cache->isvolatile, index));
+}
+
+// queues the cache's request and yields until it's done.
+static bool run(I2CRegCacheHeader* cache)
+{
+    bool success = false;
+    cache->success = &success;
+    yield_and_wait4signal(queue_request(cache, cache->i2c));
+    return success && (cache->status == AQ_DONE);
+}
+
+// writes count registers from index onwards, in one transaction.
+static bool write_burst(I2CRegCacheHeader* cache, int index, int count)
+{
+    assert(count > 0 && count <= PICORO_REGCACHE_MAXBURST);
+
+    cache->cmdstorage[0] = I2C_START | I2C_WRITE(cache->firstreg + index);
+    for (int i = 0; i < count; ++i)
+        cache->cmdstorage[1 + i] = I2C_WRITE(cache->values[index + i]);
+    cache->cmdstorage[count] |= I2C_STOP;
+
+    cache->cmds = &cache->cmdstorage[0];
+    cache->numcmds = count + 1;
+    cache->results = NULL;
+    cache->numresults = 0;
+    cache->continuation = NULL;
+
+    const bool success = run(cache);
+    for (int i = 0; i < count; ++i)
+    {
+        set_bit(cache->dirty, index + i, false);
+        set_bit(cache->valid, index + i, success);
+    }
+
+    cache->stats.numbursts++;
+    cache->stats.numregswritten += count;
+    return success;
+}
+
+// reads count registers from index onwards, in one transaction.
+static bool read_burst(I2CRegCacheHeader* cache, int index, int count)
+{
+    assert(count > 0 && count <= PICORO_REGCACHE_MAXBURST);
+
+    cache->cmdstorage[0] = I2C_START | I2C_WRITE(cache->firstreg + index);
+    cache->cmdstorage[1] = I2C_RESTART | I2C_READ(0);
+    for (int i = 1; i < count; ++i)
+        cache->cmdstorage[1 + i] = I2C_READ(0);
+    cache->cmdstorage[count] |= I2C_STOP;
+
+    cache->cmds = &cache->cmdstorage[0];
+    cache->numcmds = count + 1;
+    cache->results = &cache->values[index];
+    cache->numresults = count;
+    cache->continuation = NULL;
+
+    const bool success = run(cache);
+    for (int i = 0; i < count; ++i)
+        set_bit(cache->valid, index + i, success);
+    return success;
+}
+
+// runs on the driver coro, after the read of an uncached read-modify-write.
+// turns the request into the write, if there's anything to change.
+static bool rmw_continuation(I2CRequest* req)
+{
+    I2CRegCacheHeader* cache = static_cast<I2CRegCacheHeader*>(req);
+
+    // only once: the write round ends up here too.
+    if (req->numresults == 0)
+        return false;
+
+    const uint8_t newvalue = (cache->rmwvalue & ~cache->rmwmask) | (cache->rmwbits & cache->rmwmask);
+    if (newvalue == cache->rmwvalue)
+    {
+        cache->rmwskipped = true;
+        return false;
+    }
+
+    cache->rmwvalue = newvalue;
+    cache->cmdstorage[0] = I2C_START | I2C_WRITE(cache->rmwreg);
+    cache->cmdstorage[1] = I2C_WRITE(newvalue) | I2C_STOP;
+    req->numcmds = 2;
+    req->results = NULL;
+    req->numresults = 0;
+    return true;
+}
+
+
+void init_regcache(I2CRegCacheHeader* cache, i2c_inst_t* i2c, int8_t address, uint8_t firstreg, int numregs, uint8_t* values, uint32_t* valid, uint32_t* dirty, uint32_t* isvolatile)
+{
+    assert(firstreg + numregs <= 256);
+
+    cache->i2c = i2c;
+    cache->firstreg = firstreg;
+    cache->numregs = numregs;
+    cache->values = values;
+    cache->valid = valid;
+    cache->dirty = dirty;
+    cache->isvolatile = isvolatile;
+
+    memset(values, 0, numregs);
+    memset(valid, 0, ((numregs + 31) / 32) * sizeof(uint32_t));
+    memset(dirty, 0, ((numregs + 31) / 32) * sizeof(uint32_t));
+    memset(isvolatile, 0, ((numregs + 31) / 32) * sizeof(uint32_t));
+    memset(&cache->stats, 0, sizeof(cache->stats));
+
+    cache->address = address;
+    cache->continuation = NULL;
+#if PICORO_SOFTWARE_TIMERS
+    cache->job = NULL;
+#endif
+}
+
+void regcache_set_volatile(I2CRegCacheHeader* cache, uint8_t reg)
+{
+    set_bit(cache->isvolatile, reg2index(cache, reg), true);
+}
+
+void regcache_invalidate(I2CRegCacheHeader* cache)
+{
+    memset(cache->valid, 0, ((cache->numregs + 31) / 32) * sizeof(uint32_t));
+    memset(cache->dirty, 0, ((cache->numregs + 31) / 32) * sizeof(uint32_t));
+}
+
+void regcache_write(I2CRegCacheHeader* cache, uint8_t reg, uint8_t value)
+{
+    const int index = reg2index(cache, reg);
+
+    cache->stats.numwrites++;
+    if (!test_bit(cache->dirty, index) && test_bit(cache->valid, index) && !test_bit(cache->isvolatile, index) && (cache->values[index] == value))
+    {
+        cache->stats.numskipped++;
+        return;
+    }
+
+    // a write that's staged already just gets overwritten.
+    cache->values[index] = value;
+    set_bit(cache->dirty, index, true);
+}
+
+bool regcache_flush(I2CRegCacheHeader* cache)
+{
+    PROFILE_THIS_FUNC;
+
+    bool success = true;
+    for (int index = 0; index < cache->numregs; )
+    {
+        if (!test_bit(cache->dirty, index))
+        {
+            ++index;
+            continue;
+        }
+
+        int count = 1;
+        while ((index + count < cache->numregs) && (count < PICORO_REGCACHE_MAXBURST) && test_bit(cache->dirty, index + count))
+            ++count;
+
+        success &= write_burst(cache, index, count);
+        index += count;
+    }
+
+    return success;
+}
+
+bool regcache_read(I2CRegCacheHeader* cache, uint8_t reg, uint8_t* value)
+{
+    PROFILE_THIS_FUNC;
+
+    const int index = reg2index(cache, reg);
+
+    if (is_cached(cache, index))
+    {
+        cache->stats.numreadhits++;
+        *value = cache->values[index];
+        return true;
+    }
+
+    cache->stats.numreadmisses++;
+    if (!read_burst(cache, index, 1))
+        return false;
+
+    *value = cache->values[index];
+    return true;
+}
+
+bool regcache_update_bits(I2CRegCacheHeader* cache, uint8_t reg, uint8_t mask, uint8_t bits)
+{
+    PROFILE_THIS_FUNC;
+
+    const int index = reg2index(cache, reg);
+
+    if (is_cached(cache, index))
+    {
+        regcache_write(cache, reg, (cache->values[index] & ~mask) | (bits & mask));
+        if (!test_bit(cache->dirty, index))
+            return true;
+        return write_burst(cache, index, 1);
+    }
+
+    // not cached (or volatile): driver does the read and the write back-to-back.
+    cache->rmwreg = reg;
+    cache->rmwmask = mask;
+    cache->rmwbits = bits;
+    cache->rmwskipped = false;
+
+    cache->cmdstorage[0] = I2C_START | I2C_WRITE(reg);
+    cache->cmdstorage[1] = I2C_RESTART | I2C_READ(0) | I2C_STOP;
+    cache->cmds = &cache->cmdstorage[0];
+    cache->numcmds = 2;
+    cache->results = &cache->rmwvalue;
+    cache->numresults = 1;
+    cache->continuation = rmw_continuation;
+
+    const bool success = run(cache);
+    cache->continuation = NULL;
+
+    cache->stats.numrmw++;
+    if (cache->rmwskipped)
+        cache->stats.numrmwskipped++;
+
+    // on failure we don't know whether the write made it.
+    if (success)
+        cache->values[index] = cache->rmwvalue;
+    set_bit(cache->valid, index, success);
+    return success;
+}
+
+void regcache_get_stats(const I2CRegCacheHeader* cache, I2CRegCacheStats* stats)
+{
+    *stats = cache->stats;
+}
@@ -0,0 +1,120 @@
+#pragma once
+#include "i2c.h"
+
+
+// shadow copy of a device's (8-bit) registers, on top of the i2c driver.
+// assumes the usual register protocol: write the register address, then data bytes, with the device auto-incrementing the address.
+// - writes of a value the device has already are skipped.
+// - writes are staged and go out on regcache_flush(), adjacent registers merged into one burst.
+// - regcache_update_bits() is read-modify-write as one queued operation: the driver coro does the read and the write
+//   back-to-back, nobody else's transaction gets in between.
+//
+// one operation at a time per cache: the functions yield until their transaction is done. call from a coro only.
+
+
+// longest burst that regcache_flush() builds. costs 2 bytes per register in the cache header.
+#ifndef PICORO_REGCACHE_MAXBURST
+#define PICORO_REGCACHE_MAXBURST     16
+#endif
+
+
+struct I2CRegCacheStats
+{
+    uint32_t    numwrites;          // regcache_write() calls.
+    uint32_t    numskipped;         // ...that were skipped, the device has that value already.
+    uint32_t    numbursts;          // write transactions regcache_flush() sent.
+    uint32_t    numregswritten;     // registers those wrote.
+    uint32_t    numreadhits;
+    uint32_t    numreadmisses;
+    uint32_t    numrmw;             // regcache_update_bits() on an uncached register, read-modify-write by the driver coro.
+    uint32_t    numrmwskipped;      // ...where the read showed there was nothing to change.
+};
+
+/**
+ * Common stuff for I2CRegCache<>.
+ * Treat as opaque. It is its own request, that's how the continuation gets back to it.
+ */
+struct I2CRegCacheHeader : I2CRequest
+{
+    i2c_inst_t*         i2c;
+    uint8_t*            values;
+    uint32_t*           valid;          // bit per register: values[] matches the device.
+    uint32_t*           dirty;          // bit per register: values[] needs writing.
+    uint32_t*           isvolatile;     // bit per register: never trust values[], e.g. status registers.
+    int                 numregs;
+    uint8_t             firstreg;
+
+    // for the read-modify-write.
+    uint8_t             rmwreg;
+    uint8_t             rmwmask;
+    uint8_t             rmwbits;
+    uint8_t             rmwvalue;
+    bool                rmwskipped;
+
+    uint16_t            cmdstorage[PICORO_REGCACHE_MAXBURST + 1];
+    I2CRegCacheStats    stats;
+};
+
+template <int NumRegs_>
+struct I2CRegCache : I2CRegCacheHeader
+{
+    static const int NumRegs = NumRegs_;
+    static_assert(NumRegs > 0 && NumRegs <= 256);
+
+    uint8_t             valuestorage[NumRegs];
+    uint32_t            validstorage[(NumRegs + 31) / 32];
+    uint32_t            dirtystorage[(NumRegs + 31) / 32];
+    uint32_t            volatilestorage[(NumRegs + 31) / 32];
+};
+
+
+/** @internal */
+extern void init_regcache(I2CRegCacheHeader* cache, i2c_inst_t* i2c, int8_t address, uint8_t firstreg, int numregs, uint8_t* values, uint32_t* valid, uint32_t* dirty, uint32_t* isvolatile);
+
+/**
+ * @brief Sets up cache for registers firstreg .. firstreg + NumRegs - 1 of the device at address. Nothing is cached yet.
+ */
+template <int NumRegs>
+void regcache_init(I2CRegCache<NumRegs>* cache, i2c_inst_t* i2c, int8_t address, uint8_t firstreg = 0)
+{
+    init_regcache(cache, i2c, address, firstreg, NumRegs, &cache->valuestorage[0], &cache->validstorage[0], &cache->dirtystorage[0], &cache->volatilestorage[0]);
+}
+
+/**
+ * @brief Marks reg as volatile: reads always go to the device, writes are never skipped.
+ */
+extern void regcache_set_volatile(I2CRegCacheHeader* cache, uint8_t reg);
+
+/**
+ * @brief Forgets everything cached, e.g. after the device was reset. Staged writes are dropped too.
+ */
+extern void regcache_invalidate(I2CRegCacheHeader* cache);
+
+/**
+ * @brief Stages a write of value to reg. Skipped if the device is known to have that value already.
+ * Does not yield. Nothing goes out until regcache_flush().
+ */
+extern void regcache_write(I2CRegCacheHeader* cache, uint8_t reg, uint8_t value);
+
+/**
+ * @brief Sends all staged writes, adjacent registers as one burst each. Yields until done.
+ * @return false if any of the transactions failed. Registers of those are no longer considered cached.
+ */
+extern bool regcache_flush(I2CRegCacheHeader* cache);
+
+/**
+ * @brief Reads reg, from the cache if possible. Yields if not.
+ * A staged (not yet flushed) write counts as what the register has.
+ * @return false if the transaction failed.
+ */
+extern bool regcache_read(I2CRegCacheHeader* cache, uint8_t reg, uint8_t* value);
+
+/**
+ * @brief reg = (reg & ~mask) | (bits & mask). Write goes out right away (staged writes of other registers don't).
+ * If the register is cached this is just a (possibly skipped) write, counted as such. Otherwise the driver coro reads, modifies and writes in one go.
+ * Yields until done.
+ * @return false if the transaction failed.
+ */
+extern bool regcache_update_bits(I2CRegCacheHeader* cache, uint8_t reg, uint8_t mask, uint8_t bits);
+
+extern void regcache_get_stats(const I2CRegCacheHeader* cache, I2CRegCacheStats* stats);
@@ -0,0 +1,394 @@
+#include "i2csim.h"
+#include <string.h>
+#include <assert.h>
+
+
+void i2csim_init_bus(I2CSimBus* bus, uint32_t baudrate)
+{
+    assert(baudrate > 0);
+
+    bus->devices = NULL;
+    bus->baudrate = baudrate;
+    bus->now_us = 0;
+    memset(&bus->stats, 0, sizeof(bus->stats));
+}
+
+void i2csim_add_device(I2CSimBus* bus, I2CSimDevice* dev)
+{
+    dev->next = bus->devices;
+    bus->devices = dev;
+}
+
+static I2CSimDevice* find_device(I2CSimBus* bus, uint8_t address)
+{
+    for (I2CSimDevice* dev = bus->devices; dev != NULL; dev = dev->next)
+        if (dev->address == address)
+            return dev;
+    return NULL;
+}
+
+static uint64_t bits2us(const I2CSimBus* bus, uint32_t bits)
+{
+    return ((uint64_t) bits * 1000000 + bus->baudrate - 1) / bus->baudrate;
+}
+
+uint32_t i2csim_run(I2CSimBus* bus, uint8_t address, const uint16_t* cmds, int numcmds, uint8_t* results, int numresults, uint32_t* abortsource)
+{
+    uint32_t        bits = 0;
+    uint32_t        stretch = 0;
+    uint32_t        abort = 0;
+    int             numreceived = 0;
+    bool            inxfer = false;
+    bool            reading = false;
+    I2CSimDevice*   dev = NULL;
+
+    for (int i = 0; i < numcmds; ++i)
+    {
+        const uint16_t  cmd = cmds[i];
+        const bool      isread = (cmd & I2C_IC_DATA_CMD_CMD_BITS) != 0;
+
+        // controller sends a (re)start and the address when asked to, on the first byte, and when the direction changes.
+        if (!inxfer || (cmd & I2C_IC_DATA_CMD_RESTART_BITS) || (isread != reading))
+        {
+            bits += 1 + 9;
+            bus->stats.numbytes++;
+            reading = isread;
+            inxfer = true;
+
+            I2CSimDevice* d = find_device(bus, address);
+            if ((d == NULL) || !d->start(d, reading, bus->now_us + bits2us(bus, bits) + stretch))
+            {
+                abort = I2C_IC_TX_ABRT_SOURCE_ABRT_7B_ADDR_NOACK_BITS;
+                bus->stats.numaddrnaks++;
+                break;
+            }
+            dev = d;
+        }
+
+        if (dev->stretch != NULL)
+            stretch += dev->stretch(dev);
+        bits += 9;
+        bus->stats.numbytes++;
+
+        if (isread)
+        {
+            const uint8_t v = dev->read(dev);
+            if (numreceived < numresults)
+                results[numreceived++] = v;
+        }
+        else
+        if (!dev->write(dev, (uint8_t) (cmd & I2C_IC_DATA_CMD_DAT_BITS)))
+        {
+            abort = I2C_IC_TX_ABRT_SOURCE_ABRT_TXDATA_NOACK_BITS;
+            bus->stats.numdatanaks++;
+            break;
+        }
+
+        if (cmd & I2C_IC_DATA_CMD_STOP_BITS)
+        {
+            bits += 1;
+            dev->stop(dev, bus->now_us + bits2us(bus, bits) + stretch);
+            inxfer = false;
+            dev = NULL;
+        }
+    }
+
+    // aborts (and a missing stop) end with a stop too.
+    if (inxfer)
+    {
+        bits += 1;
+        if (dev != NULL)
+            dev->stop(dev, bus->now_us + bits2us(bus, bits) + stretch);
+    }
+
+    const uint32_t duration = (uint32_t) bits2us(bus, bits) + stretch;
+    bus->now_us += duration;
+
+    bus->stats.numtransactions++;
+    bus->stats.numaborts += (abort != 0) ? 1 : 0;
+    bus->stats.busytime_us += duration;
+    bus->stats.stretchtime_us += stretch;
+
+    *abortsource = abort;
+    return duration;
+}
+
+void i2csim_get_stats(const I2CSimBus* bus, I2CSimStats* stats)
+{
+    *stats = bus->stats;
+}
+
+
+static bool regfile_start(I2CSimDevice* dev, bool read, uint64_t now_us)
+{
+    I2CSimRegFile* rf = (I2CSimRegFile*) dev;
+    // a read carries on where the pointer is, a write sets it anew.
+    if (!read)
+        rf->haspointer = false;
+    return true;
+}
+
+static bool regfile_write(I2CSimDevice* dev, uint8_t byte)
+{
+    I2CSimRegFile* rf = (I2CSimRegFile*) dev;
+    if (!rf->haspointer)
+    {
+        rf->pointer = byte;
+        rf->haspointer = true;
+    }
+    else
+        rf->regs[rf->pointer++] = byte;
+    return true;
+}
+
+static uint8_t regfile_read(I2CSimDevice* dev)
+{
+    I2CSimRegFile* rf = (I2CSimRegFile*) dev;
+    return rf->regs[rf->pointer++];
+}
+
+static void regfile_stop(I2CSimDevice* dev, uint64_t now_us)
+{
+    ((I2CSimRegFile*) dev)->haspointer = false;
+}
+
+void i2csim_init_regfile(I2CSimRegFile* dev, uint8_t address)
+{
+    dev->next = NULL;
+    dev->address = address;
+    dev->start = regfile_start;
+    dev->write = regfile_write;
+    dev->read = regfile_read;
+    dev->stop = regfile_stop;
+    dev->stretch = NULL;
+
+    memset(&dev->regs[0], 0, sizeof(dev->regs));
+    dev->pointer = 0;
+    dev->haspointer = false;
+}
+
+
+static bool eeprom_start(I2CSimDevice* dev, bool read, uint64_t now_us)
+{
+    I2CSimEepromHeader* ee = (I2CSimEepromHeader*) dev;
+    // still busy with the last page write: that's what ack-polling is for.
+    if (now_us < ee->busyuntil_us)
+        return false;
+    if (!read)
+        ee->addressreceived = 0;
+    return true;
+}
+
+static bool eeprom_write(I2CSimDevice* dev, uint8_t byte)
+{
+    I2CSimEepromHeader* ee = (I2CSimEepromHeader*) dev;
+    if (ee->addressreceived < ee->addressbytes)
+    {
+        if (ee->addressreceived == 0)
+            ee->pointer = 0;
+        ee->pointer = ((ee->pointer << 8) | byte) % ee->size;
+        ee->addressreceived++;
+        return true;
+    }
+
+    // wraps around within the page.
+    const uint32_t page = ee->pointer - (ee->pointer % ee->pagesize);
+    ee->memory[ee->pointer] = byte;
+    ee->pointer = page + ((ee->pointer + 1) % ee->pagesize);
+    ee->written = true;
+    return true;
+}
+
+static uint8_t eeprom_read(I2CSimDevice* dev)
+{
+    I2CSimEepromHeader* ee = (I2CSimEepromHeader*) dev;
+    // sequential reads wrap around the whole thing.
+    const uint8_t v = ee->memory[ee->pointer];
+    ee->pointer = (ee->pointer + 1) % ee->size;
+    return v;
+}
+
+static void eeprom_stop(I2CSimDevice* dev, uint64_t now_us)
+{
+    I2CSimEepromHeader* ee = (I2CSimEepromHeader*) dev;
+    if (ee->written)
+    {
+        ee->busyuntil_us = now_us + ee->writecycle_us;
+        ee->written = false;
+    }
+}
+
+void init_eeprom(I2CSimEepromHeader* dev, uint8_t address, uint8_t* memory, uint32_t size, uint32_t pagesize, int addressbytes, uint32_t writecycle_us)
+{
+    assert(addressbytes == 1 || addressbytes == 2);
+
+    dev->next = NULL;
+    dev->address = address;
+    dev->start = eeprom_start;
+    dev->write = eeprom_write;
+    dev->read = eeprom_read;
+    dev->stop = eeprom_stop;
+    dev->stretch = NULL;
+
+    memset(memory, 0xFF, size);
+    dev->memory = memory;
+    dev->size = size;
+    dev->pagesize = pagesize;
+    dev->writecycle_us = writecycle_us;
+    dev->busyuntil_us = 0;
+    dev->pointer = 0;
+    dev->addressbytes = addressbytes;
+    dev->addressreceived = 0;
+    dev->written = false;
+}
+
+
+static bool faulty_start(I2CSimDevice* dev, bool read, uint64_t now_us)
+{
+    I2CSimFaulty* f = (I2CSimFaulty*) dev;
+    f->numstarts++;
+    f->numwritten = 0;
+    if ((f->nakaddressevery != 0) && ((f->numstarts % f->nakaddressevery) == 0))
+        return false;
+    return f->inner->start(f->inner, read, now_us);
+}
+
+static bool faulty_write(I2CSimDevice* dev, uint8_t byte)
+{
+    I2CSimFaulty* f = (I2CSimFaulty*) dev;
+    f->numwritten++;
+    if ((f->nakdataafter != 0) && (f->numwritten == f->nakdataafter))
+        return false;
+    return f->inner->write(f->inner, byte);
+}
+
+static uint8_t faulty_read(I2CSimDevice* dev)
+{
+    I2CSimFaulty* f = (I2CSimFaulty*) dev;
+    return f->inner->read(f->inner);
+}
+
+static void faulty_stop(I2CSimDevice* dev, uint64_t now_us)
+{
+    I2CSimFaulty* f = (I2CSimFaulty*) dev;
+    f->inner->stop(f->inner, now_us);
+}
+
+static uint32_t faulty_stretch(I2CSimDevice* dev)
+{
+    I2CSimFaulty* f = (I2CSimFaulty*) dev;
+    return f->stretch_us + ((f->inner->stretch != NULL) ? f->inner->stretch(f->inner) : 0);
+}
+
+void i2csim_init_faulty(I2CSimFaulty* dev, I2CSimDevice* inner, uint32_t nakaddressevery, uint32_t nakdataafter, uint32_t stretch_us)
+{
+    dev->next = NULL;
+    dev->address = inner->address;
+    dev->start = faulty_start;
+    dev->write = faulty_write;
+    dev->read = faulty_read;
+    dev->stop = faulty_stop;
+    dev->stretch = faulty_stretch;
+
+    dev->inner = inner;
+    dev->nakaddressevery = nakaddressevery;
+    dev->nakdataafter = nakdataafter;
+    dev->stretch_us = stretch_us;
+    dev->numstarts = 0;
+    dev->numwritten = 0;
+}
+
+
+#if !PICO_PRINTF_ALWAYS_INCLUDED
+// if the above symbol is not defined then assert's printf does not work!
+#endif
+// copied from assert macro.
+#define CHECK(__e) ((__e) ? (void)0 : __assert_func(__FILE__, __LINE__, __PRETTY_FUNCTION__, #__e))
+
+void i2csim_unit_test()
+{
+    static const uint16_t   RD = I2C_IC_DATA_CMD_CMD_BITS;
+    static const uint16_t   STOP = I2C_IC_DATA_CMD_STOP_BITS;
+    static const uint16_t   RESTART = I2C_IC_DATA_CMD_RESTART_BITS;
+
+    static I2CSimBus                bus;
+    static I2CSimRegFile            rf;
+    static I2CSimEeprom<1024, 16>   ee;
+    static I2CSimRegFile            rfa;
+    static I2CSimFaulty             fa;
+    static I2CSimRegFile            rfd;
+    static I2CSimFaulty             fd;
+
+    // 10 us per bit keeps the durations easy to work out.
+    i2csim_init_bus(&bus, 100000);
+    i2csim_init_regfile(&rf, 0x68);
+    i2csim_init_eeprom(&ee, 0x50, 5000);
+    i2csim_init_regfile(&rfa, 0x20);
+    i2csim_init_faulty(&fa, &rfa, 2, 0, 5);
+    i2csim_init_regfile(&rfd, 0x21);
+    i2csim_init_faulty(&fd, &rfd, 0, 2, 0);
+    i2csim_add_device(&bus, &rf);
+    i2csim_add_device(&bus, &ee);
+    i2csim_add_device(&bus, &fa);
+    i2csim_add_device(&bus, &fd);
+
+    uint32_t    abort = 0xDEAD;
+    uint8_t     results[4] = {};
+
+    // start+address 10 bits, 4 bytes of 9, stop 1.
+    const uint16_t  writeregs[] = {0x10, 1, 2, 3 | STOP};
+    CHECK(i2csim_run(&bus, 0x68, &writeregs[0], 4, NULL, 0, &abort) == 470);
+    CHECK(abort == 0);
+    CHECK(rf.regs[0x10] == 1 && rf.regs[0x11] == 2 && rf.regs[0x12] == 3);
+    CHECK(bus.now_us == 470);
+
+    // the direction change needs another start and address.
+    const uint16_t  readregs[] = {0x10, RD | RESTART, RD, RD | STOP};
+    CHECK(i2csim_run(&bus, 0x68, &readregs[0], 4, &results[0], 3, &abort) == 570);
+    CHECK(abort == 0);
+    CHECK(results[0] == 1 && results[1] == 2 && results[2] == 3);
+
+    // nobody there: start, address, stop.
+    CHECK(i2csim_run(&bus, 0x69, &readregs[0], 4, &results[0], 3, &abort) == 110);
+    CHECK(abort == I2C_IC_TX_ABRT_SOURCE_ABRT_7B_ADDR_NOACK_BITS);
+
+    // page write from 14 wraps to the start of the page.
+    const uint16_t  writeee[] = {0, 14, 0xA, 0xB, 0xC | STOP};
+    i2csim_run(&bus, 0x50, &writeee[0], 5, NULL, 0, &abort);
+    CHECK(abort == 0);
+    CHECK(ee.storage[14] == 0xA && ee.storage[15] == 0xB && ee.storage[0] == 0xC && ee.storage[16] == 0xFF);
+
+    // still in its write cycle.
+    const uint16_t  readee[] = {0, 0, RD | RESTART, RD | STOP};
+    i2csim_run(&bus, 0x50, &readee[0], 4, &results[0], 2, &abort);
+    CHECK(abort == I2C_IC_TX_ABRT_SOURCE_ABRT_7B_ADDR_NOACK_BITS);
+
+    bus.now_us += 5000;
+    i2csim_run(&bus, 0x50, &readee[0], 4, &results[0], 2, &abort);
+    CHECK(abort == 0);
+    CHECK(results[0] == 0xC && results[1] == 0xFF);
+
+    // every other start nak'd, and 5 us stretch per byte.
+    const uint16_t  writefa[] = {0, 0xAA | STOP};
+    CHECK(i2csim_run(&bus, 0x20, &writefa[0], 2, NULL, 0, &abort) == 290 + 2 * 5);
+    CHECK(abort == 0);
+    CHECK(rfa.regs[0] == 0xAA);
+    CHECK(i2csim_run(&bus, 0x20, &writefa[0], 2, NULL, 0, &abort) == 110);
+    CHECK(abort == I2C_IC_TX_ABRT_SOURCE_ABRT_7B_ADDR_NOACK_BITS);
+
+    // second data byte nak'd: the register pointer got through, the value didn't. rest is flushed.
+    const uint16_t  writefd[] = {5, 1, 2 | STOP};
+    CHECK(i2csim_run(&bus, 0x21, &writefd[0], 3, NULL, 0, &abort) == 290);
+    CHECK(abort == I2C_IC_TX_ABRT_SOURCE_ABRT_TXDATA_NOACK_BITS);
+    CHECK(rfd.regs[5] == 0 && rfd.regs[6] == 0);
+
+    I2CSimStats stats;
+    i2csim_get_stats(&bus, &stats);
+    CHECK(stats.numtransactions == 9);
+    CHECK(stats.numaborts == 4);
+    CHECK(stats.numaddrnaks == 3);
+    CHECK(stats.numdatanaks == 1);
+    CHECK(stats.stretchtime_us == 10);
+}
+
+#undef CHECK
@@ -0,0 +1,138 @@
+#pragma once
+#include <stdint.h>
+#include "hardware/regs/i2c.h"
+
+
+// simulated i2c bus with virtual devices.
+// it interprets the data_cmd words the way the controller would: (re)starts, direction changes, stops, naks and the
+// abort that follows, and works out how long that would have kept the bus busy.
+// it stands in for the controller as a whole, not for its registers: there's no i2c_hw, dma or irq emulation in here.
+// no sdk calls in here, only register definitions, so that it compiles (and i2csim_unit_test() runs) on a host too.
+//
+// with PICORO_I2C_SIM, attach_i2c_sim() hooks a bus up to the i2c driver instead of the hardware. that covers the
+// driver's queue side only, on the device. see i2c.h for what does and doesn't run.
+//
+// devices are plain structs with callbacks, derive from I2CSimDevice. three come with it:
+// - I2CSimRegFile: 256 registers, first byte written is the register pointer, auto-increment.
+// - I2CSimEeprom<>: 1 or 2 address bytes, page writes that wrap within the page, naks while busy writing.
+// - I2CSimFaulty: wraps another device and naks its address or data, or stretches the clock.
+
+
+struct I2CSimDevice
+{
+    I2CSimDevice*   next;
+    uint8_t         address;
+
+    // address phase, now_us is the bus' simulated time. return false to nak.
+    bool        (*start)(I2CSimDevice* dev, bool read, uint64_t now_us);
+    // return false to nak the byte.
+    bool        (*write)(I2CSimDevice* dev, uint8_t byte);
+    uint8_t     (*read)(I2CSimDevice* dev);
+    void        (*stop)(I2CSimDevice* dev, uint64_t now_us);
+    // optional: extra us the device holds scl low before the next byte.
+    uint32_t    (*stretch)(I2CSimDevice* dev);
+};
+
+struct I2CSimStats
+{
+    uint32_t    numtransactions;    // i2csim_run() calls.
+    uint32_t    numaborts;
+    uint32_t    numaddrnaks;
+    uint32_t    numdatanaks;
+    uint32_t    numbytes;           // incl address bytes.
+    uint64_t    busytime_us;        // simulated.
+    uint64_t    stretchtime_us;     // ...of which clock stretching.
+};
+
+struct I2CSimBus
+{
+    I2CSimDevice*   devices;
+    uint32_t        baudrate;
+    uint64_t        now_us;         // simulated time, advances with each i2csim_run().
+    I2CSimStats     stats;
+};
+
+
+extern void i2csim_init_bus(I2CSimBus* bus, uint32_t baudrate);
+extern void i2csim_add_device(I2CSimBus* bus, I2CSimDevice* dev);
+
+/**
+ * @brief Runs one transaction's worth of data_cmd words against the devices on bus.
+ * Reads are stored into results, in order, up to the point of an abort.
+ * After a nak the rest of cmds is flushed, like the controller's abort does, and a stop goes out.
+ * If cmds does not end with a stop, one is assumed (the real controller would hold the bus).
+ * @param abortsource gets the IC_TX_ABRT_SOURCE bits, 0 if all went through.
+ * @return how long the bus was busy, in us.
+ */
+extern uint32_t i2csim_run(I2CSimBus* bus, uint8_t address, const uint16_t* cmds, int numcmds, uint8_t* results, int numresults, uint32_t* abortsource);
+
+extern void i2csim_get_stats(const I2CSimBus* bus, I2CSimStats* stats);
+
+
+struct I2CSimRegFile : I2CSimDevice
+{
+    uint8_t         regs[256];
+    uint8_t         pointer;
+    bool            haspointer;     // first byte after a write-start sets the pointer.
+};
+
+extern void i2csim_init_regfile(I2CSimRegFile* dev, uint8_t address);
+
+
+/**
+ * Common stuff for I2CSimEeprom<>.
+ * Treat as opaque, apart from memory.
+ */
+struct I2CSimEepromHeader : I2CSimDevice
+{
+    uint8_t*        memory;
+    uint32_t        size;
+    uint32_t        pagesize;
+    uint32_t        writecycle_us;
+    uint64_t        busyuntil_us;
+    uint32_t        pointer;
+    int             addressbytes;   // 1 or 2.
+    int             addressreceived;
+    bool            written;        // data came in, write cycle starts with the stop.
+};
+
+template <uint32_t Size_, uint32_t PageSize_>
+struct I2CSimEeprom : I2CSimEepromHeader
+{
+    static const uint32_t Size = Size_;
+    static const uint32_t PageSize = PageSize_;
+    static_assert((Size % PageSize) == 0);
+
+    uint8_t         storage[Size];
+};
+
+/** @internal */
+extern void init_eeprom(I2CSimEepromHeader* dev, uint8_t address, uint8_t* memory, uint32_t size, uint32_t pagesize, int addressbytes, uint32_t writecycle_us);
+
+/**
+ * @brief Blank (0xFF) eeprom. Sizes over 256 bytes take 2 address bytes.
+ */
+template <uint32_t Size, uint32_t PageSize>
+void i2csim_init_eeprom(I2CSimEeprom<Size, PageSize>* dev, uint8_t address, uint32_t writecycle_us = 5000)
+{
+    init_eeprom(dev, address, &dev->storage[0], Size, PageSize, (Size > 256) ? 2 : 1, writecycle_us);
+}
+
+
+struct I2CSimFaulty : I2CSimDevice
+{
+    I2CSimDevice*   inner;
+    uint32_t        nakaddressevery;    // every nth address phase gets nak'd. 0 for never.
+    uint32_t        nakdataafter;       // nak the nth data byte written after a start. 0 for never.
+    uint32_t        stretch_us;         // per byte.
+    uint32_t        numstarts;
+    uint32_t        numwritten;
+};
+
+/**
+ * @brief Puts dev in front of inner, with the same address. Add dev to the bus, not inner.
+ */
+extern void i2csim_init_faulty(I2CSimFaulty* dev, I2CSimDevice* inner, uint32_t nakaddressevery, uint32_t nakdataafter, uint32_t stretch_us);
+
+
+extern void i2csim_unit_test();
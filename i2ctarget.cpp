@@ -0,0 +1,315 @@
+#include "i2ctarget.h"
+#include "hardware/dma.h"
+#include "hardware/irq.h"
+#include "hardware/sync.h"
+#include <string.h>
+#include "profiler.h"
+
+
+// the rx dma counts down from here. at 1 MHz that's good for hours, re-armed on a stop long before it runs out.
+#define RX_COUNT        0xFFFFFFFFu
+#define RX_REARM_BELOW  0x80000000u
+
+static I2CTargetHeader*     targets[2];
+
+
+// ring entries the rx dma has written, ever.
+static uint32_t received(const I2CTargetHeader* t)
+{
+    return t->rxbase + (RX_COUNT - dma_hw->ch[t->rxchannel].transfer_count);
+}
+
+// whatever's still in the rx fifo is only a few cycles away from the ring.
+static void drain_rx(i2c_hw_t* hw)
+{
+    while (hw->rxflr > 0)
+        tight_loop_contents();
+}
+
+static void finish_write(I2CTargetHeader* t, uint32_t end)
+{
+    if ((t->writestart != ~0u) && (end != t->writestart))
+    {
+        I2CTargetWrite  w;
+        w.start = t->writestart;
+        w.length = end - t->writestart;
+        w.reg = t->writereg;
+        if (spsc_push(&t->writes, w))
+            t->stats.numwrites++;
+        else
+            t->stats.numdropped++;
+    }
+    t->writestart = ~0u;
+}
+
+// follows the register pointer through what the host has written since last time.
+static void scan_rx(I2CTargetHeader* t)
+{
+    const uint32_t end = received(t);
+    for (; t->scanned != end; ++t->scanned)
+    {
+        const uint16_t e = t->ring[t->scanned & (t->ringsize - 1)];
+        if (e & I2C_IC_DATA_CMD_FIRST_DATA_BYTE_BITS)
+        {
+            // without a stop in between (write, restart, write) the previous one ends here.
+            finish_write(t, t->scanned);
+            t->writereg = t->pointer = (uint8_t) e;
+            t->writestart = t->scanned + 1;
+        }
+        else
+            t->pointer = ((int) t->pointer + 1 < t->numregs) ? t->pointer + 1 : 0;
+        t->stats.numbyteswritten++;
+    }
+}
+
+// the host has stopped reading. flushed is what it didn't want of what was in the fifo.
+static void end_read(I2CTargetHeader* t, uint32_t flushed)
+{
+    dma_channel_abort(t->txchannel);
+    const uint32_t notsent = dma_hw->ch[t->txchannel].transfer_count + flushed;
+    const uint32_t sent = (notsent < t->txcount) ? t->txcount - notsent : 0;
+
+    t->pointer = (uint8_t) ((t->txstart + sent) % t->numregs);
+    t->stats.numbytesread += sent;
+    t->txactive = false;
+}
+
+static void start_read(I2CTargetHeader* t)
+{
+    if (t->txactive)
+    {
+        // read past the end of the map: the dma has run out, carry on from the top.
+        t->stats.numbytesread += t->txcount;
+        t->pointer = 0;
+    }
+    else
+        t->stats.numreads++;
+
+    if (t->pointer >= t->numregs)
+        t->pointer = 0;
+
+    t->txmap = t->servemaps[t->front];
+    t->txstart = t->pointer;
+    t->txcount = t->numregs - t->pointer;
+    t->txactive = true;
+
+    dma_channel_set_read_addr(t->txchannel, &t->txmap[t->pointer], false);
+    dma_channel_set_trans_count(t->txchannel, t->txcount, true);
+}
+
+template <int I>
+static void __no_inline_not_in_flash_func(i2ctarget_handler)()
+{
+    uint32_t save = save_and_disable_interrupts();
+    {
+        PROFILE_THIS_FUNC;
+
+        I2CTargetHeader*    t = targets[I];
+        i2c_hw_t*           hw = i2c_get_hw(t->i2c);
+        const uint32_t      intstatus = hw->intr_stat;
+
+        t->stats.numirqs++;
+
+        // host nak'd the last byte it wanted, the controller flushed the rest.
+        if (intstatus & I2C_IC_INTR_STAT_R_TX_ABRT_BITS)
+        {
+            const uint32_t source = hw->tx_abrt_source;
+            if (t->txactive)
+                end_read(t, (source & I2C_IC_TX_ABRT_SOURCE_TX_FLUSH_CNT_BITS) >> I2C_IC_TX_ABRT_SOURCE_TX_FLUSH_CNT_LSB);
+            hw->clr_tx_abrt;
+        }
+
+        // before a read request: a read request holds the bus, so a stop that's pending too belongs to the previous transaction.
+        if (intstatus & I2C_IC_INTR_STAT_R_STOP_DET_BITS)
+        {
+            hw->clr_stop_det;
+
+            drain_rx(hw);
+            scan_rx(t);
+            finish_write(t, t->scanned);
+            if (t->txactive)
+                end_read(t, hw->txflr);
+
+            // bus is idle and the fifo is empty, nothing gets lost restarting the rx dma here.
+            if (dma_hw->ch[t->rxchannel].transfer_count < RX_REARM_BELOW)
+            {
+                t->rxbase = received(t);
+                dma_channel_abort(t->rxchannel);
+                dma_channel_set_trans_count(t->rxchannel, RX_COUNT, true);
+            }
+        }
+
+        if (intstatus & I2C_IC_INTR_STAT_R_RD_REQ_BITS)
+        {
+            // the register byte of a write-restart-read needs to be through first.
+            drain_rx(hw);
+            scan_rx(t);
+            finish_write(t, t->scanned);
+
+            start_read(t);
+            hw->clr_rd_req;
+        }
+    }
+    restore_interrupts(save);
+}
+
+static const irq_handler_t handlers[] = {i2ctarget_handler<0>, i2ctarget_handler<1>};
+
+
+void init_i2c_target(I2CTargetHeader* t, i2c_inst_t* i2c, uint8_t address, int numregs, uint8_t* map, uint16_t* serve0, uint16_t* serve1, volatile uint16_t* ring, uint32_t ringsize)
+{
+    PROFILE_THIS_FUNC;
+
+    const int i2cindex = i2c_hw_index(i2c);
+    assert(targets[i2cindex] == NULL);
+
+    t->i2c = i2c;
+    t->map = map;
+    t->servemaps[0] = serve0;
+    t->servemaps[1] = serve1;
+    t->front = 0;
+    t->numregs = numregs;
+    memset(map, 0, numregs);
+    memset(serve0, 0, numregs * sizeof(uint16_t));
+    memset(serve1, 0, numregs * sizeof(uint16_t));
+
+    t->ring = ring;
+    t->ringsize = ringsize;
+    t->rxbase = 0;
+    t->scanned = 0;
+    t->writestart = ~0u;
+    t->writereg = 0;
+    t->pointer = 0;
+    t->txactive = false;
+    t->txmap = NULL;
+    t->txstart = 0;
+    t->txcount = 0;
+    spsc_init(&t->writes);
+    memset(&t->stats, 0, sizeof(t->stats));
+
+    targets[i2cindex] = t;
+
+    i2c_set_slave_mode(i2c, true, address);
+
+    i2c_hw_t* hw = i2c_get_hw(i2c);
+    hw->enable = 0;
+    // stop only for our own transactions. and rather hold the bus than lose bytes if the rx dma ever falls behind.
+    hw->con |= I2C_IC_CON_STOP_DET_IFADDRESSED_BITS | I2C_IC_CON_RX_FIFO_FULL_HLD_CTRL_BITS;
+    hw->intr_mask = I2C_IC_INTR_MASK_M_RD_REQ_BITS | I2C_IC_INTR_MASK_M_TX_ABRT_BITS | I2C_IC_INTR_MASK_M_STOP_DET_BITS;
+    hw->dma_rdlr = 0;
+    hw->dma_cr = I2C_IC_DMA_CR_TDMAE_BITS | I2C_IC_DMA_CR_RDMAE_BITS;
+    hw->enable = 1;
+
+    // everything that comes in, forever, into the ring.
+    {
+        t->rxchannel = dma_claim_unused_channel(true);
+        dma_channel_config cfg = dma_channel_get_default_config(t->rxchannel);
+        channel_config_set_read_increment(&cfg, false);
+        channel_config_set_write_increment(&cfg, true);
+        // 16 bits to keep the first-data-byte flag.
+        channel_config_set_transfer_data_size(&cfg, DMA_SIZE_16);
+        channel_config_set_ring(&cfg, true, __builtin_ctz(ringsize * sizeof(uint16_t)));
+        channel_config_set_dreq(&cfg, i2c_get_dreq(i2c, false));
+        channel_config_set_irq_quiet(&cfg, true);
+        dma_channel_configure(t->rxchannel, &cfg, (void*) ring, &hw->data_cmd, RX_COUNT, true);
+    }
+
+    // gets pointed at the register map on each read request.
+    {
+        t->txchannel = dma_claim_unused_channel(true);
+        dma_channel_config cfg = dma_channel_get_default_config(t->txchannel);
+        channel_config_set_read_increment(&cfg, true);
+        channel_config_set_write_increment(&cfg, false);
+        channel_config_set_transfer_data_size(&cfg, DMA_SIZE_16);
+        channel_config_set_dreq(&cfg, i2c_get_dreq(i2c, true));
+        channel_config_set_irq_quiet(&cfg, true);
+        dma_channel_configure(t->txchannel, &cfg, &hw->data_cmd, serve0, 0, false);
+    }
+
+    const int i2cirq = i2cindex + I2C0_IRQ;
+    irq_set_exclusive_handler(i2cirq, handlers[i2cindex]);
+    irq_set_enabled(i2cirq, true);
+}
+
+void stop_i2c_target(I2CTargetHeader* t)
+{
+    PROFILE_THIS_FUNC;
+
+    const int i2cindex = i2c_hw_index(t->i2c);
+    assert(targets[i2cindex] == t);
+
+    const int i2cirq = i2cindex + I2C0_IRQ;
+    irq_set_enabled(i2cirq, false);
+    irq_remove_handler(i2cirq, handlers[i2cindex]);
+
+    i2c_hw_t* hw = i2c_get_hw(t->i2c);
+    hw->intr_mask = 0;
+    hw->dma_cr = 0;
+
+    dma_channel_abort(t->rxchannel);
+    dma_channel_abort(t->txchannel);
+    dma_channel_unclaim(t->rxchannel);
+    dma_channel_unclaim(t->txchannel);
+
+    i2c_set_slave_mode(t->i2c, false, 0);
+    targets[i2cindex] = NULL;
+}
+
+void i2ct_publish(I2CTargetHeader* t)
+{
+    PROFILE_THIS_FUNC;
+
+    const int back = t->front ^ 1;
+    // a host read that started before the last publish might still be going on in there.
+    while (t->txactive && (t->txmap == t->servemaps[back]))
+        yield();
+
+    for (int i = 0; i < t->numregs; ++i)
+        t->servemaps[back][i] = t->map[i];
+
+    // map needs to be in memory before the irq handler can pick it.
+    __dmb();
+    t->front = back;
+}
+
+int i2ct_wait_writes(I2CTargetHeader* t, I2CTargetWrite* writes, int max)
+{
+    PROFILE_THIS_FUNC;
+
+    assert(max > 0);
+
+    spsc_pop(&t->writes, &writes[0]);
+    return 1 + spsc_try_pop_n(&t->writes, &writes[1], max - 1);
+}
+
+bool i2ct_get_write_data(I2CTargetHeader* t, const I2CTargetWrite* w, uint8_t* data)
+{
+    uint32_t save = save_and_disable_interrupts();
+    const uint32_t before = received(t);
+    restore_interrupts(save);
+    if (before - w->start > t->ringsize)
+    {
+        t->stats.numoverruns++;
+        return false;
+    }
+
+    for (int i = 0; i < w->length; ++i)
+        data[i] = (uint8_t) t->ring[(w->start + i) & (t->ringsize - 1)];
+
+    // the dma might have come round while we were copying.
+    save = save_and_disable_interrupts();
+    const uint32_t after = received(t);
+    restore_interrupts(save);
+    if (after - w->start > t->ringsize)
+    {
+        t->stats.numoverruns++;
+        return false;
+    }
+
+    return true;
+}
+
+void i2ct_get_stats(const I2CTargetHeader* t, I2CTargetStats* stats)
+{
+    *stats = t->stats;
+}
@@ -0,0 +1,139 @@
+#pragma once
+#include "coroutine.h"
+#include "spscqueue.h"
+#include "hardware/i2c.h"
+
+
+// the other side of the bus: the pico as an i2c target (slave) with a register map, for some host mcu.
+// usual register protocol: the first byte of a write sets the register pointer, following bytes are data, reads carry on
+// from the pointer, both auto-increment (reads wrap around at the end of the map).
+//
+// - reads never involve a coro: on a read request the irq handler points a dma channel at the register map and that's it,
+//   the controller stretches the clock until the first byte is in the fifo. a master nak at the end flushes the rest.
+// - the map is double-buffered: the app changes its copy and publishes it in one go. a read that's in progress keeps
+//   reading from the old one, so the host always sees a consistent snapshot.
+//   (served maps are 16 bits per register: 8-bit writes to data_cmd would get replicated into the cmd bits.)
+// - written bytes go through a second dma channel into a ring, the irq handler only looks at them on stop. complete
+//   write transactions get queued up for a coro, which wakes once per batch, not per byte.
+//
+// one irq per transaction (two for reads: request and end), regardless of how many bytes.
+// the i2c instance is exclusive: don't use the controller driver (i2c.h) on it too.
+
+
+// how many write transactions can be waiting for the coro.
+#ifndef PICORO_I2CT_MAXWRITES
+#define PICORO_I2CT_MAXWRITES        16
+#endif
+
+
+struct I2CTargetWrite
+{
+    uint32_t    start;      // where the data starts in the ring. counts up forever.
+    uint16_t    length;     // data bytes, not counting the register byte.
+    uint8_t     reg;
+};
+
+struct I2CTargetStats
+{
+    uint32_t    numreads;           // read transactions.
+    uint32_t    numwrites;          // write transactions with data (not those that only set the pointer).
+    uint32_t    numbytesread;
+    uint32_t    numbyteswritten;    // incl register bytes.
+    uint32_t    numoverruns;        // writes whose data the ring had overwritten before the coro got to it.
+    uint32_t    numdropped;         // writes that found the queue to the coro full.
+    uint32_t    numirqs;
+};
+
+/**
+ * Common stuff for I2CTarget<>.
+ * Treat as opaque.
+ */
+struct I2CTargetHeader
+{
+    i2c_inst_t*         i2c;
+    uint8_t*            map;            // the app's copy.
+    uint16_t*           servemaps[2];
+    volatile uint8_t    front;          // which servemap reads are served from.
+    int                 numregs;
+
+    volatile uint16_t*  ring;           // data_cmd words as they came in, incl the first-data-byte flag.
+    uint32_t            ringsize;
+    int                 rxchannel;
+    int                 txchannel;
+
+    // irq handler only.
+    uint32_t            rxbase;         // ring entries before the rx dma was last (re)started.
+    uint32_t            scanned;        // ring entries looked at so far.
+    uint32_t            writestart;     // ring index of the current write's first data byte, or ~0 if there's no write going on.
+    uint8_t             writereg;
+    uint8_t             pointer;
+    volatile bool       txactive;
+    const uint16_t*     txmap;
+    uint8_t             txstart;
+    uint32_t            txcount;
+
+    SpscQueue<I2CTargetWrite, PICORO_I2CT_MAXWRITES>    writes;
+    I2CTargetStats      stats;
+};
+
+template <int NumRegs_, int RingSize_>
+struct I2CTarget : I2CTargetHeader
+{
+    static const int NumRegs = NumRegs_;
+    static const int RingSize = RingSize_;
+    static_assert(NumRegs > 0 && NumRegs <= 256);
+    // dma wraps the ring by address bits, in bytes: 2^1 .. 2^15.
+    static_assert(RingSize >= 2 && (RingSize & (RingSize - 1)) == 0 && RingSize * 2 <= 32768, "ring size needs to be a power of two");
+
+    uint8_t             mapstorage[NumRegs];
+    uint16_t            servestorage[2][NumRegs];
+    alignas(RingSize * 2) uint16_t  ringstorage[RingSize];
+};
+
+
+/** @internal */
+extern void init_i2c_target(I2CTargetHeader* t, i2c_inst_t* i2c, uint8_t address, int numregs, uint8_t* map, uint16_t* serve0, uint16_t* serve1, volatile uint16_t* ring, uint32_t ringsize);
+
+/**
+ * @brief Starts answering on address. The caller has called i2c_init() and set up the pins. Both maps start out as zeros.
+ * t needs to stay alive until stop_i2c_target().
+ */
+template <int NumRegs, int RingSize>
+void start_i2c_target(I2CTarget<NumRegs, RingSize>* t, i2c_inst_t* i2c, uint8_t address)
+{
+    init_i2c_target(t, i2c, address, NumRegs, &t->mapstorage[0], &t->servestorage[0][0], &t->servestorage[1][0], &t->ringstorage[0], RingSize);
+}
+
+/**
+ * @brief Stops answering, frees the dma channels and the irq.
+ */
+extern void stop_i2c_target(I2CTargetHeader* t);
+
+/**
+ * @brief The app's copy of the map. Change it as you like, the host sees none of it until i2ct_publish().
+ */
+static inline uint8_t* i2ct_get_map(I2CTargetHeader* t)
+{
+    return t->map;
+}
+
+/**
+ * @brief Makes the app's copy of the map the one reads are served from. Reads that have started already finish off the old one.
+ * Yields if the previous-but-one publish is still being read from. Call from a coro only.
+ */
+extern void i2ct_publish(I2CTargetHeader* t);
+
+/**
+ * @brief Yields until the host has written something, then pops up to max writes in one go.
+ * Call from a coro only.
+ * @return how many were popped, at least 1.
+ */
+extern int i2ct_wait_writes(I2CTargetHeader* t, I2CTargetWrite* writes, int max);
+
+/**
+ * @brief Copies w's data (w->length bytes) out of the ring.
+ * @return false if the ring has wrapped over it already, i.e. the coro is not keeping up. Make the ring bigger.
+ */
+extern bool i2ct_get_write_data(I2CTargetHeader* t, const I2CTargetWrite* w, uint8_t* data);
+
+extern void i2ct_get_stats(const I2CTargetHeader* t, I2CTargetStats* stats);
@@ -0,0 +1,444 @@
+#pragma once
+#include "pico/stdlib.h"
+
+// more intrusive containers, in the spirit of linkedlist.h: the link lives inside the user's struct, nothing gets allocated.
+// but instead of byte offsets (LL_ACCESS) the container types carry a member pointer, so the compiler checks the types for us.
+//
+//   struct Thing { uint32_t key; DListEntry listentry; HeapEntry heapentry; };
+//   DList<Thing, &Thing::listentry>                                  list;
+//   PairingHeap<Thing, &Thing::heapentry, uint32_t, &Thing::key>     heap;
+//   HashTable<Thing, uint32_t, &Thing::key, 16>                      table;
+
+
+/** @internal From pointer-to-member back to pointer-to-enclosing-struct. */
+template <typename T, typename E>
+static inline T* intrusive_container_of(E* entry, E T::* member)
+{
+    if (entry == NULL)
+        return NULL;
+    const uintptr_t offset = (uintptr_t) &(((T*) 0)->*member);
+    return (T*) (((uint8_t*) entry) - offset);
+}
+
+
+// ---- doubly-linked list ----
+// same as LinkedList, but removing from the middle is O(1).
+
+struct DListEntry
+{
+    DListEntry*     next;
+    DListEntry*     prev;
+};
+
+template <typename T, DListEntry T::* Entry>
+struct DList
+{
+    typedef T   ValueType;
+
+    DListEntry*     head;
+    DListEntry*     tail;
+};
+
+template <typename T, DListEntry T::* Entry>
+static inline void dl_init_list(DList<T, Entry>* list)
+{
+    list->head = NULL;
+    list->tail = NULL;
+}
+
+template <typename T, DListEntry T::* Entry>
+static inline bool dl_is_empty(const DList<T, Entry>* list)
+{
+    if (list->head == NULL)
+        return true;
+    // if not empty, ie we have a head then we should also have a tail
+    assert(list->tail != NULL);
+    return false;
+}
+
+template <typename T, DListEntry T::* Entry>
+static inline T* dl_peek_head(DList<T, Entry>* list)
+{
+    return intrusive_container_of(list->head, Entry);
+}
+
+template <typename T, DListEntry T::* Entry>
+static inline T* dl_peek_tail(DList<T, Entry>* list)
+{
+    return intrusive_container_of(list->tail, Entry);
+}
+
+// next element after value, or NULL at the end.
+template <typename T, DListEntry T::* Entry>
+static inline T* dl_next(DList<T, Entry>* list, T* value)
+{
+    return intrusive_container_of((value->*Entry).next, Entry);
+}
+
+template <typename T, DListEntry T::* Entry>
+static inline void dl_push_back(DList<T, Entry>* list, T* value)
+{
+    DListEntry* e = &(value->*Entry);
+    // catch easy mistake: a value can only be in one list at a time, there's only 1 intrusive link!
+    assert(e != list->head);
+    assert(e != list->tail);
+
+    e->next = NULL;
+    e->prev = list->tail;
+    if (list->tail != NULL)
+        list->tail->next = e;
+    else
+        list->head = e;
+    list->tail = e;
+}
+
+template <typename T, DListEntry T::* Entry>
+static inline void dl_push_front(DList<T, Entry>* list, T* value)
+{
+    DListEntry* e = &(value->*Entry);
+    assert(e != list->head);
+    assert(e != list->tail);
+
+    e->prev = NULL;
+    e->next = list->head;
+    if (list->head != NULL)
+        list->head->prev = e;
+    else
+        list->tail = e;
+    list->head = e;
+}
+
+// inserts value in front of before. before == NULL means at the end.
+template <typename T, DListEntry T::* Entry>
+static inline void dl_insert_before(DList<T, Entry>* list, T* before, T* value)
+{
+    if (before == NULL)
+    {
+        dl_push_back(list, value);
+        return;
+    }
+
+    DListEntry* b = &(before->*Entry);
+    DListEntry* e = &(value->*Entry);
+    e->next = b;
+    e->prev = b->prev;
+    if (b->prev != NULL)
+        b->prev->next = e;
+    else
+        list->head = e;
+    b->prev = e;
+}
+
+/**
+ * @brief Unlinks value, which needs to be in list. O(1), unlike ll_remove().
+ */
+template <typename T, DListEntry T::* Entry>
+static inline void dl_remove(DList<T, Entry>* list, T* value)
+{
+    DListEntry* e = &(value->*Entry);
+
+    if (e->prev != NULL)
+        e->prev->next = e->next;
+    else
+    {
+        assert(list->head == e);
+        list->head = e->next;
+    }
+
+    if (e->next != NULL)
+        e->next->prev = e->prev;
+    else
+    {
+        assert(list->tail == e);
+        list->tail = e->prev;
+    }
+
+#ifndef NDEBUG
+    e->next = (DListEntry*) 0xdeadbeef;
+    e->prev = (DListEntry*) 0xdeadbeef;
+#endif
+}
+
+template <typename T, DListEntry T::* Entry>
+static inline T* dl_pop_front(DList<T, Entry>* list)
+{
+    T* value = dl_peek_head(list);
+    if (value != NULL)
+        dl_remove(list, value);
+    return value;
+}
+
+
+// ---- pairing heap ----
+// min-heap. push and peek are O(1), pop and remove are amortised O(log n).
+// ties come out in no particular order.
+
+struct HeapEntry
+{
+    HeapEntry*      child;      // leftmost child
+    HeapEntry*      sibling;    // next sibling to the right
+    HeapEntry*      prev;       // parent if leftmost child, otherwise left sibling. NULL for the root.
+};
+
+template <typename T, HeapEntry T::* Entry, typename K, K T::* Key>
+struct PairingHeap
+{
+    typedef T   ValueType;
+
+    HeapEntry*      root;
+};
+
+template <typename T, HeapEntry T::* Entry, typename K, K T::* Key>
+static inline void ph_init_heap(PairingHeap<T, Entry, K, Key>* heap)
+{
+    heap->root = NULL;
+}
+
+template <typename T, HeapEntry T::* Entry, typename K, K T::* Key>
+static inline bool ph_is_empty(const PairingHeap<T, Entry, K, Key>* heap)
+{
+    return heap->root == NULL;
+}
+
+template <typename T, HeapEntry T::* Entry, typename K, K T::* Key>
+static inline T* ph_peek_min(PairingHeap<T, Entry, K, Key>* heap)
+{
+    return intrusive_container_of(heap->root, Entry);
+}
+
+/** @internal Links two roots, the bigger one becomes the leftmost child of the smaller one. */
+template <typename T, HeapEntry T::* Entry, typename K, K T::* Key>
+static inline HeapEntry* ph_meld(HeapEntry* a, HeapEntry* b)
+{
+    if (a == NULL)
+        return b;
+    if (b == NULL)
+        return a;
+
+    if (intrusive_container_of(b, Entry)->*Key < intrusive_container_of(a, Entry)->*Key)
+    {
+        HeapEntry* t = a;
+        a = b;
+        b = t;
+    }
+
+    b->prev = a;
+    b->sibling = a->child;
+    if (a->child != NULL)
+        a->child->prev = b;
+    a->child = b;
+    a->sibling = NULL;
+    a->prev = NULL;
+    return a;
+}
+
+/** @internal Standard two-pass pairing of a sibling list. */
+template <typename T, HeapEntry T::* Entry, typename K, K T::* Key>
+static inline HeapEntry* ph_merge_pairs(HeapEntry* first)
+{
+    // pass 1: meld pairs left to right, chaining the results up in reverse through the sibling pointer.
+    HeapEntry* paired = NULL;
+    while (first != NULL)
+    {
+        HeapEntry* a = first;
+        HeapEntry* b = a->sibling;
+        first = (b != NULL) ? b->sibling : NULL;
+
+        a->sibling = NULL;
+        if (b != NULL)
+            b->sibling = NULL;
+        HeapEntry* m = ph_meld<T, Entry, K, Key>(a, b);
+        m->sibling = paired;
+        paired = m;
+    }
+
+    // pass 2: meld right to left.
+    HeapEntry* root = NULL;
+    while (paired != NULL)
+    {
+        HeapEntry* next = paired->sibling;
+        paired->sibling = NULL;
+        root = ph_meld<T, Entry, K, Key>(root, paired);
+        paired = next;
+    }
+
+    return root;
+}
+
+template <typename T, HeapEntry T::* Entry, typename K, K T::* Key>
+static inline void ph_push(PairingHeap<T, Entry, K, Key>* heap, T* value)
+{
+    HeapEntry* e = &(value->*Entry);
+    e->child = NULL;
+    e->sibling = NULL;
+    e->prev = NULL;
+    heap->root = ph_meld<T, Entry, K, Key>(heap->root, e);
+}
+
+template <typename T, HeapEntry T::* Entry, typename K, K T::* Key>
+static inline T* ph_pop_min(PairingHeap<T, Entry, K, Key>* heap)
+{
+    HeapEntry* root = heap->root;
+    if (root == NULL)
+        return NULL;
+
+    heap->root = ph_merge_pairs<T, Entry, K, Key>(root->child);
+    if (heap->root != NULL)
+        heap->root->prev = NULL;
+
+    return intrusive_container_of(root, Entry);
+}
+
+/**
+ * @brief Takes value out of the heap, wherever it is. value needs to be in heap.
+ * To change a key: remove, change, push.
+ */
+template <typename T, HeapEntry T::* Entry, typename K, K T::* Key>
+static inline void ph_remove(PairingHeap<T, Entry, K, Key>* heap, T* value)
+{
+    HeapEntry* e = &(value->*Entry);
+    if (e == heap->root)
+    {
+        ph_pop_min(heap);
+        return;
+    }
+
+    // cut e (with its subtree) out of its sibling list.
+    if (e->prev->child == e)
+        e->prev->child = e->sibling;
+    else
+        e->prev->sibling = e->sibling;
+    if (e->sibling != NULL)
+        e->sibling->prev = e->prev;
+
+    // its children form a heap of their own, put that back in.
+    HeapEntry* sub = ph_merge_pairs<T, Entry, K, Key>(e->child);
+    if (sub != NULL)
+        sub->prev = NULL;
+    heap->root = ph_meld<T, Entry, K, Key>(heap->root, sub);
+}
+
+
+// ---- open-addressing hash table ----
+// fixed capacity (power of two), linear probing, stores pointers to the user's structs and reads the key through the member pointer.
+// deleting shifts the following entries back, so there are no tombstones and lookups never degrade.
+
+template <typename K>
+static inline uint32_t intrusive_hash(const K& key)
+{
+    static_assert(sizeof(K) <= sizeof(uint32_t), "provide your own hash for bigger keys");
+    // fibonacci hashing. good enough for ints and pointers.
+    return ((uint32_t) key) * 2654435769u;
+}
+
+template <typename T, typename K, K T::* Key, int Capacity_, uint32_t (*Hash)(const K&) = intrusive_hash<K>>
+struct HashTable
+{
+    typedef T   ValueType;
+    static const int Capacity = Capacity_;
+    static const uint32_t Mask = Capacity_ - 1;
+    static_assert(Capacity > 1 && (Capacity & (Capacity - 1)) == 0, "hash table size needs to be a power of two");
+
+    int     count;
+    T*      slots[Capacity];
+};
+
+template <typename T, typename K, K T::* Key, int C, uint32_t (*H)(const K&)>
+static inline void ht_init_table(HashTable<T, K, Key, C, H>* table)
+{
+    table->count = 0;
+    for (int i = 0; i < C; ++i)
+        table->slots[i] = NULL;
+}
+
+/** @internal Home slot for key: the low bits, after folding the top half onto them. Fibonacci hashing mixes best into the top bits, a custom hash might only mix the low ones. */
+template <typename T, typename K, K T::* Key, int C, uint32_t (*H)(const K&)>
+static inline uint32_t ht_home_slot(const K& key)
+{
+    const uint32_t h = H(key);
+    return (h ^ (h >> 16)) & HashTable<T, K, Key, C, H>::Mask;
+}
+
+template <typename T, typename K, K T::* Key, int C, uint32_t (*H)(const K&)>
+static inline T* ht_find(HashTable<T, K, Key, C, H>* table, const K& key)
+{
+    typedef HashTable<T, K, Key, C, H> HT;
+
+    for (uint32_t i = ht_home_slot<T, K, Key, C, H>(key); ; i = (i + 1) & HT::Mask)
+    {
+        T* v = table->slots[i];
+        // there's always at least one empty slot, so this terminates.
+        if (v == NULL)
+            return NULL;
+        if (v->*Key == key)
+            return v;
+    }
+}
+
+/**
+ * @brief Adds value, under its key.
+ * @return false if there's already an entry with the same key, or if the table is full.
+ *         (full means Capacity - 1 entries: one slot always stays empty.)
+ */
+template <typename T, typename K, K T::* Key, int C, uint32_t (*H)(const K&)>
+static inline bool ht_insert(HashTable<T, K, Key, C, H>* table, T* value)
+{
+    typedef HashTable<T, K, Key, C, H> HT;
+
+    if (table->count >= C - 1)
+        return false;
+
+    for (uint32_t i = ht_home_slot<T, K, Key, C, H>(value->*Key); ; i = (i + 1) & HT::Mask)
+    {
+        T* v = table->slots[i];
+        if (v == NULL)
+        {
+            table->slots[i] = value;
+            table->count++;
+            return true;
+        }
+        if (v->*Key == value->*Key)
+            return false;
+    }
+}
+
+/**
+ * @brief Takes the entry for key out of the table.
+ * @return the entry, or NULL if there was none.
+ */
+template <typename T, typename K, K T::* Key, int C, uint32_t (*H)(const K&)>
+static inline T* ht_remove(HashTable<T, K, Key, C, H>* table, const K& key)
+{
+    typedef HashTable<T, K, Key, C, H> HT;
+
+    uint32_t i = ht_home_slot<T, K, Key, C, H>(key);
+    while (true)
+    {
+        T* v = table->slots[i];
+        if (v == NULL)
+            return NULL;
+        if (v->*Key == key)
+            break;
+        i = (i + 1) & HT::Mask;
+    }
+
+    T* removed = table->slots[i];
+    table->count--;
+
+    // backward shift: pull following entries into the hole, unless they are already at (or before) their home slot.
+    uint32_t hole = i;
+    for (uint32_t j = (i + 1) & HT::Mask; table->slots[j] != NULL; j = (j + 1) & HT::Mask)
+    {
+        const uint32_t home = ht_home_slot<T, K, Key, C, H>(table->slots[j]->*Key);
+        // can j move to hole? only if its home is not in (hole, j], cyclically.
+        const bool homeinbetween = ((j - home) & HT::Mask) < ((j - hole) & HT::Mask);
+        if (!homeinbetween)
+        {
+            table->slots[hole] = table->slots[j];
+            hole = j;
+        }
+    }
+    table->slots[hole] = NULL;
+
+    return removed;
+}
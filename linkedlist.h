@@ -191,3 +191,5 @@ static inline void ll_sorted_insert(struct LinkedList* list, struct LinkedListEn
 #define LL_ACCESS(enclosingstructptr, listentrymembername, ptr)   LL_ACCESS_INTERNAL<typeof(enclosingstructptr)>(ptr, -offsetof(typeof(*enclosingstructptr), listentrymembername))
 
 extern "C" void ll_unit_test();
+// timings of intrusive.h's DList and PairingHeap against the ll_* ops above, on the same entries.
+extern "C" void ll_benchmark();
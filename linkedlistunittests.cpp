@@ -1,4 +1,6 @@
 #include "linkedlist.h"
+#include "intrusive.h"
+#include <stdio.h>
 
 #if !PICO_PRINTF_ALWAYS_INCLUDED
 // if the above symbol is not defined then assert's printf does not work!
@@ -13,6 +15,13 @@ struct UnitTestListEntry
     struct LinkedListEntry  listentry;
 };
 
+struct UnitTestIntrusiveEntry
+{
+    uint32_t    key;
+    DListEntry  dlistentry;
+    HeapEntry   heapentry;
+};
+
 extern "C" void ll_unit_test()
 {
     struct LinkedList   list;
@@ -130,4 +139,208 @@ extern "C" void ll_unit_test()
     ll_sorted_insert<(int) offsetof(UnitTestListEntry, someothervalue) - (int) offsetof(UnitTestListEntry, listentry), uint32_t>(&list, &value4.listentry);
     CHECK(&value1.listentry == ll_peek_head(&list));
     CHECK(&value4.listentry == ll_peek_tail(&list));
+
+
+    // intrusive.h
+
+    UnitTestIntrusiveEntry  entries[8];
+    for (int i = 0; i < 8; ++i)
+        entries[i].key = (i * 5) % 8;   // 0 5 2 7 4 1 6 3
+
+
+    // dl_*
+
+    DList<UnitTestIntrusiveEntry, &UnitTestIntrusiveEntry::dlistentry>  dlist;
+    dl_init_list(&dlist);
+    CHECK(dl_is_empty(&dlist));
+    CHECK(dl_pop_front(&dlist) == NULL);
+
+    dl_push_back(&dlist, &entries[1]);
+    dl_push_back(&dlist, &entries[2]);
+    dl_push_front(&dlist, &entries[0]);
+    dl_insert_before(&dlist, &entries[2], &entries[3]);  // order is: e0, e1, e3, e2
+    CHECK(dl_peek_head(&dlist) == &entries[0]);
+    CHECK(dl_peek_tail(&dlist) == &entries[2]);
+    CHECK(dl_next(&dlist, &entries[1]) == &entries[3]);
+
+    dl_remove(&dlist, &entries[3]);         // remove in the middle
+    CHECK(dl_next(&dlist, &entries[1]) == &entries[2]);
+    dl_remove(&dlist, &entries[2]);         // remove tail
+    CHECK(dl_peek_tail(&dlist) == &entries[1]);
+    dl_remove(&dlist, &entries[0]);         // remove head
+    CHECK(dl_peek_head(&dlist) == &entries[1]);
+    CHECK(dl_pop_front(&dlist) == &entries[1]);
+    CHECK(dl_is_empty(&dlist));
+
+
+    // ph_*
+
+    PairingHeap<UnitTestIntrusiveEntry, &UnitTestIntrusiveEntry::heapentry, uint32_t, &UnitTestIntrusiveEntry::key>  heap;
+    ph_init_heap(&heap);
+    CHECK(ph_is_empty(&heap));
+    CHECK(ph_pop_min(&heap) == NULL);
+
+    for (int i = 0; i < 8; ++i)
+        ph_push(&heap, &entries[i]);
+    CHECK(ph_peek_min(&heap)->key == 0);
+
+    // take out some that are (most likely) not the root: keys 5 and 3.
+    ph_remove(&heap, &entries[1]);
+    ph_remove(&heap, &entries[7]);
+    // and the root: key 0.
+    ph_remove(&heap, &entries[0]);
+
+    const uint32_t expectedkeys[] = {1, 2, 4, 6, 7};
+    for (unsigned int i = 0; i < count_of(expectedkeys); ++i)
+    {
+        UnitTestIntrusiveEntry* min = ph_pop_min(&heap);
+        CHECK(min != NULL && min->key == expectedkeys[i]);
+    }
+    CHECK(ph_is_empty(&heap));
+
+
+    // ht_*
+
+    HashTable<UnitTestIntrusiveEntry, uint32_t, &UnitTestIntrusiveEntry::key, 8>  table;
+    ht_init_table(&table);
+    CHECK(ht_find(&table, 0u) == NULL);
+
+    // one slot always stays empty.
+    for (int i = 0; i < 7; ++i)
+        CHECK(ht_insert(&table, &entries[i]));
+    CHECK(!ht_insert(&table, &entries[7]));
+    CHECK(table.count == 7);
+
+    for (int i = 0; i < 7; ++i)
+        CHECK(ht_find(&table, entries[i].key) == &entries[i]);
+    CHECK(ht_find(&table, entries[7].key) == NULL);
+
+    // removing shifts the others back, they all need to stay findable.
+    CHECK(ht_remove(&table, entries[2].key) == &entries[2]);
+    CHECK(ht_remove(&table, entries[2].key) == NULL);
+    for (int i = 0; i < 7; ++i)
+        CHECK(ht_find(&table, entries[i].key) == ((i == 2) ? NULL : &entries[i]));
+
+    CHECK(ht_insert(&table, &entries[7]));
+    CHECK(!ht_insert(&table, &entries[7]));   // same key again
+    CHECK(ht_find(&table, entries[7].key) == &entries[7]);
+}
+
+
+struct BenchmarkEntry
+{
+    uint32_t        key;
+    LinkedListEntry listentry;
+    DListEntry      dlistentry;
+    HeapEntry       heapentry;
+};
+
+static BenchmarkEntry   benchmarkentries[128];
+static uint32_t         benchmarkseed;
+
+static uint32_t benchmark_random()
+{
+    benchmarkseed = benchmarkseed * 1664525 + 1013904223;
+    return benchmarkseed >> 8;
+}
+
+// a timer queue's kind of traffic: take the earliest, put it back a bit later.
+static uint64_t benchmark_ll_requeue(int n, int iterations)
+{
+    static const int    keyoffset = (int) offsetof(BenchmarkEntry, key) - (int) offsetof(BenchmarkEntry, listentry);
+
+    LinkedList  list;
+    ll_init_list(&list);
+    benchmarkseed = 1;
+    for (int i = 0; i < n; ++i)
+    {
+        benchmarkentries[i].key = benchmark_random() % 1000;
+        ll_sorted_insert<keyoffset, uint32_t>(&list, &benchmarkentries[i].listentry);
+    }
+
+    const uint64_t starttime = time_us_64();
+    for (int i = 0; i < iterations; ++i)
+    {
+        BenchmarkEntry* e = LL_ACCESS(e, listentry, ll_pop_front(&list));
+        e->key += benchmark_random() % 1000;
+        ll_sorted_insert<keyoffset, uint32_t>(&list, &e->listentry);
+    }
+    return time_us_64() - starttime;
+}
+
+static uint64_t benchmark_ph_requeue(int n, int iterations)
+{
+    PairingHeap<BenchmarkEntry, &BenchmarkEntry::heapentry, uint32_t, &BenchmarkEntry::key>  heap;
+    ph_init_heap(&heap);
+    benchmarkseed = 1;
+    for (int i = 0; i < n; ++i)
+    {
+        benchmarkentries[i].key = benchmark_random() % 1000;
+        ph_push(&heap, &benchmarkentries[i]);
+    }
+
+    const uint64_t starttime = time_us_64();
+    for (int i = 0; i < iterations; ++i)
+    {
+        BenchmarkEntry* e = ph_pop_min(&heap);
+        e->key += benchmark_random() % 1000;
+        ph_push(&heap, e);
+    }
+    return time_us_64() - starttime;
+}
+
+// a wait list's kind of traffic: any one of them leaves, and queues up again at the end.
+static uint64_t benchmark_ll_remove(int n, int iterations)
+{
+    LinkedList  list;
+    ll_init_list(&list);
+    for (int i = 0; i < n; ++i)
+        ll_push_back(&list, &benchmarkentries[i].listentry);
+
+    benchmarkseed = 1;
+    const uint64_t starttime = time_us_64();
+    for (int i = 0; i < iterations; ++i)
+    {
+        BenchmarkEntry* e = &benchmarkentries[benchmark_random() % n];
+        ll_remove(&list, &e->listentry);
+        ll_push_back(&list, &e->listentry);
+    }
+    return time_us_64() - starttime;
+}
+
+static uint64_t benchmark_dl_remove(int n, int iterations)
+{
+    DList<BenchmarkEntry, &BenchmarkEntry::dlistentry>  list;
+    dl_init_list(&list);
+    for (int i = 0; i < n; ++i)
+        dl_push_back(&list, &benchmarkentries[i]);
+
+    benchmarkseed = 1;
+    const uint64_t starttime = time_us_64();
+    for (int i = 0; i < iterations; ++i)
+    {
+        BenchmarkEntry* e = &benchmarkentries[benchmark_random() % n];
+        dl_remove(&list, e);
+        dl_push_back(&list, e);
+    }
+    return time_us_64() - starttime;
+}
+
+extern "C" void ll_benchmark()
+{
+    static const int    iterations = 20000;
+    const int           sizes[] = {8, 32, 128};
+
+    for (unsigned int i = 0; i < count_of(sizes); ++i)
+    {
+        const int n = sizes[i];
+        // in ns per iteration.
+        const uint64_t llrequeue = benchmark_ll_requeue(n, iterations) * 1000 / iterations;
+        const uint64_t phrequeue = benchmark_ph_requeue(n, iterations) * 1000 / iterations;
+        const uint64_t llremove = benchmark_ll_remove(n, iterations) * 1000 / iterations;
+        const uint64_t dlremove = benchmark_dl_remove(n, iterations) * 1000 / iterations;
+
+        printf("intrusive: n=%d, pop+sorted_insert: ll %llu ns, ph %llu ns. remove+push_back: ll %llu ns, dl %llu ns\n", n,
+            (unsigned long long) llrequeue, (unsigned long long) phrequeue, (unsigned long long) llremove, (unsigned long long) dlremove);
+    }
 }
@@ -1,17 +1,13 @@
 #include "mpu.h"
 #include "hardware/structs/mpu.h"
+#include "hardware/sync.h"
 #include <cassert>
 
 
-#ifndef PICO_FLASH_SIZE_BYTES
-#error
-#endif
+static uint32_t     claimedregions = 0;
 
-#if PICO_NO_FLASH
-#error
-#endif
 
-int find_free_mpu_region()
+static int find_free_mpu_region()
 {
 #ifndef NDEBUG
     // the pico cpu has 8 mpu regions.
@@ -25,6 +21,10 @@ int find_free_mpu_region()
     // the last region will have been used by the pico-sdk to setup the mainflow stack guard, see pico-sdk/src/rp2_common/pico_runtime/runtime.c
     for (int i = 0; i < numregions; ++i)
     {
+        // claimed but not enabled (yet) is still in use.
+        if (claimedregions & (1 << i))
+            continue;
+
         mpu_hw->rnr = i;
         // region already in use?
         if (mpu_hw->rasr & M0PLUS_MPU_RASR_ENABLE_BITS)
@@ -37,9 +37,48 @@ int find_free_mpu_region()
     return -1;
 }
 
-bool block_unused_flash()
+int claim_mpu_region()
 {
+    // mpu_hw->rnr is global state, so is claimedregions.
+    uint32_t save = save_and_disable_interrupts();
+
     int region = find_free_mpu_region();
+    if (region != -1)
+        claimedregions |= 1 << region;
+
+    restore_interrupts(save);
+    return region;
+}
+
+void unclaim_mpu_region(int region)
+{
+    assert(region >= 0 && region < 8);
+    assert(claimedregions & (1 << region));
+
+    uint32_t save = save_and_disable_interrupts();
+
+    mpu_hw->rnr = region;
+    mpu_hw->rasr = 0;
+    claimedregions &= ~(1 << region);
+
+    restore_interrupts(save);
+}
+
+uint32_t get_claimed_mpu_regions()
+{
+    return claimedregions;
+}
+
+#if !defined(PICO_FLASH_SIZE_BYTES) || PICO_NO_FLASH
+bool block_unused_flash()
+{
+    // no flash, nothing to block.
+    return false;
+}
+#else
+bool block_unused_flash()
+{
+    int region = claim_mpu_region();
     if (region == -1)
         return false;
 
@@ -75,3 +114,4 @@ bool block_unused_flash()
 
     return true;
 }
+#endif // if !defined(PICO_FLASH_SIZE_BYTES) || PICO_NO_FLASH
@@ -1,4 +1,17 @@
 #pragma once
+#include <stdint.h>
+
+
+// the pico has 8 mpu regions. they are shared between the pico-sdk's mainflow stack guard, picoro's stack guards and block_unused_flash().
+// so everyone (apart from the sdk) should claim regions through here, instead of scanning for free ones on their own.
+
+// returns the region number, or -1 if there's none left.
+// the region is not enabled, that's up to the caller.
+extern int claim_mpu_region();
+// disables the region and makes it available again.
+extern void unclaim_mpu_region(int region);
+// bit per region that has been claimed through claim_mpu_region().
+extern uint32_t get_claimed_mpu_regions();
 
 // mpu-protects all accesses to unused flash, as determined by linker at build time.
 extern bool block_unused_flash();
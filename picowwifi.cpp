@@ -4,8 +4,7 @@
 #include "lwip/tcp.h"
 #include "lwip/dns.h"
 #include <algorithm>
-#define RINGBUFFER_SIZE 4
-#include "ringbuffer.h"
+#include "requestqueue.h"
 
 
 #if PICORO_WIFIFUNC_IN_RAM
@@ -28,56 +27,8 @@ enum WifiCmd
     NONE = 0xdeadbeef
 };
 
-struct SendUdpOrTcpCmdBuf
-{
-    const char*     host;
-    int             port;
-    const char*     buffer;
-    int             bufferlength;
-    bool*           success;
-    char*           responsebuffer;
-    int*            responselength;
-};
-
-struct CmdRingbufferEntry
-{
-    WifiCmd             cmd;
-    Waitable            waitable;
-
-
-    union
-    {
-        struct
-        {
-            const char*     ssid;
-            const char*     pw;
-            bool*           success;
-        } connect;
-
-        struct SendUdpOrTcpCmdBuf      send_udp_or_tcp;
-
-        struct
-        {
-            const char*         host;
-            uint64_t*           ms_since_1970;
-            absolute_time_t*    localts;
-        } getntp;
-
-        struct
-        {
-            const char*     host;
-            const char*     url;
-            char*           responsebuffer;
-            int*            bufferlength;
-            int             port;
-        } httphead;
-    };
-};
-
 static Coroutine<640>       wifiblock;
-static RingBuffer           cmdindices;
-static CmdRingbufferEntry   cmdringbuffer[RINGBUFFER_SIZE];
-static Waitable             newcmdswaitable;
+static AsyncQueue<WifiRequest>  queue;
 
 
 static void WIFIFUNC(handle_disconnect)()
@@ -933,234 +884,156 @@ static uint32_t WIFIFUNC(wififunc)(uint32_t param)
 {
     PROFILE_THIS_FUNC;
 
-    bool keepspinning = true;
+    // (re-)started, after a disconnect the queue was closed.
+    aq_init(&queue);
 
-    while (keepspinning)
+    while (true)
     {
-        if (!rb_is_empty(&cmdindices))
-        {
-            // not empty, so do the thing.
-            CmdRingbufferEntry&  c = cmdringbuffer[rb_peek_front(&cmdindices)];
+        WifiRequest* c = aq_wait_next(&queue);
+        if (c == NULL)
+            break;
 
-            switch (c.cmd)
-            {
-                case CONNECT:
-                    handle_connect(c.connect.ssid, c.connect.pw, c.connect.success);
-                    break;
-                    
-                case DISCONNECT:
-                    handle_disconnect();
-                    keepspinning = false;
-                    break;
+        bool keepspinning = true;
+        switch (c->cmd)
+        {
+            case CONNECT:
+                handle_connect(c->connect.ssid, c->connect.pw, c->connect.success);
+                break;
                 
-                case SENDUDP:
-                    handle_sendudptcp<false>(&c.send_udp_or_tcp);
-                    break;
-                case SENDTCP:
-                    handle_sendudptcp<true>(&c.send_udp_or_tcp);
-                    break;
+            case DISCONNECT:
+                handle_disconnect();
+                keepspinning = false;
+                break;
+            
+            case SENDUDP:
+                handle_sendudptcp<false>(&c->send_udp_or_tcp);
+                break;
+            case SENDTCP:
+                handle_sendudptcp<true>(&c->send_udp_or_tcp);
+                break;
 
-                case GETNTP:
-                    handle_getntp(c.getntp.host, c.getntp.ms_since_1970, c.getntp.localts);
-                    break;
+            case GETNTP:
+                handle_getntp(c->getntp.host, c->getntp.ms_since_1970, c->getntp.localts);
+                break;
 
-                case HTTPHEAD:
-                    handle_httphead(c.httphead.host, c.httphead.url, c.httphead.port, c.httphead.responsebuffer, c.httphead.bufferlength);
-                    break;
+            case HTTPHEAD:
+                handle_httphead(c->httphead.host, c->httphead.url, c->httphead.port, c->httphead.responsebuffer, c->httphead.bufferlength);
+                break;
 
-                default:
-                    assert(false);
-                    break;
-            }
+            default:
+                assert(false);
+                break;
+        }
 
 #ifndef NDEBUG
-            c.cmd = NONE;
+        c->cmd = NONE;
 #endif
-            signal(&c.waitable);
-
-            rb_pop_front(&cmdindices);
-        }
+        aq_complete(&queue, c);
 
         if (!keepspinning)
+        {
+            // whatever got queued after the disconnect won't happen, but its waiters still need to wake up.
+            aq_close(&queue, true);
             break;
-
-        yield_and_wait4signal(&newcmdswaitable);
+        }
     }
 
     return 0;
 }
 
-Waitable* WIFIFUNC(disconnect_wifi)()
+// safe to "start" multiple times.
+// FIXME: but yielding too often is unnecessary
+static Waitable* WIFIFUNC(submit)(WifiRequest* req)
 {
-    PROFILE_THIS_FUNC;
-
-    // safe to "start" multiple times.
-    // FIXME: but yielding too often is unnecessary
     yield_and_start(wififunc, 0, &wifiblock);
 
-    while (rb_is_full(&cmdindices))
-    {
-        // FIXME: does not work with countable semaphores!
-        __breakpoint();
-        yield_and_wait4signal(&cmdringbuffer[rb_peek_front(&cmdindices)].waitable);
-    }
-
-    CmdRingbufferEntry&  c = cmdringbuffer[rb_push_back(&cmdindices)];
-    c.cmd = DISCONNECT;
-
-    // tell driver that there are new cmds waiting.
-    signal(&newcmdswaitable);
-
-    return &c.waitable;
+    // wakes the driver if it's waiting for more.
+    return aq_submit(&queue, req);
 }
 
-Waitable* WIFIFUNC(connect_wifi)(const char* ssid, const char* pw, bool* success)
+Waitable* WIFIFUNC(disconnect_wifi)(WifiRequest* req)
 {
     PROFILE_THIS_FUNC;
 
-    // safe to "start" multiple times.
-    // FIXME: but yielding too often is unnecessary
-    yield_and_start(wififunc, 0, &wifiblock);
-
-
-    while (rb_is_full(&cmdindices))
-    {
-        // FIXME: does not work with countable semaphores!
-        __breakpoint();
-        yield_and_wait4signal(&cmdringbuffer[rb_peek_front(&cmdindices)].waitable);
-    }
-
-    CmdRingbufferEntry&  c = cmdringbuffer[rb_push_back(&cmdindices)];
-    c.cmd = CONNECT;
-    c.connect.success = success;
-    c.connect.ssid = ssid;
-    c.connect.pw = pw;
+    req->cmd = DISCONNECT;
+    return submit(req);
+}
 
-    // tell driver that there are new cmds waiting.
-    signal(&newcmdswaitable);
+Waitable* WIFIFUNC(connect_wifi)(WifiRequest* req, const char* ssid, const char* pw, bool* success)
+{
+    PROFILE_THIS_FUNC;
 
-    return &c.waitable;
+    req->cmd = CONNECT;
+    req->connect.success = success;
+    req->connect.ssid = ssid;
+    req->connect.pw = pw;
+    return submit(req);
 }
 
-Waitable* WIFIFUNC(get_ntp)(const char* host, uint64_t* ms_since_1970, absolute_time_t* localts)
+Waitable* WIFIFUNC(get_ntp)(WifiRequest* req, const char* host, uint64_t* ms_since_1970, absolute_time_t* localts)
 {
     PROFILE_THIS_FUNC;
 
     assert(ms_since_1970 != NULL);
     assert(localts != NULL);
 
-    // safe to "start" multiple times.
-    // FIXME: but yielding too often is unnecessary
-    yield_and_start(wififunc, 0, &wifiblock);
-
-    while (rb_is_full(&cmdindices))
-    {
-        // FIXME: does not work with countable semaphores!
-        __breakpoint();
-        yield_and_wait4signal(&cmdringbuffer[rb_peek_front(&cmdindices)].waitable);
-    }
-
-    CmdRingbufferEntry&  c = cmdringbuffer[rb_push_back(&cmdindices)];
-    c.cmd = GETNTP;
-    c.getntp.host = host;
-    c.getntp.ms_since_1970 = ms_since_1970;
-    c.getntp.localts = localts;
-
-    // tell driver that there are new cmds waiting.
-    signal(&newcmdswaitable);
-
-    return &c.waitable;
+    req->cmd = GETNTP;
+    req->getntp.host = host;
+    req->getntp.ms_since_1970 = ms_since_1970;
+    req->getntp.localts = localts;
+    return submit(req);
 }
 
-Waitable* WIFIFUNC(send_tcp)(const char* host, int port, const char* buffer, int bufferlength, bool* success, char* responsebuffer, int* responsebufferlength)
+Waitable* WIFIFUNC(send_tcp)(WifiRequest* req, const char* host, int port, const char* buffer, int bufferlength, bool* success, char* responsebuffer, int* responsebufferlength)
 {
     PROFILE_THIS_FUNC;
 
-    // safe to "start" multiple times.
-    // FIXME: but yielding too often is unnecessary
-    yield_and_start(wififunc, 0, &wifiblock);
-
-    while (rb_is_full(&cmdindices))
-    {
-        // FIXME: does not work with countable semaphores!
-        __breakpoint();
-        yield_and_wait4signal(&cmdringbuffer[rb_peek_front(&cmdindices)].waitable);
-    }
-
-    CmdRingbufferEntry&  c = cmdringbuffer[rb_push_back(&cmdindices)];
-    c.cmd = SENDTCP;
-    c.send_udp_or_tcp.host = host;
-    c.send_udp_or_tcp.port = port;
-    c.send_udp_or_tcp.buffer = buffer;
-    c.send_udp_or_tcp.bufferlength = bufferlength;
-    c.send_udp_or_tcp.success = success;
-    c.send_udp_or_tcp.responsebuffer = responsebuffer;
-    c.send_udp_or_tcp.responselength = responsebufferlength;
-
-    // tell driver that there are new cmds waiting.
-    signal(&newcmdswaitable);
-
-    return &c.waitable;
+    req->cmd = SENDTCP;
+    req->send_udp_or_tcp.host = host;
+    req->send_udp_or_tcp.port = port;
+    req->send_udp_or_tcp.buffer = buffer;
+    req->send_udp_or_tcp.bufferlength = bufferlength;
+    req->send_udp_or_tcp.success = success;
+    req->send_udp_or_tcp.responsebuffer = responsebuffer;
+    req->send_udp_or_tcp.responselength = responsebufferlength;
+    return submit(req);
 }
 
-Waitable* WIFIFUNC(send_udp)(const char* host, int port, const char* buffer, int bufferlength, bool* maybesuccess, char* responsebuffer, int* responsebufferlength)
+Waitable* WIFIFUNC(send_udp)(WifiRequest* req, const char* host, int port, const char* buffer, int bufferlength, bool* maybesuccess, char* responsebuffer, int* responsebufferlength)
 {
     PROFILE_THIS_FUNC;
 
-    // safe to "start" multiple times.
-    // FIXME: but yielding too often is unnecessary
-    yield_and_start(wififunc, 0, &wifiblock);
-
-    while (rb_is_full(&cmdindices))
-    {
-        // FIXME: does not work with countable semaphores!
-        __breakpoint();
-        yield_and_wait4signal(&cmdringbuffer[rb_peek_front(&cmdindices)].waitable);
-    }
-
-    CmdRingbufferEntry&  c = cmdringbuffer[rb_push_back(&cmdindices)];
-    c.cmd = SENDUDP;
-    c.send_udp_or_tcp.host = host;
-    c.send_udp_or_tcp.port = port;
-    c.send_udp_or_tcp.buffer = buffer;
-    c.send_udp_or_tcp.bufferlength = bufferlength;
-    c.send_udp_or_tcp.success = maybesuccess;
-    c.send_udp_or_tcp.responsebuffer = responsebuffer;
-    c.send_udp_or_tcp.responselength = responsebufferlength;
-
-    // tell driver that there are new cmds waiting.
-    signal(&newcmdswaitable);
-
-    return &c.waitable;
+    req->cmd = SENDUDP;
+    req->send_udp_or_tcp.host = host;
+    req->send_udp_or_tcp.port = port;
+    req->send_udp_or_tcp.buffer = buffer;
+    req->send_udp_or_tcp.bufferlength = bufferlength;
+    req->send_udp_or_tcp.success = maybesuccess;
+    req->send_udp_or_tcp.responsebuffer = responsebuffer;
+    req->send_udp_or_tcp.responselength = responsebufferlength;
+    return submit(req);
 }
 
-Waitable* WIFIFUNC(httpreq_head)(const char* host, const char* url, int port, char* responsebuffer, int* bufferlength)
+Waitable* WIFIFUNC(httpreq_head)(WifiRequest* req, const char* host, const char* url, int port, char* responsebuffer, int* bufferlength)
 {
     if (responsebuffer != NULL)
         assert(bufferlength != NULL);
 
-    // safe to "start" multiple times.
-    // FIXME: but yielding too often is unnecessary
-    yield_and_start(wififunc, 0, &wifiblock);
-
-
-    while (rb_is_full(&cmdindices))
-    {
-        // FIXME: does not work with countable semaphores!
-        __breakpoint();
-        yield_and_wait4signal(&cmdringbuffer[rb_peek_front(&cmdindices)].waitable);
-    }
-
-    CmdRingbufferEntry&  c = cmdringbuffer[rb_push_back(&cmdindices)];
-    c.cmd = HTTPHEAD;
-    c.httphead.host = host;
-    c.httphead.url = url;
-    c.httphead.port = port;
-    c.httphead.responsebuffer = responsebuffer;
-    c.httphead.bufferlength = bufferlength;
+    req->cmd = HTTPHEAD;
+    req->httphead.host = host;
+    req->httphead.url = url;
+    req->httphead.port = port;
+    req->httphead.responsebuffer = responsebuffer;
+    req->httphead.bufferlength = bufferlength;
+    return submit(req);
+}
 
-    // tell driver that there are new cmds waiting.
-    signal(&newcmdswaitable);
+bool WIFIFUNC(cancel_wifi_request)(WifiRequest* req)
+{
+    return aq_cancel(&queue, req);
+}
 
-    return &c.waitable;
+void WIFIFUNC(get_wifi_queue_stats)(AsyncQueueStats* stats)
+{
+    aq_get_stats(&queue, stats);
 }
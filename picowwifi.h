@@ -1,5 +1,6 @@
 #pragma once
 #include "coroutine.h"
+#include "requestqueue.h"
 
 
 // define to place wifi functions in ram.
@@ -8,29 +9,87 @@
 #endif
 
 
+/** @internal */
+struct SendUdpOrTcpCmdBuf
+{
+    const char*     host;
+    int             port;
+    const char*     buffer;
+    int             bufferlength;
+    bool*           success;
+    char*           responsebuffer;
+    int*            responselength;
+};
+
+/**
+ * One wifi command. Caller-owned: needs to stay alive (and untouched) until its waitable has signalled.
+ * Can be reused once it has. Treat as opaque.
+ */
+struct WifiRequest : AsyncRequest
+{
+    uint32_t            cmd;
+
+    union
+    {
+        struct
+        {
+            const char*     ssid;
+            const char*     pw;
+            bool*           success;
+        } connect;
+
+        struct SendUdpOrTcpCmdBuf      send_udp_or_tcp;
+
+        struct
+        {
+            const char*         host;
+            uint64_t*           ms_since_1970;
+            absolute_time_t*    localts;
+        } getntp;
+
+        struct
+        {
+            const char*     host;
+            const char*     url;
+            char*           responsebuffer;
+            int*            bufferlength;
+            int             port;
+        } httphead;
+    };
+};
+
+
+// all of these queue up req and return its waitable. they may yield (to start the wifi driver coro).
+
 // will yield internally, async wrt caller.
 // ssid and pw need to outlive the returned Waitable!
-extern Waitable* connect_wifi(const char* ssid, const char* pw, bool* success);
+extern Waitable* connect_wifi(WifiRequest* req, const char* ssid, const char* pw, bool* success);
 // disconnects and stops all wifi stuff. driver will exit.
-extern Waitable* disconnect_wifi();
+extern Waitable* disconnect_wifi(WifiRequest* req);
 
 // does a http head request and returns the value of the date header (as an unparsed string).
 // FIXME: incorrect function name...
-extern Waitable* httpreq_head(const char* host, const char* url, int port, char* responsebuffer, int* bufferlength);
+extern Waitable* httpreq_head(WifiRequest* req, const char* host, const char* url, int port, char* responsebuffer, int* bufferlength);
 
 // sends the byte contents of buffer to host:port using one(!) udp packet.
 // this is not meant for continous stream but rather for small amounts of one-off data.
 // if responsebuffer is non-null then it'll wait for a response, up to some (unspecified) timeout expires.
 // it will receive at most responsebufferlength and discard the rest. server might repond less though.
-extern Waitable* send_udp(const char* host, int port, const char* buffer, int bufferlength, bool* maybesuccess, char* responsebuffer = NULL, int* responsebufferlength = NULL);
+extern Waitable* send_udp(WifiRequest* req, const char* host, int port, const char* buffer, int bufferlength, bool* maybesuccess, char* responsebuffer = NULL, int* responsebufferlength = NULL);
 
 // sends the byte contents of buffer to host:port using tcp.
 // should be used for small amounts of one-off data.
 // if responsebuffer is non-null then it'll wait for a response, up to some (unspecified) timeout expires.
 // it will receive at most responsebufferlength and discard the rest. server might repond less though.
-extern Waitable* send_tcp(const char* host, int port, const char* buffer, int bufferlength, bool* success, char* responsebuffer = NULL, int* responsebufferlength = NULL);
+extern Waitable* send_tcp(WifiRequest* req, const char* host, int port, const char* buffer, int bufferlength, bool* success, char* responsebuffer = NULL, int* responsebufferlength = NULL);
 
 
 // sntp only, see https://www.rfc-editor.org/rfc/rfc4330
 // returns milliseconds since 1970 (unix epoch) that correspond to a local microsecond watchdog time.
-extern Waitable* get_ntp(const char* host, uint64_t* ms_since_1970, absolute_time_t* localts);
+extern Waitable* get_ntp(WifiRequest* req, const char* host, uint64_t* ms_since_1970, absolute_time_t* localts);
+
+// takes req back out of the queue, if the driver has not started on it yet. its waitable signals then.
+extern bool cancel_wifi_request(WifiRequest* req);
+
+// depth, wait and service times of the driver's queue.
+extern void get_wifi_queue_stats(AsyncQueueStats* stats);
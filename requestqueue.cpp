@@ -0,0 +1,339 @@
+#include "requestqueue.h"
+#include "coroutine.h"
+#include "profiler.h"
+#include "pico/stdlib.h"
+#include <string.h>
+
+
+// true if a is due before b. time_us_32() wraps, so compare the difference.
+static bool is_earlier(uint32_t a, uint32_t b)
+{
+    return (int32_t) (a - b) < 0;
+}
+
+static void enqueue(AsyncQueueHeader* q, AsyncRequest* r)
+{
+    assert(r->lane < AQ_NUMLANES);
+
+    r->status = AQ_QUEUED;
+
+    // without deadline: at the back. with: ahead of the first that has none, or a later one.
+    // lanes are short, walking them is cheaper than keeping a heap per lane.
+    auto* lane = &q->queued[r->lane];
+    AsyncRequest* before = NULL;
+    if (r->hasdeadline)
+    {
+        for (before = dl_peek_head(lane); before != NULL; before = dl_next(lane, before))
+            if (!before->hasdeadline || is_earlier(r->deadline, before->deadline))
+                break;
+    }
+    if (before != NULL)
+        dl_insert_before(lane, before, r);
+    else
+        dl_push_back(lane, r);
+
+    q->stats.depth++;
+    if (q->stats.depth > q->stats.maxdepth)
+        q->stats.maxdepth = q->stats.depth;
+
+    AsyncLaneStats& ls = q->stats.lanes[r->lane];
+    ls.numsubmitted++;
+    ls.depth++;
+    if (ls.depth > ls.maxdepth)
+        ls.maxdepth = ls.depth;
+
+    // only signal if the driver is actually waiting. otherwise a burst of submits would pile up counts on the semaphore.
+    if (q->driverwaiting)
+    {
+        q->driverwaiting = false;
+        signal(&q->newrequests);
+    }
+}
+
+static void dequeue(AsyncQueueHeader* q, AsyncRequest* r)
+{
+    dl_remove(&q->queued[r->lane], r);
+    q->stats.depth--;
+    q->stats.lanes[r->lane].depth--;
+}
+
+// which lane aq_wait_next() takes from next. -1 if all are empty.
+static int pick_lane(const AsyncQueueHeader* q)
+{
+    const bool hasurgent = !dl_is_empty(&q->queued[AQ_LANE_URGENT]);
+    const bool hasbulk = !dl_is_empty(&q->queued[AQ_LANE_BULK]);
+
+    if (hasurgent && hasbulk)
+        return ((q->urgentburst > 0) && (q->urgentstreak >= q->urgentburst)) ? AQ_LANE_BULK : AQ_LANE_URGENT;
+    if (hasurgent)
+        return AQ_LANE_URGENT;
+    if (hasbulk)
+        return AQ_LANE_BULK;
+    return -1;
+}
+
+static bool has_space(const AsyncQueueHeader* q)
+{
+    return (q->limit == 0) || (q->stats.depth < (uint32_t) q->limit);
+}
+
+// moves blocked submitters over into the queue, as far as there's space, in the order they arrived.
+static void admit_blocked(AsyncQueueHeader* q)
+{
+    while (has_space(q) && !dl_is_empty(&q->blocked))
+    {
+        AsyncRequest* r = dl_pop_front(&q->blocked);
+        CoroutineHeader* submitter = r->submitter;
+        r->submitter = NULL;
+        enqueue(q, r);
+        // the submitter sleeps in aq_submit(), waiting for its status to change.
+        wakeup(submitter);
+    }
+}
+
+static void cancel(AsyncQueueHeader* q, AsyncRequest* r)
+{
+    r->status = AQ_CANCELLED;
+    q->stats.numcancelled++;
+    signal(&r->waitable);
+}
+
+void aq_init(AsyncQueueHeader* q, int limit)
+{
+    assert(limit >= 0);
+
+    for (int i = 0; i < AQ_NUMLANES; ++i)
+        dl_init_list(&q->queued[i]);
+    dl_init_list(&q->blocked);
+    q->newrequests.semaphore = 0;
+    q->limit = limit;
+    q->urgentburst = PICORO_AQ_URGENT_BURST;
+    q->urgentstreak = 0;
+    q->driverwaiting = false;
+    q->closed = false;
+    memset(&q->stats, 0, sizeof(q->stats));
+}
+
+void aq_close(AsyncQueueHeader* q, bool cancelpending)
+{
+    PROFILE_THIS_FUNC;
+
+    q->closed = true;
+
+    if (cancelpending)
+    {
+        for (int i = 0; i < AQ_NUMLANES; ++i)
+        {
+            for (AsyncRequest* r = dl_peek_head(&q->queued[i]); r != NULL; r = dl_peek_head(&q->queued[i]))
+            {
+                dequeue(q, r);
+                cancel(q, r);
+            }
+        }
+        for (AsyncRequest* r = dl_pop_front(&q->blocked); r != NULL; r = dl_pop_front(&q->blocked))
+        {
+            CoroutineHeader* submitter = r->submitter;
+            r->submitter = NULL;
+            cancel(q, r);
+            wakeup(submitter);
+        }
+    }
+
+    // driver might be asleep, waiting for more. it needs to see that there won't be any.
+    if (q->driverwaiting)
+    {
+        q->driverwaiting = false;
+        signal(&q->newrequests);
+    }
+}
+
+static bool submit(AsyncQueueHeader* q, AsyncRequest* r, bool mayblock)
+{
+    // it's a mistake to submit a request that's still in flight.
+    assert(r->status != AQ_BLOCKED && r->status != AQ_QUEUED && r->status != AQ_ACTIVE);
+
+    // left over from a previous round if nobody waited on it.
+    r->waitable.semaphore = 0;
+    r->cancelrequested = false;
+    r->submitter = NULL;
+    r->queuedtime = time_us_32();
+
+    if (q->closed)
+    {
+        // still counts as submitted, so that numcancelled never runs ahead of numsubmitted.
+        q->stats.numsubmitted++;
+        cancel(q, r);
+        return true;
+    }
+
+    // also wait if others are blocked already, so nobody can overtake them.
+    if (!has_space(q) || !dl_is_empty(&q->blocked))
+    {
+        if (!mayblock)
+            return false;
+
+        r->status = AQ_BLOCKED;
+        r->submitter = get_current_coroutine();
+        dl_push_back(&q->blocked, r);
+        q->stats.numsubmitted++;
+        q->stats.numblocked++;
+
+        // admit_blocked() or a cancel will change our status, and wake us.
+        while (r->status == AQ_BLOCKED)
+            yield_and_wait4wakeup();
+        return true;
+    }
+
+    q->stats.numsubmitted++;
+    enqueue(q, r);
+    return true;
+}
+
+Waitable* aq_submit(AsyncQueueHeader* q, AsyncRequest* r)
+{
+    PROFILE_THIS_FUNC;
+
+    submit(q, r, true);
+    return &r->waitable;
+}
+
+bool aq_try_submit(AsyncQueueHeader* q, AsyncRequest* r)
+{
+    PROFILE_THIS_FUNC;
+
+    return submit(q, r, false);
+}
+
+bool aq_cancel(AsyncQueueHeader* q, AsyncRequest* r)
+{
+    PROFILE_THIS_FUNC;
+
+    switch (r->status)
+    {
+        case AQ_QUEUED:
+            dequeue(q, r);
+            cancel(q, r);
+            admit_blocked(q);
+            return true;
+
+        case AQ_BLOCKED:
+        {
+            dl_remove(&q->blocked, r);
+            CoroutineHeader* submitter = r->submitter;
+            r->submitter = NULL;
+            cancel(q, r);
+            wakeup(submitter);
+            return true;
+        }
+
+        case AQ_ACTIVE:
+            // up to the driver whether it can do anything about it.
+            r->cancelrequested = true;
+            return false;
+
+        default:
+            // done already, or never submitted.
+            return false;
+    }
+}
+
+AsyncRequest* aq_wait_next(AsyncQueueHeader* q)
+{
+    PROFILE_THIS_FUNC;
+
+    while (true)
+    {
+        const int lane = pick_lane(q);
+        if (lane >= 0)
+        {
+            AsyncRequest* r = dl_peek_head(&q->queued[lane]);
+            dequeue(q, r);
+            admit_blocked(q);
+
+            // only counts while bulk is actually waiting.
+            if (lane == AQ_LANE_URGENT)
+                q->urgentstreak = dl_is_empty(&q->queued[AQ_LANE_BULK]) ? 0 : q->urgentstreak + 1;
+            else
+            {
+                if (!dl_is_empty(&q->queued[AQ_LANE_URGENT]))
+                    q->stats.numfairnesspicks++;
+                q->urgentstreak = 0;
+            }
+
+            r->status = AQ_ACTIVE;
+            r->servicestart = time_us_32();
+            const uint32_t waittime = r->servicestart - r->queuedtime;
+            q->stats.waittime_us += waittime;
+            if (waittime > q->stats.maxwaittime_us)
+                q->stats.maxwaittime_us = waittime;
+
+            AsyncLaneStats& ls = q->stats.lanes[lane];
+            ls.waittime_us += waittime;
+            if (waittime > ls.maxwaittime_us)
+                ls.maxwaittime_us = waittime;
+            if (r->hasdeadline && is_earlier(r->deadline, r->servicestart))
+                ls.nummissed++;
+            return r;
+        }
+
+        if (q->closed)
+            return NULL;
+
+        q->driverwaiting = true;
+        yield_and_wait4signal(&q->newrequests);
+    }
+}
+
+AsyncRequest* aq_peek_next(AsyncQueueHeader* q)
+{
+    const int lane = pick_lane(q);
+    return (lane >= 0) ? dl_peek_head(&q->queued[lane]) : NULL;
+}
+
+void aq_set_fairness(AsyncQueueHeader* q, int urgentburst)
+{
+    assert(urgentburst >= 0);
+    q->urgentburst = urgentburst;
+}
+
+void aq_complete(AsyncQueueHeader* q, AsyncRequest* r)
+{
+    PROFILE_THIS_FUNC;
+
+    assert(r->status == AQ_ACTIVE);
+
+    const uint32_t servicetime = time_us_32() - r->servicestart;
+    q->stats.servicetime_us += servicetime;
+    if (servicetime > q->stats.maxservicetime_us)
+        q->stats.maxservicetime_us = servicetime;
+    q->stats.numcompleted++;
+
+    r->status = AQ_DONE;
+    // careful: r may be gone as soon as the signal is out.
+    signal(&r->waitable);
+}
+
+void aq_begin_direct(AsyncRequest* r)
+{
+    assert(r->status != AQ_BLOCKED && r->status != AQ_QUEUED && r->status != AQ_ACTIVE);
+
+    r->waitable.semaphore = 0;
+    r->cancelrequested = false;
+    r->submitter = NULL;
+    r->status = AQ_ACTIVE;
+    // no wait, for whoever looks at the times.
+    r->queuedtime = r->servicestart = time_us_32();
+}
+
+void aq_complete_direct(AsyncRequest* r)
+{
+    assert(r->status == AQ_ACTIVE);
+
+    r->status = AQ_DONE;
+    signal(&r->waitable);
+}
+
+void aq_get_stats(const AsyncQueueHeader* q, AsyncQueueStats* stats)
+{
+    *stats = q->stats;
+}
@@ -0,0 +1,227 @@
+#pragma once
+#include "coroutine.h"
+#include "intrusive.h"
+
+
+// the bits that every driver needs: callers hand in requests, one driver coro works through them, callers wait for completion.
+// requests are owned by the caller and linked in intrusively, so nothing gets copied and there's no fixed depth.
+// (the caller's request needs to stay alive until it has completed or been cancelled.)
+//
+// everything here is meant to be called from coros on core0 only, not from irq handlers.
+// the scheduler is cooperative, so there's no locking needed.
+// software timer callbacks (see SoftwareTimer) run on core0 too, but on the scheduler's stack, so they must not yield:
+// from there only the ones that never do, e.g. aq_try_submit(), aq_cancel() and aq_get_stats(). not aq_submit() or aq_wait_next().
+
+
+enum AsyncRequestStatus
+{
+    AQ_IDLE = 0,        // never submitted.
+    AQ_BLOCKED,         // queue was full, submitter is waiting for space.
+    AQ_QUEUED,
+    AQ_ACTIVE,          // the driver is working on it.
+    AQ_DONE,
+    AQ_CANCELLED        // cancelled before the driver got to it, or the queue was closed.
+};
+
+// each queue has two lanes. the driver serves urgent before bulk, but lets a bulk request through every so often, see aq_set_fairness().
+// requests go into the urgent lane unless marked otherwise, i.e. if nobody uses lanes it's one fifo.
+enum AsyncRequestLane
+{
+    AQ_LANE_URGENT = 0,
+    AQ_LANE_BULK,
+    AQ_NUMLANES
+};
+
+// default for aq_set_fairness().
+#ifndef PICORO_AQ_URGENT_BURST
+#define PICORO_AQ_URGENT_BURST       4
+#endif
+
+/**
+ * Base for a driver's request descriptor, derive from it and put the driver-specific stuff in there.
+ * Treat as opaque, apart from waitable and status.
+ */
+struct AsyncRequest
+{
+    DListEntry          listentry;
+    Waitable            waitable;           // signals once the request is done or cancelled.
+    volatile uint8_t    status;             // AsyncRequestStatus
+    bool                cancelrequested;    // cancel came in while the driver was busy with it.
+    CoroutineHeader*    submitter;          // only while blocked.
+    uint32_t            queuedtime;         // time_us_32(), for stats.
+    uint32_t            servicestart;
+    uint8_t             lane;               // AsyncRequestLane, see aq_set_lane().
+    bool                hasdeadline;
+    uint32_t            deadline;           // time_us_32() by when it should have started.
+
+    AsyncRequest()
+        : status(AQ_IDLE), lane(AQ_LANE_URGENT), hasdeadline(false)
+    {
+    }
+};
+
+struct AsyncLaneStats
+{
+    uint32_t    numsubmitted;
+    uint32_t    depth;              // queued (not active), right now.
+    uint32_t    maxdepth;
+    uint64_t    waittime_us;        // submitted until the driver picked it up, summed.
+    uint32_t    maxwaittime_us;
+    uint32_t    nummissed;          // picked up after their deadline.
+};
+
+struct AsyncQueueStats
+{
+    uint32_t    numsubmitted;
+    uint32_t    numcompleted;
+    uint32_t    numcancelled;
+    uint32_t    numblocked;         // submits that had to wait for space.
+    uint32_t    depth;              // queued (not active), right now.
+    uint32_t    maxdepth;
+    uint64_t    waittime_us;        // submitted until the driver picked it up (including time blocked), summed.
+    uint32_t    maxwaittime_us;
+    uint64_t    servicetime_us;     // picked up until complete, summed.
+    uint32_t    maxservicetime_us;
+    uint32_t    numfairnesspicks;   // bulk requests served ahead of waiting urgent ones.
+    AsyncLaneStats  lanes[AQ_NUMLANES];
+};
+
+/**
+ * One per driver (instance).
+ * Treat as opaque.
+ */
+struct AsyncQueueHeader
+{
+    DList<AsyncRequest, &AsyncRequest::listentry>   queued[AQ_NUMLANES];    // by deadline, then in order of arrival.
+    DList<AsyncRequest, &AsyncRequest::listentry>   blocked;    // waiting for space, in order of arrival.
+    Waitable            newrequests;        // the driver waits on this.
+    int                 limit;              // max queued requests (all lanes). 0 means unbounded.
+    int                 urgentburst;        // urgent requests in a row before a waiting bulk one gets its turn.
+    int                 urgentstreak;
+    bool                driverwaiting;
+    bool                closed;
+    AsyncQueueStats     stats;
+};
+
+/**
+ * Typed front for a driver whose requests are T (derived from AsyncRequest).
+ */
+template <typename T>
+struct AsyncQueue : AsyncQueueHeader
+{
+    static_assert(std::is_base_of<AsyncRequest, T>::value, "requests need to derive from AsyncRequest");
+};
+
+
+/**
+ * @brief (Re-)initialises q, with no requests in it.
+ * @param limit how many can be queued before submitters have to wait. 0 for no limit.
+ */
+extern void aq_init(AsyncQueueHeader* q, int limit = 0);
+
+/**
+ * @brief Stops q taking more requests. Submitting to a closed queue cancels the request straight away.
+ * @param cancelpending if true, requests that are still queued get cancelled. otherwise the driver drains them first.
+ * Either way, once empty aq_wait_next() returns NULL so that the driver can exit.
+ */
+extern void aq_close(AsyncQueueHeader* q, bool cancelpending = false);
+
+/**
+ * @brief Caller side: which lane r goes into, next time it's submitted. Sticks for later submits.
+ */
+static inline void aq_set_lane(AsyncRequest* r, AsyncRequestLane lane)
+{
+    r->lane = lane;
+}
+
+/**
+ * @brief Caller side: within its lane, r goes ahead of requests with a later deadline and of those without one (earliest deadline first).
+ * Sticks for later submits, until aq_clear_deadline(). Missing the deadline only shows in the stats, r is served anyway.
+ * @param deadline time_us_32() by when the driver should have picked it up.
+ */
+static inline void aq_set_deadline(AsyncRequest* r, uint32_t deadline)
+{
+    r->hasdeadline = true;
+    r->deadline = deadline;
+}
+
+static inline void aq_clear_deadline(AsyncRequest* r)
+{
+    r->hasdeadline = false;
+}
+
+/**
+ * @brief Driver side: after urgentburst urgent requests in a row, a waiting bulk request goes next. 0 for strict priority.
+ */
+extern void aq_set_fairness(AsyncQueueHeader* q, int urgentburst);
+
+/**
+ * @brief Caller side: queues r. Yields if the queue is at its limit, until there's room.
+ * @return what to yield_and_wait4signal() on for completion.
+ */
+extern Waitable* aq_submit(AsyncQueueHeader* q, AsyncRequest* r);
+
+/**
+ * @brief Caller side: like aq_submit() but never yields.
+ * @return false if the queue is at its limit (r is left alone then).
+ */
+extern bool aq_try_submit(AsyncQueueHeader* q, AsyncRequest* r);
+
+/**
+ * @brief Caller side: cancels r if the driver has not picked it up yet. r's waitable signals then.
+ * If the driver is working on it already, this only raises a flag (see aq_is_cancel_requested()) and completion comes as usual.
+ * @return true if r got cancelled.
+ */
+extern bool aq_cancel(AsyncQueueHeader* q, AsyncRequest* r);
+
+/**
+ * @brief Driver side: yields until there's a request, marks it as active and returns it.
+ * @return NULL once the queue is closed and empty.
+ */
+extern AsyncRequest* aq_wait_next(AsyncQueueHeader* q);
+
+/**
+ * @brief Driver side: returns the next queued request without taking it. Does not yield. NULL if there's none.
+ */
+extern AsyncRequest* aq_peek_next(AsyncQueueHeader* q);
+
+/**
+ * @brief Driver side: r is done. Signals its waitable.
+ */
+extern void aq_complete(AsyncQueueHeader* q, AsyncRequest* r);
+
+/**
+ * @brief True if the driver is waiting for work and nothing is queued.
+ * For drivers that can serve a request straight away on the caller's coro, see aq_begin_direct().
+ */
+static inline bool aq_is_idle(const AsyncQueueHeader* q)
+{
+    return q->driverwaiting && (q->stats.depth == 0) && !q->closed;
+}
+
+/**
+ * @brief Marks r as active without queueing it, the caller serves it directly. Finish with aq_complete_direct().
+ * Does not count towards the queue's stats.
+ */
+extern void aq_begin_direct(AsyncRequest* r);
+extern void aq_complete_direct(AsyncRequest* r);
+
+static inline bool aq_is_cancel_requested(const AsyncRequest* r)
+{
+    return r->cancelrequested;
+}
+
+extern void aq_get_stats(const AsyncQueueHeader* q, AsyncQueueStats* stats);
+
+
+template <typename T>
+static inline T* aq_wait_next(AsyncQueue<T>* q)
+{
+    return static_cast<T*>(aq_wait_next((AsyncQueueHeader*) q));
+}
+
+template <typename T>
+static inline T* aq_peek_next(AsyncQueue<T>* q)
+{
+    return static_cast<T*>(aq_peek_next((AsyncQueueHeader*) q));
+}
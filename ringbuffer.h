@@ -1,67 +1,267 @@
 #pragma once
 #include "pico/stdlib.h"
+#include "hardware/sync.h"
 
-#ifndef RINGBUFFER_SIZE
-#define RINGBUFFER_SIZE     4           // FIXME: should prob be a template parameter?
-#endif
-
-// not a full container, just a companion. manages the indices into an external buffer.
+// fixed-capacity fifo of N elements of T, N needs to be a power of two.
+// begin and end are free-running counters, only masked when indexing into items. so all N slots are usable
+// and wrap-around is an and (instead of a modulo, which on the m0+ can end up as a call into the divider).
+template <typename T, int N>
 struct RingBuffer
 {
-    int     begin;      // read ptr, points to the first element
-    int     end;        // write ptr, points to 1 past the last element
+    static_assert(N > 0 && (N & (N - 1)) == 0, "ringbuffer size needs to be a power of two");
+    static const uint32_t Capacity = N;
+    static const uint32_t Mask = N - 1;
+
+    uint32_t    begin;      // read counter, masked it points to the first element
+    uint32_t    end;        // write counter, masked it points to 1 past the last element
+    T           items[N];
 };
 
 
-static inline void rb_init_ringbuffer(RingBuffer* rb)
+template <typename T, int N>
+static inline void rb_init_ringbuffer(RingBuffer<T, N>* rb)
 {
     rb->begin = rb->end = 0;
 }
 
-static inline bool rb_is_empty(const RingBuffer* rb)
+template <typename T, int N>
+static inline uint32_t rb_size(const RingBuffer<T, N>* rb)
+{
+    // unsigned arithmetic takes care of the counters wrapping.
+    return rb->end - rb->begin;
+}
+
+template <typename T, int N>
+static inline bool rb_is_empty(const RingBuffer<T, N>* rb)
 {
     return (rb->begin == rb->end);
 }
 
-static inline bool rb_is_full(const RingBuffer* rb)
+template <typename T, int N>
+static inline bool rb_is_full(const RingBuffer<T, N>* rb)
 {
-    int end = (rb->end + 1) % RINGBUFFER_SIZE;
-    return (rb->begin == end);
+    return rb_size(rb) == (uint32_t) N;
 }
 
-// returns index into external companion array that you can safely write your data into.
-static inline int rb_push_back(RingBuffer* rb)
+// returns the slot that you can safely write your data into.
+template <typename T, int N>
+static inline T& rb_push_back(RingBuffer<T, N>* rb)
 {
     // it's a mistake to try to add more into ringbuffer if it's full already.
     assert(!rb_is_full(rb));
 
-    int r = rb->end;
-    rb->end = (rb->end + 1) % RINGBUFFER_SIZE;
+    T& r = rb->items[rb->end & RingBuffer<T, N>::Mask];
+    rb->end++;
     return r;
 }
 
-static inline int rb_peek_front(RingBuffer* rb)
+template <typename T, int N>
+static inline T& rb_peek_front(RingBuffer<T, N>* rb)
 {
     // it's a mistake to call peek_front if ringbuffer is empty.
     assert(!rb_is_empty(rb));
 
-    return rb->begin;
+    return rb->items[rb->begin & RingBuffer<T, N>::Mask];
 }
 
-static inline int rb_peek_back(RingBuffer* rb)
+template <typename T, int N>
+static inline T& rb_peek_back(RingBuffer<T, N>* rb)
 {
     // it's a mistake to call peek_back if ringbuffer is empty.
     assert(!rb_is_empty(rb));
 
-    return (rb->end + RINGBUFFER_SIZE - 1) % RINGBUFFER_SIZE;
+    return rb->items[(rb->end - 1) & RingBuffer<T, N>::Mask];
 }
 
-static inline void rb_pop_front(RingBuffer* rb)
+template <typename T, int N>
+static inline void rb_pop_front(RingBuffer<T, N>* rb)
 {
     assert(!rb_is_empty(rb));
-    rb->begin = (rb->begin + 1) % RINGBUFFER_SIZE;
+    rb->begin++;
+}
+
+// copies as many of the count elements at src as fit. returns how many that was.
+template <typename T, int N>
+static inline int rb_push_back_n(RingBuffer<T, N>* rb, const T* src, int count)
+{
+    const uint32_t  n = MIN((uint32_t) count, N - rb_size(rb));
+    const uint32_t  first = rb->end & RingBuffer<T, N>::Mask;
+    // at most two runs: up to the end of items, and the rest from the start.
+    const uint32_t  run1 = MIN(n, N - first);
+
+    for (uint32_t i = 0; i < run1; ++i)
+        rb->items[first + i] = src[i];
+    for (uint32_t i = run1; i < n; ++i)
+        rb->items[i - run1] = src[i];
+
+    rb->end += n;
+    return n;
+}
+
+// copies up to count elements into dst and removes them. returns how many that was.
+template <typename T, int N>
+static inline int rb_pop_front_n(RingBuffer<T, N>* rb, T* dst, int count)
+{
+    const uint32_t  n = MIN((uint32_t) count, rb_size(rb));
+    const uint32_t  first = rb->begin & RingBuffer<T, N>::Mask;
+    const uint32_t  run1 = MIN(n, N - first);
+
+    for (uint32_t i = 0; i < run1; ++i)
+        dst[i] = rb->items[first + i];
+    for (uint32_t i = run1; i < n; ++i)
+        dst[i] = rb->items[i - run1];
+
+    rb->begin += n;
+    return n;
+}
+
+
+
+// bip-buffer: a ring that only ever hands out contiguous regions, for dma to write into (or read out of) directly.
+// not a full container, just a companion. manages offsets into an external buffer of size elements.
+// once the writer gets close to the end it skips whatever is left there and carries on at the start;
+// watermark remembers where the valid data ends, so the reader knows where to wrap.
+// lock-free for one producer (e.g. a dma irq handler) and one consumer (e.g. a coro): each field has exactly one writer.
+struct BipBuffer
+{
+    volatile uint32_t   read;           // consumer only
+    volatile uint32_t   write;          // producer only
+    volatile uint32_t   watermark;      // producer only. end of valid data while the writer has wrapped ahead of the reader.
+    uint32_t            reservestart;   // producer only
+    uint32_t            reservelength;  // producer only
+    uint32_t            size;
+};
+
+
+static inline void bb_init(BipBuffer* bb, int size)
+{
+    assert(size > 1);
+    bb->read = 0;
+    bb->write = 0;
+    bb->watermark = size;
+    bb->reservestart = 0;
+    bb->reservelength = 0;
+    bb->size = size;
+}
+
+/**
+ * @brief Producer side: reserves a contiguous region to write into.
+ * With minlength <= 0 it picks the largest region there is. Otherwise it prefers the space at the end of the buffer,
+ * as long as that's at least minlength, and only wraps to the start if it has to.
+ * Only one reservation at a time, finish it with bb_commit().
+ * @param length gets the length of the region
+ * @return offset into the buffer, or -1 if there's no (big enough) region.
+ */
+static inline int bb_reserve(BipBuffer* bb, int minlength, int* length)
+{
+    const uint32_t  write = bb->write;
+    const uint32_t  read = bb->read;
+    uint32_t        start = write;
+    uint32_t        avail = 0;
+
+    if (write < read)
+    {
+        // writer has wrapped already, can go up to (but not onto) the reader.
+        avail = read - write - 1;
+    }
+    else
+    {
+        const uint32_t  atend = bb->size - write;
+        // the start is free up to the reader. but not onto it, otherwise read == write would look empty.
+        const uint32_t  atstart = (read > 0) ? (read - 1) : 0;
+
+        if ((minlength <= 0) ? (atend >= atstart) : (atend >= (uint32_t) minlength))
+            avail = atend;
+        else
+        {
+            start = 0;
+            avail = atstart;
+        }
+    }
+
+    if (avail == 0 || (int) avail < minlength)
+    {
+        *length = 0;
+        return -1;
+    }
+
+    bb->reservestart = start;
+    bb->reservelength = avail;
+    *length = avail;
+    return start;
 }
 
+/**
+ * @brief Producer side: makes used elements of the last reservation visible to the consumer.
+ * Safe to call from an IRQ handler, e.g. dma completion.
+ */
+static inline void bb_commit(BipBuffer* bb, int used)
+{
+    assert(used >= 0 && (uint32_t) used <= bb->reservelength);
+
+    const uint32_t  write = bb->write;
+    const uint32_t  newwrite = bb->reservestart + used;
+
+    // data needs to be in memory before the consumer can see the new indices.
+    __dmb();
+    if ((newwrite < write) && (write != bb->size))
+    {
+        // wrapped to the start, skipping the rest at the end. the reader has to stop where we were.
+        bb->watermark = write;
+    }
+    else if (newwrite > bb->watermark)
+    {
+        // passed the old watermark, i.e. the reader has wrapped too. whole buffer is fair game again.
+        bb->watermark = bb->size;
+    }
+    // watermark before write: consumer reads them in the opposite order.
+    __dmb();
+    bb->write = newwrite;
+    bb->reservelength = 0;
+}
+
+/**
+ * @brief Consumer side: finds the contiguous span of data that's ready to read.
+ * @param length gets the length of the span
+ * @return offset into the buffer, or -1 if empty.
+ */
+static inline int bb_peek(BipBuffer* bb, int* length)
+{
+    const uint32_t  write = bb->write;
+    __dmb();
+    const uint32_t  watermark = bb->watermark;
+    uint32_t        read = bb->read;
+
+    // reached the end of the valid data and the writer has wrapped: so do we.
+    if ((read == watermark) && (write < read))
+    {
+        read = 0;
+        bb->read = 0;
+    }
+
+    const uint32_t  end = (write < read) ? watermark : write;
+    if (end == read)
+    {
+        *length = 0;
+        return -1;
+    }
+
+    // don't read the data before having seen the indices.
+    __dmb();
+    *length = end - read;
+    return read;
+}
+
+/**
+ * @brief Consumer side: frees used elements of the span from bb_peek().
+ */
+static inline void bb_consume(BipBuffer* bb, int used)
+{
+    assert(used >= 0);
+    // done reading before the producer may overwrite it.
+    __dmb();
+    bb->read = bb->read + used;
+}
 
 #if !PICO_PRINTF_ALWAYS_INCLUDED
 // if the above symbol is not defined then assert's printf does not work!
@@ -71,38 +271,108 @@ static inline void rb_pop_front(RingBuffer* rb)
 
 static inline void rb_unit_test()
 {
-    RingBuffer  rb;
+    RingBuffer<int, 4>  rb;
     rb_init_ringbuffer(&rb);
     CHECK(rb_is_empty(&rb));
     CHECK(!rb_is_full(&rb));
 
-    int i0 = rb_push_back(&rb);
+    rb_push_back(&rb) = 100;
     CHECK(!rb_is_empty(&rb));
     CHECK(!rb_is_full(&rb));
 
-    CHECK(rb_peek_front(&rb) == i0);
+    CHECK(rb_peek_front(&rb) == 100);
 
     rb_pop_front(&rb);
     CHECK(rb_is_empty(&rb));
 
-    // rb can store size-1 elements
-    for (int i = 1; i < RINGBUFFER_SIZE; ++i)
+    // rb can store all 4 elements, and we are starting off-center to test wrap-around.
+    for (int i = 0; i < 4; ++i)
     {
-        int k = rb_push_back(&rb);
-        CHECK(k == i);
+        rb_push_back(&rb) = i;
         CHECK(!rb_is_empty(&rb));
-        CHECK(rb_peek_back(&rb) == k);
+        CHECK(rb_peek_back(&rb) == i);
     }
     CHECK(rb_is_full(&rb));
 
-    for (int i = 1; i < RINGBUFFER_SIZE; ++i)
+    for (int i = 0; i < 4; ++i)
     {
-        int k = rb_peek_front(&rb);
-        CHECK(k == i);
+        CHECK(rb_peek_front(&rb) == i);
         rb_pop_front(&rb);
         CHECK(!rb_is_full(&rb));
     }
     CHECK(rb_is_empty(&rb));
+
+    // counters wrapping around the 32-bit range.
+    rb.begin = rb.end = 0xFFFFFFFE;
+    const int src[] = {1, 2, 3, 4, 5};
+    CHECK(rb_push_back_n(&rb, &src[0], 5) == 4);
+    CHECK(rb_is_full(&rb));
+    CHECK(rb_peek_back(&rb) == 4);
+
+    int dst[5] = {0};
+    CHECK(rb_pop_front_n(&rb, &dst[0], 3) == 3);
+    CHECK(dst[0] == 1 && dst[1] == 2 && dst[2] == 3);
+    CHECK(rb_size(&rb) == 1);
+    CHECK(rb_pop_front_n(&rb, &dst[0], 5) == 1);
+    CHECK(dst[0] == 4);
+    CHECK(rb_is_empty(&rb));
+}
+
+static inline void bb_unit_test()
+{
+    BipBuffer   bb;
+    bb_init(&bb, 16);
+
+    int len = 0;
+    CHECK(bb_peek(&bb, &len) == -1);
+
+    // whole buffer is free.
+    CHECK(bb_reserve(&bb, 0, &len) == 0);
+    CHECK(len == 16);
+    bb_commit(&bb, 10);
+
+    CHECK(bb_peek(&bb, &len) == 0);
+    CHECK(len == 10);
+    bb_consume(&bb, 8);
+
+    // 6 at the end, 7 at the start. asking for 7 has to wrap and leave the end unused.
+    CHECK(bb_reserve(&bb, 7, &len) == 0);
+    CHECK(len == 7);
+    bb_commit(&bb, 7);
+
+    // reader still gets what's left before the watermark first, then wraps.
+    CHECK(bb_peek(&bb, &len) == 8);
+    CHECK(len == 2);
+    bb_consume(&bb, 2);
+    CHECK(bb_peek(&bb, &len) == 0);
+    CHECK(len == 7);
+
+    // reader has wrapped as well, so the end is free again.
+    CHECK(bb_reserve(&bb, 0, &len) == 7);
+    CHECK(len == 9);
+    bb_commit(&bb, 9);
+    // and the data is contiguous again.
+    CHECK(bb_peek(&bb, &len) == 0);
+    CHECK(len == 16);
+    bb_consume(&bb, 3);
+
+    // full up to the end, the start is free up to (but not onto) the reader.
+    CHECK(bb_reserve(&bb, 0, &len) == 0);
+    CHECK(len == 2);
+    bb_commit(&bb, 2);
+    CHECK(bb_reserve(&bb, 0, &len) == -1);
+
+    CHECK(bb_peek(&bb, &len) == 3);
+    CHECK(len == 13);
+    bb_consume(&bb, 13);
+    CHECK(bb_peek(&bb, &len) == 0);
+    CHECK(len == 2);
+    bb_consume(&bb, 2);
+    CHECK(bb_peek(&bb, &len) == -1);
 }
 
 #undef CHECK
+
+
+// timings against the index-only, modulo on int version it replaced. in ringbufferbenchmark.cpp.
+extern void rb_benchmark();
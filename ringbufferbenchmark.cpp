@@ -0,0 +1,86 @@
+#include "ringbuffer.h"
+#include <stdio.h>
+
+
+// push 3, pop 3, over and over, on a 64 entry fifo of ints. against how it used to be done: indices only, modulo on int.
+// m0+ numbers are what count, but it builds on a host too, with a time_us_64() from somewhere.
+void rb_benchmark()
+{
+    static const int    Size = 64;
+    static const int    Rounds = 100000;
+    static const int    NumOps = Rounds * 3 * 2;
+
+    static int                      olditems[Size];
+    static RingBuffer<int, Size>    rb;
+    static int                      bulk[3];
+    volatile int                    sink = 0;
+    int                             sum;
+
+    const char*     names[] = {"old % on int", "mask on uint32", "push_n/pop_n"};
+    uint64_t        elapsed[3];
+
+    {
+        int     begin = 0;
+        int     end = 0;
+        sum = 0;
+        const uint64_t starttime = time_us_64();
+        for (int r = 0; r < Rounds; ++r)
+        {
+            for (int i = 0; i < 3; ++i)
+            {
+                olditems[end] = r + i;
+                end = (end + 1) % Size;
+            }
+            for (int i = 0; i < 3; ++i)
+            {
+                sum += olditems[begin];
+                begin = (begin + 1) % Size;
+            }
+        }
+        elapsed[0] = time_us_64() - starttime;
+        sink = sink + sum;
+    }
+
+    {
+        rb_init_ringbuffer(&rb);
+        sum = 0;
+        const uint64_t starttime = time_us_64();
+        for (int r = 0; r < Rounds; ++r)
+        {
+            for (int i = 0; i < 3; ++i)
+                rb_push_back(&rb) = r + i;
+            for (int i = 0; i < 3; ++i)
+            {
+                sum += rb_peek_front(&rb);
+                rb_pop_front(&rb);
+            }
+        }
+        elapsed[1] = time_us_64() - starttime;
+        sink = sink + sum;
+    }
+
+    {
+        rb_init_ringbuffer(&rb);
+        sum = 0;
+        const uint64_t starttime = time_us_64();
+        for (int r = 0; r < Rounds; ++r)
+        {
+            bulk[0] = r;
+            bulk[1] = r + 1;
+            bulk[2] = r + 2;
+            rb_push_back_n(&rb, &bulk[0], 3);
+            rb_pop_front_n(&rb, &bulk[0], 3);
+            sum += bulk[0] + bulk[1] + bulk[2];
+        }
+        elapsed[2] = time_us_64() - starttime;
+        sink = sink + sum;
+    }
+
+    for (int i = 0; i < 3; ++i)
+    {
+        // in 1/100 ns.
+        const unsigned long long perop = elapsed[i] * 100000 / NumOps;
+        printf("ringbuffer: %s: %d push/pops in %llu us, %llu.%02llu ns each\n", names[i], NumOps, (unsigned long long) elapsed[i], perop / 100, perop % 100);
+    }
+    (void) sink;
+}
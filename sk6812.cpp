@@ -3,70 +3,325 @@
 #include <cstring>
 #include "picoro/coroutine.h"
 #include "hardware/dma.h"
+#include "hardware/irq.h"
+#include "hardware/sync.h"
+#include "pico/time.h"
+#include "profiler.h"
 
 
-bool init_sk6812(SK6812Framebuffer* fb, PIO pio, int datapin)
+// 24 bits at 800 kHz.
+#define PIXEL_US        30
+// 4 bit slots at 800 kHz.
+#define PARALLELWORD_US 5
+
+// i2c has the other one.
+static const unsigned int       dmairq = 0;
+
+// indexed by pio * 4 + sm.
+static SK6812Output*    outputs[SK6812_MAXSTRIPS];
+static int              numoutputs;
+
+// where each program is on each pio, and how many outputs use it.
+static const pio_program_t* const   programs[2] = {&sk6812_program, &sk6812_parallel_program};
+static uint         programoffset[2][2];
+static int          programusers[2][2];
+
+static absolute_time_t  statssince;
+
+
+static int output_index(PIO pio, int sm)
+{
+    return pio_get_index(pio) * 4 + sm;
+}
+
+static bool has_stalled(const SK6812Output* out)
+{
+    return (out->pio->fdebug & (1u << (PIO_FDEBUG_TXSTALL_LSB + out->sm))) != 0;
+}
+
+static void latched(SK6812Output* out)
 {
-    std::memset(fb, 0, sizeof(*fb));
+    const uint32_t frametime = (uint32_t) (time_us_64() - out->startedat_us);
+    out->lastframetime_us = frametime;
+    out->busytime_us += frametime;
+    out->numframes++;
+    out->numpixelssent += out->numpixels;
+    out->busy = false;
 
-    fb->pio = pio;
-    bool ok2add = pio_can_add_program(pio, &sk6812_program);
-    if (!ok2add)
+    // a done flag, not a counter: nobody might be waiting, frame after frame.
+    if (out->done.semaphore <= 0)
+        signal(&out->done);
+
+    if (out->latchwaiting)
+    {
+        out->latchwaiting = false;
+        signal(&out->latchedwaitable);
+    }
+}
+
+static int64_t __no_inline_not_in_flash_func(latch_alarm)(alarm_id_t id, void* param)
+{
+    SK6812Output* out = (SK6812Output*) param;
+
+    // the estimate is on the safe side, this should not happen. unless clk_sys has changed under our feet.
+    if (!has_stalled(out))
+    {
+        out->numdrainretries++;
+        return out->wordtime_us + PICORO_SK6812_LATCH_US;
+    }
+
+    latched(out);
+    return 0;
+}
+
+static void __no_inline_not_in_flash_func(dma_irq_handler)()
+{
+    uint32_t save = save_and_disable_interrupts();
+    {
+        PROFILE_THIS_FUNC;
+
+        for (int i = 0; i < SK6812_MAXSTRIPS; ++i)
+        {
+            SK6812Output* out = outputs[i];
+            if ((out == NULL) || !dma_irqn_get_channel_status(dmairq, out->dmachannel))
+                continue;
+            dma_irqn_acknowledge_channel(dmairq, out->dmachannel);
+
+            // the last few words are still in the fifo, plus the one the sm is shifting out.
+            // from here on the sm stalls as soon as it runs dry, and that's our "tx empty".
+            out->pio->fdebug = 1u << (PIO_FDEBUG_TXSTALL_LSB + out->sm);
+            const uint32_t drain_us = (pio_sm_get_tx_fifo_level(out->pio, out->sm) + 1) * out->wordtime_us;
+
+            // out of alarm slots: better a torn latch than a strip that never finishes.
+            if (add_alarm_in_us(drain_us + PICORO_SK6812_LATCH_US, latch_alarm, out, true) < 0)
+                latched(out);
+        }
+    }
+    restore_interrupts(save);
+}
+
+
+// claims what out needs and loads program, if it's not there yet. the caller then inits the sm.
+static bool claim_output(SK6812Output* out, PIO pio, int program, const uint32_t* front, int numwords, int wordtime_us, int numpixels)
+{
+    out->pio = pio;
+    out->program = program;
+    out->sending = front;
+    out->numwords = numwords;
+    out->wordtime_us = wordtime_us;
+    out->numpixels = numpixels;
+    out->busy = false;
+    out->latchwaiting = false;
+    std::memset(&out->latchedwaitable, 0, sizeof(out->latchedwaitable));
+    out->startedat_us = 0;
+    out->numframes = 0;
+    out->numpixelssent = 0;
+    out->busytime_us = 0;
+    out->numdrainretries = 0;
+    out->lastframetime_us = 0;
+
+    const int pioindex = pio_get_index(pio);
+    if ((programusers[program][pioindex] == 0) && !pio_can_add_program(pio, programs[program]))
         return false;
 
-    fb->dmachannel = dma_claim_unused_channel(false);
-    if (fb->dmachannel == -1)
+    out->dmachannel = dma_claim_unused_channel(false);
+    if (out->dmachannel == -1)
         return false;
 
-    fb->sm = pio_claim_unused_sm(pio, false);
-    if (fb->sm == -1)
+    out->sm = pio_claim_unused_sm(pio, false);
+    if (out->sm == -1)
     {
-        dma_channel_unclaim(fb->dmachannel);
+        dma_channel_unclaim(out->dmachannel);
         return false;
     }
 
-    uint offset = pio_add_program(pio, &sk6812_program);
+    if (programusers[program][pioindex]++ == 0)
+        programoffset[program][pioindex] = pio_add_program(pio, programs[program]);
 
-    static const int    freq_hz = 800000;
-    sk6812_program_init(fb->pio, fb->sm, offset, datapin, freq_hz);
+    return true;
+}
 
-    int dreq = pio_get_dreq(fb->pio, fb->sm, true);
-    dma_channel_config dmacfg = dma_channel_get_default_config(fb->dmachannel);
+// once the sm is running.
+static void start_output(SK6812Output* out)
+{
+    int dreq = pio_get_dreq(out->pio, out->sm, true);
+    dma_channel_config dmacfg = dma_channel_get_default_config(out->dmachannel);
     channel_config_set_dreq(&dmacfg, dreq);
-    channel_config_set_transfer_data_size(&dmacfg, DMA_SIZE_32);    // grbx
+    channel_config_set_transfer_data_size(&dmacfg, DMA_SIZE_32);
     channel_config_set_read_increment(&dmacfg, true);
     channel_config_set_write_increment(&dmacfg, false);
-    dma_channel_configure(fb->dmachannel, &dmacfg, &pio->txf[fb->sm], &fb->grbx_pixels[0], count_of(fb->grbx_pixels), false);
+    dma_channel_configure(out->dmachannel, &dmacfg, &out->pio->txf[out->sm], out->sending, out->numwords, false);
+
+    dma_irqn_acknowledge_channel(dmairq, out->dmachannel);
+    dma_irqn_set_channel_enabled(dmairq, out->dmachannel, true);
 
-    // FIXME: irq handler
-    // FIXME: side note: pio doesnt have a "tx empty" interrupt, or "stalled" interrupt.
-    //        so we'd have to wait for dma completion and then waste some time until the fifo has been emptied at 800khz
+    outputs[output_index(out->pio, out->sm)] = out;
 
-    //pio_remove_program
+    // first one brings up the irq handler, and starts the clock for the stats.
+    if (numoutputs++ == 0)
+    {
+        statssince = get_absolute_time();
+        irq_add_shared_handler(DMA_IRQ_0 + dmairq, dma_irq_handler, PICO_SHARED_IRQ_HANDLER_DEFAULT_ORDER_PRIORITY);
+        irq_set_enabled(DMA_IRQ_0 + dmairq, true);
+    }
+}
+
+// sleeps until out has latched, if it hasn't yet. a frame takes milliseconds, not worth spinning for.
+static void wait4latched(SK6812Output* out)
+{
+    while (true)
+    {
+        // flag first, then look at busy. latched() does the opposite, so one of us sees the other.
+        out->latchwaiting = true;
+        __dmb();
+        if (!out->busy)
+            break;
+        // might wake up for an earlier signal that raced with the check above, hence the loop.
+        yield_and_wait4signal(&out->latchedwaitable);
+    }
+    out->latchwaiting = false;
+}
+
+// yields until the previous frame has latched, then sends front.
+static Waitable* send_frame(SK6812Output* out, const uint32_t* front)
+{
+    // the leds need their latch time before the next frame can start.
+    wait4latched(out);
+
+    // whoever didn't wait for the last one: that's not this one's.
+    if (out->done.semaphore > 0)
+        yield_and_check4signal(&out->done);
+
+    out->sending = front;
+    out->busy = true;
+    out->startedat_us = time_us_64();
+    dma_channel_set_read_addr(out->dmachannel, out->sending, false);
+    dma_channel_set_trans_count(out->dmachannel, out->numwords, true);
+
+    return &out->done;
+}
+
+
+bool init_sk6812_framebuffer(SK6812FramebufferHeader* fb, PIO pio, int datapin, uint32_t* front, uint32_t* back, int numpixels)
+{
+    fb->sum = 0;
+    fb->grbx_pixels = back;
+    std::memset(front, 0, numpixels * sizeof(uint32_t));
+    std::memset(back, 0, numpixels * sizeof(uint32_t));
+
+    if (!claim_output(fb, pio, 0, front, numpixels, PIXEL_US, numpixels))
+        return false;
+
+    static const int    freq_hz = 800000;
+    sk6812_program_init(fb->pio, fb->sm, programoffset[0][pio_get_index(pio)], datapin, freq_hz);
+
+    start_output(fb);
+    return true;
+}
+
+bool init_sk6812_parallel_framebuffer(SK6812ParallelHeader* fb, PIO pio, int pinbase, int numpins, uint32_t* pixels, uint32_t* front, uint32_t* back, int numpixels)
+{
+    assert(numpins >= 1 && numpins <= 8);
+
+    const int numwords = numpixels * SK6812_WORDS_PER_PIXEL;
+    for (int i = 0; i < 8; ++i)
+        fb->grbx_pixels[i] = &pixels[i * numpixels];
+    fb->bitplanes = back;
+    fb->numpins = numpins;
+    fb->pixelsperstrip = numpixels;
+    std::memset(pixels, 0, 8 * numpixels * sizeof(uint32_t));
+    std::memset(front, 0, numwords * sizeof(uint32_t));
+    std::memset(back, 0, numwords * sizeof(uint32_t));
+
+    if (!claim_output(fb, pio, 1, front, numwords, PARALLELWORD_US, numpins * numpixels))
+        return false;
+
+    static const int    freq_hz = 800000;
+    sk6812_parallel_program_init(fb->pio, fb->sm, programoffset[1][pio_get_index(pio)], pinbase, numpins, freq_hz);
+
+    start_output(fb);
     return true;
 }
 
-static Coroutine<>     sk6812block;
+void deinit_sk6812(SK6812Output* out)
+{
+    const int pioindex = pio_get_index(out->pio);
+    assert(outputs[output_index(out->pio, out->sm)] == out);
+    assert(programusers[out->program][pioindex] > 0);
+    assert(!out->busy);
+
+    dma_irqn_set_channel_enabled(dmairq, out->dmachannel, false);
+    pio_sm_set_enabled(out->pio, out->sm, false);
+    pio_sm_unclaim(out->pio, out->sm);
+    dma_channel_abort(out->dmachannel);
+    dma_channel_unclaim(out->dmachannel);
+
+    if (--programusers[out->program][pioindex] == 0)
+        pio_remove_program(out->pio, programs[out->program], programoffset[out->program][pioindex]);
 
-static uint32_t sk6812func(uint32_t param)
+    outputs[output_index(out->pio, out->sm)] = NULL;
+    if (--numoutputs == 0)
+        irq_remove_handler(DMA_IRQ_0 + dmairq, dma_irq_handler);
+}
+
+Waitable* update_sk6812ledstrip(SK6812FramebufferHeader* fb)
 {
-    SK6812Framebuffer* fb = (SK6812Framebuffer*) param;
+    PROFILE_THIS_FUNC;
+
+    // no touching the front buffer until it's out.
+    wait4latched(fb);
 
-    //pio_sm_put_blocking(pio0, 0, pixel_grb << 8u);
+    uint32_t* front = fb->grbx_pixels;
+    fb->grbx_pixels = (uint32_t*) fb->sending;
+    return send_frame(fb, front);
+}
 
-    dma_channel_set_read_addr(fb->dmachannel, &fb->grbx_pixels[0], false);
-    dma_channel_set_trans_count(fb->dmachannel, count_of(fb->grbx_pixels), true);
+Waitable* update_sk6812parallel(SK6812ParallelHeader* fb)
+{
+    PROFILE_THIS_FUNC;
 
-    // should be about 5 ms
-    int transfertime_us = count_of(fb->grbx_pixels) * 24 * 1000000 / 800000;
-    // FIXME: but round up for now until we have completion irq
-    yield_and_wait4time(make_timeout_time_us(transfertime_us + 1000));
-    return 0;
+    // the back buffer is ours, even while the previous frame is still going out.
+    sk6812_transpose8(fb->grbx_pixels, fb->pixelsperstrip, fb->bitplanes);
+
+    uint32_t* front = fb->bitplanes;
+    wait4latched(fb);
+    fb->bitplanes = (uint32_t*) fb->sending;
+    return send_frame(fb, front);
 }
 
-Waitable* update_sk6812ledstrip(SK6812Framebuffer* fb)
+void get_sk6812_stats(SK6812Stats* stats)
 {
-    yield_and_start(sk6812func, (uint32_t) fb, &sk6812block);
-    // coro will exit when finished, it'll become signalled.
-    return &sk6812block.waitable;
+    std::memset(stats, 0, sizeof(*stats));
+    for (int i = 0; i < SK6812_MAXSTRIPS; ++i)
+    {
+        const SK6812Output* out = outputs[i];
+        if (out == NULL)
+            continue;
+        stats->numframes += out->numframes;
+        stats->numpixels += out->numpixelssent;
+        stats->busytime_us += out->busytime_us;
+        stats->numdrainretries += out->numdrainretries;
+    }
+
+    stats->elapsed_us = absolute_time_diff_us(statssince, get_absolute_time());
+    if (stats->elapsed_us > 0)
+    {
+        stats->framespersecond = (uint32_t) ((uint64_t) stats->numframes * 1000000 / stats->elapsed_us);
+        stats->pixelspersecond = (uint32_t) (stats->numpixels * 1000000 / stats->elapsed_us);
+    }
+}
+
+void reset_sk6812_stats()
+{
+    for (int i = 0; i < SK6812_MAXSTRIPS; ++i)
+    {
+        SK6812Output* out = outputs[i];
+        if (out == NULL)
+            continue;
+        out->numframes = 0;
+        out->numpixelssent = 0;
+        out->busytime_us = 0;
+        out->numdrainretries = 0;
+    }
+    statssince = get_absolute_time();
 }
@@ -1,37 +1,184 @@
 #pragma once
 #include "coroutine.h"
 #include "hardware/pio.h"
+#include "sk6812transpose.h"
 
 
+// one strip per pio state machine, so up to 8 of them (2 pios, 4 sms each).
+// or, in parallel mode, up to 8 strips per state machine: see SK6812Parallel<>.
+// strips update independently, so they all go out at the same time.
+// the pio programs are shared between all strips on the same pio.
+#define SK6812_MAXSTRIPS    8
+
+// how long the data line needs to be low before the leds latch what they got. datasheet says >80us.
+#ifndef PICORO_SK6812_LATCH_US
+#define PICORO_SK6812_LATCH_US      80
+#endif
+
+// frames are double-buffered: the app renders into grbx_pixels (the back buffer) while the dma sends the front one.
+// an update swaps them. there's no coro involved: the dma completion irq works out how long the pio fifo needs to drain,
+// and an alarm then signals once the strip has had its latch time. the pio has no "tx empty" irq, so the alarm checks
+// the stall flag and waits a little more if the estimate was too short.
+//
+// for gamma, brightness and dithering on the way into grbx_pixels see sk6812pipeline.h.
+
+
+struct SK6812Stats
+{
+    uint32_t    numframes;          // completed updates, all strips together.
+    uint64_t    numpixels;          // ...and the pixels they pushed out.
+    uint64_t    busytime_us;        // summed over all strips, so can be more than elapsed_us when they run in parallel.
+    uint64_t    elapsed_us;         // since the first strip came up, or reset_sk6812_stats().
+    uint32_t    framespersecond;    // numframes / elapsed_us
+    uint32_t    pixelspersecond;    // numpixels / elapsed_us
+    uint32_t    numdrainretries;
+};
+
 /**
- * @brief Stores "pixel" values for the LED strip.
- * 
+ * What a single strip and a parallel group have in common: a state machine, a dma channel and the frame that's going out.
+ * Treat as opaque.
  */
-struct SK6812Framebuffer
+struct SK6812Output
 {
     PIO     pio;
     int     sm;
     int     dmachannel;
+    int     program;
+
+    const uint32_t* sending;        // front buffer.
+    int             numwords;       // what the dma sends per frame.
+    int             wordtime_us;    // how long the sm takes to shift out one of those.
+    int             numpixels;      // per frame, all strips.
 
+    volatile bool   busy;           // from dma start until latched.
+    Waitable        done;
+    // for the update functions to sleep on while busy. separate from done, that one belongs to the app.
+    volatile bool   latchwaiting;
+    Waitable        latchedwaitable;
+    uint64_t        startedat_us;
+
+    uint32_t        numframes;
+    uint64_t        numpixelssent;
+    uint64_t        busytime_us;
+    uint32_t        numdrainretries;    // fifo drain estimate was too short.
+    uint32_t        lastframetime_us;   // dma start to latched.
+};
+
+/**
+ * Common stuff for SK6812Framebuffer<>.
+ * Treat as opaque, apart from sum and grbx_pixels.
+ */
+struct SK6812FramebufferHeader : SK6812Output
+{
     /**
      * The sum of all the pixel values. Can be used to estimate power consumption.
      * A good ballpark guestimate is 0.5mA per LED base current, ie no light.
      * And around 4.5mA per channel per LED at full brightness.
-     * Ex: count_of(grbx_pixels) * 0.5 + sum * (4.5 / 255)
+     * Ex: numpixels * 0.5 + sum * (4.5 / 255)
      */
     uint32_t        sum;
 
-    // FIXME: to template or not to template...
-    uint32_t    grbx_pixels[166];
+    /**
+     * The back buffer, render into this. Swaps with the front one on each update_sk6812ledstrip(),
+     * after which it has the frame before last in it.
+     */
+    uint32_t*       grbx_pixels;
 };
 
+/**
+ * @brief Stores "pixel" values for the LED strip.
+ */
+template <int NumPixels_ = 166>
+struct SK6812Framebuffer : SK6812FramebufferHeader
+{
+    static const int NumPixels = NumPixels_;
+    static_assert(NumPixels > 0);
 
-extern bool init_sk6812(SK6812Framebuffer* fb, PIO pio, int datapin);
+    uint32_t    framestorage[2][NumPixels];
+};
 
 /**
- * @brief Lights up a strip of SK6812 LEDs according to the "framebuffer".
- * 
- * @param pio 
+ * Common stuff for SK6812Parallel<>.
+ * Treat as opaque, apart from grbx_pixels.
+ */
+struct SK6812ParallelHeader : SK6812Output
+{
+    /**
+     * One per strip, strip n is on pin base+n. Render into these.
+     * Not double-buffered: an update transposes them into the back buffer right away, after that they're free again.
+     */
+    uint32_t*       grbx_pixels[8];
+    uint32_t*       bitplanes;      // back buffer.
+    int             numpins;
+    int             pixelsperstrip;
+};
+
+/**
+ * @brief Up to 8 strips of the same length on consecutive pins, driven by a single state machine.
+ * Eight times the pixels for the same pio and dma budget, at the cost of a transpose per update.
+ */
+template <int NumPixels_ = 166>
+struct SK6812Parallel : SK6812ParallelHeader
+{
+    static const int NumPixels = NumPixels_;
+    static_assert(NumPixels > 0);
+
+    uint32_t    pixelstorage[8][NumPixels];
+    uint32_t    bitplanestorage[2][NumPixels * SK6812_WORDS_PER_PIXEL];
+};
+
+
+/** @internal */
+extern bool init_sk6812_framebuffer(SK6812FramebufferHeader* fb, PIO pio, int datapin, uint32_t* front, uint32_t* back, int numpixels);
+/** @internal */
+extern bool init_sk6812_parallel_framebuffer(SK6812ParallelHeader* fb, PIO pio, int pinbase, int numpins, uint32_t* pixels, uint32_t* front, uint32_t* back, int numpixels);
+
+/**
+ * @brief Claims a state machine and a dma channel for a strip on datapin.
+ * @return false if pio has no state machine left, or there's no space for the program, or no dma channel.
+ */
+template <int NumPixels>
+bool init_sk6812(SK6812Framebuffer<NumPixels>* fb, PIO pio, int datapin)
+{
+    return init_sk6812_framebuffer(fb, pio, datapin, &fb->framestorage[0][0], &fb->framestorage[1][0], NumPixels);
+}
+
+/**
+ * @brief Claims a state machine and a dma channel for numpins (1..8) strips on pins pinbase onwards.
+ * @return false if pio has no state machine left, or there's no space for the program, or no dma channel.
+ */
+template <int NumPixels>
+bool init_sk6812_parallel(SK6812Parallel<NumPixels>* fb, PIO pio, int pinbase, int numpins)
+{
+    return init_sk6812_parallel_framebuffer(fb, pio, pinbase, numpins, &fb->pixelstorage[0][0], &fb->bitplanestorage[0][0], &fb->bitplanestorage[1][0], NumPixels);
+}
+
+/**
+ * @brief Gives the state machine and the dma channel back. The program goes too, once its last strip has gone.
+ * Don't call while an update is still going on.
+ */
+extern void deinit_sk6812(SK6812Output* fb);
+
+/**
+ * @brief Lights up a strip of SK6812 LEDs according to the back buffer, fb->grbx_pixels, and swaps buffers.
+ * Yields until the previous update has latched, if it hasn't yet. Call from a coro only.
+ * Each strip updates independently, call this for all of them and then wait for each (or don't).
+ * One coro per strip: only one can sleep on a busy strip at a time.
+ *
  * @return Waitable* signaled when the LEDs have been updated
  */
-extern Waitable* update_sk6812ledstrip(SK6812Framebuffer* fb);
+extern Waitable* update_sk6812ledstrip(SK6812FramebufferHeader* fb);
+
+/**
+ * @brief Same for a parallel group: transposes fb->grbx_pixels into the back buffer, while the previous frame is still
+ * going out, then yields until that has latched and swaps.
+ *
+ * @return Waitable* signaled when the LEDs have been updated
+ */
+extern Waitable* update_sk6812parallel(SK6812ParallelHeader* fb);
+
+/**
+ * @brief Frame and pixel counts of all strips together, and rates from that.
+ */
+extern void get_sk6812_stats(SK6812Stats* stats);
+extern void reset_sk6812_stats();
@@ -0,0 +1,258 @@
+#include "sk6812pipeline.h"
+#include <math.h>
+#include <assert.h>
+#include <stdio.h>
+#include "pico/time.h"
+#if PICORO_SK6812_INTERP
+#include "hardware/interp.h"
+#endif
+
+
+static uint32_t pack_grbx(uint32_t r, uint32_t g, uint32_t b)
+{
+    return (g << 24) | (r << 16) | (b << 8);
+}
+
+void init_pipeline(SK6812PipelineHeader* p, uint8_t* residuals, int numpixels)
+{
+    p->residuals = residuals;
+    p->numpixels = numpixels;
+    p->brightness = 256;
+    for (int i = 0; i < numpixels * 3; ++i)
+        residuals[i] = 0;
+    sk6812_set_gamma(p, 2.2f);
+}
+
+void sk6812_set_gamma(SK6812PipelineHeader* p, float gamma)
+{
+    assert(gamma > 0);
+
+    for (int i = 0; i <= 256; ++i)
+        p->gamma[i] = (uint16_t) (powf(i / 256.0f, gamma) * 65535.0f + 0.5f);
+}
+
+uint32_t sk6812_run_pipeline_reference(SK6812PipelineHeader* p, const SK6812Pixel16* in, uint32_t* grbx)
+{
+    uint32_t sum = 0;
+    uint8_t* residual = p->residuals;
+    for (int i = 0; i < p->numpixels; ++i, residual += 3)
+    {
+        const uint32_t r = sk6812_dither(sk6812_apply_brightness(p, sk6812_apply_gamma(p, in[i].r)), &residual[0]);
+        const uint32_t g = sk6812_dither(sk6812_apply_brightness(p, sk6812_apply_gamma(p, in[i].g)), &residual[1]);
+        const uint32_t b = sk6812_dither(sk6812_apply_brightness(p, sk6812_apply_gamma(p, in[i].b)), &residual[2]);
+        grbx[i] = pack_grbx(r, g, b);
+        sum += r + g + b;
+    }
+    return sum;
+}
+
+#if PICORO_SK6812_INTERP
+// interp0 is set up so that writing v to accum0 has the table entry's address in peek0 and the fraction in peek1.
+// saves the shifting and masking for each channel, the rest is the same as the reference.
+static inline uint32_t interp_gamma(uint16_t v)
+{
+    interp0->accum[0] = v;
+    const uint16_t* entry = (const uint16_t*) interp0->peek[0];
+    const uint32_t  frac = interp0->peek[1];
+    const uint32_t  a = entry[0];
+    const uint32_t  b = entry[1];
+    return a + (((b - a) * frac) >> 8);
+}
+
+uint32_t sk6812_run_pipeline(SK6812PipelineHeader* p, const SK6812Pixel16* in, uint32_t* grbx)
+{
+    interp_hw_save_t saved;
+    interp_save(interp0, &saved);
+
+    // lane 0: (v >> 8) * sizeof(uint16_t), plus the table.
+    interp_config cfg = interp_default_config();
+    interp_config_set_shift(&cfg, 7);
+    interp_config_set_mask(&cfg, 1, 8);
+    interp_set_config(interp0, 0, &cfg);
+    // lane 1: v & 0xff, off lane 0's accumulator.
+    cfg = interp_default_config();
+    interp_config_set_cross_input(&cfg, true);
+    interp_config_set_mask(&cfg, 0, 7);
+    interp_set_config(interp0, 1, &cfg);
+    interp0->base[0] = (uint32_t) &p->gamma[0];
+    interp0->base[1] = 0;
+
+    uint32_t sum = 0;
+    uint8_t* residual = p->residuals;
+    for (int i = 0; i < p->numpixels; ++i, residual += 3)
+    {
+        const uint32_t r = sk6812_dither(sk6812_apply_brightness(p, interp_gamma(in[i].r)), &residual[0]);
+        const uint32_t g = sk6812_dither(sk6812_apply_brightness(p, interp_gamma(in[i].g)), &residual[1]);
+        const uint32_t b = sk6812_dither(sk6812_apply_brightness(p, interp_gamma(in[i].b)), &residual[2]);
+        grbx[i] = pack_grbx(r, g, b);
+        sum += r + g + b;
+    }
+
+    interp_restore(interp0, &saved);
+    return sum;
+}
+#else
+uint32_t sk6812_run_pipeline(SK6812PipelineHeader* p, const SK6812Pixel16* in, uint32_t* grbx)
+{
+    return sk6812_run_pipeline_reference(p, in, grbx);
+}
+#endif
+
+
+#if !PICO_PRINTF_ALWAYS_INCLUDED
+// if the above symbol is not defined then assert's printf does not work!
+#endif
+// copied from assert macro.
+#define CHECK(__e) ((__e) ? (void)0 : __assert_func(__FILE__, __LINE__, __PRETTY_FUNCTION__, #__e))
+
+void sk6812_pipeline_unit_test()
+{
+    static SK6812Pipeline<4>    p;
+    static SK6812Pixel16        in[4];
+    static uint32_t             out[4];
+
+    init_sk6812_pipeline(&p);
+    CHECK(p.gamma[0] == 0 && p.gamma[256] == 65535);
+    for (int i = 0; i < 256; ++i)
+        CHECK(p.gamma[i] <= p.gamma[i + 1]);
+
+    // full on stays full on, every frame.
+    in[0] = {65535, 65535, 65535};
+    // well below one step of 8-bit output: needs dithering to show up at all.
+    in[1] = {0x2000, 0x1000, 0x0800};
+    in[2] = {0, 0, 0};
+    in[3] = {0x8000, 0x4000, 0xC000};
+
+    sk6812_set_brightness(&p, 100);
+    uint32_t sums[4][3] = {};
+    for (int frame = 0; frame < 256; ++frame)
+    {
+        const uint32_t total = sk6812_run_pipeline(&p, &in[0], &out[0]);
+
+        uint32_t check = 0;
+        for (int i = 0; i < 4; ++i)
+        {
+            sums[i][0] += (out[i] >> 16) & 0xFF;
+            sums[i][1] += out[i] >> 24;
+            sums[i][2] += (out[i] >> 8) & 0xFF;
+            check += ((out[i] >> 16) & 0xFF) + (out[i] >> 24) + ((out[i] >> 8) & 0xFF);
+            CHECK((out[i] & 0xFF) == 0);
+        }
+        CHECK(total == check);
+    }
+
+    // over 256 frames, what went out adds up to exactly the 16-bit value. and nothing's left over.
+    // (that's below full scale. at 0xFFFF the clamp in sk6812_dither() keeps 255 in the residual, frame after frame.)
+    for (int i = 0; i < 4; ++i)
+    {
+        CHECK(sums[i][0] == sk6812_apply_brightness(&p, sk6812_apply_gamma(&p, in[i].r)));
+        CHECK(sums[i][1] == sk6812_apply_brightness(&p, sk6812_apply_gamma(&p, in[i].g)));
+        CHECK(sums[i][2] == sk6812_apply_brightness(&p, sk6812_apply_gamma(&p, in[i].b)));
+    }
+    for (int i = 0; i < 4 * 3; ++i)
+        CHECK(p.residualstorage[i] == 0);
+    CHECK(sums[1][0] > 0);
+
+    sk6812_set_gamma(&p, 1.0f);
+    sk6812_set_brightness(&p, 256);
+    sk6812_run_pipeline(&p, &in[0], &out[0]);
+    CHECK(out[0] == 0xFFFFFF00);
+    CHECK(out[2] == 0);
+
+    sk6812_set_brightness(&p, 0);
+    sk6812_run_pipeline(&p, &in[0], &out[0]);
+    CHECK(out[0] == 0 && out[3] == 0);
+
+#if PICORO_SK6812_INTERP
+    // same numbers both ways.
+    static SK6812Pipeline<4>    q;
+    init_sk6812_pipeline(&p);
+    init_sk6812_pipeline(&q);
+    sk6812_set_brightness(&p, 77);
+    sk6812_set_brightness(&q, 77);
+    static uint32_t             ref[4];
+    for (int frame = 0; frame < 16; ++frame)
+    {
+        sk6812_run_pipeline(&p, &in[0], &out[0]);
+        sk6812_run_pipeline_reference(&q, &in[0], &ref[0]);
+        for (int i = 0; i < 4; ++i)
+            CHECK(out[i] == ref[i]);
+    }
+#endif
+}
+
+#undef CHECK
+
+
+// what apps did before: float gamma and brightness per channel, rounded to 8 bits.
+static uint32_t float_channel(uint16_t v, float gamma, float brightness)
+{
+    return (uint32_t) (powf(v / 65535.0f, gamma) * brightness * 255.0f + 0.5f);
+}
+
+void sk6812_pipeline_benchmark()
+{
+    static const int                NumPixels = 166;
+    static const int                NumFrames = 256;
+    static SK6812Pipeline<NumPixels> p;
+    static SK6812Pixel16            in[NumPixels];
+    static uint32_t                 out[NumPixels];
+    static uint32_t                 sums[NumPixels];
+    volatile uint32_t               sink = 0;
+
+    init_sk6812_pipeline(&p);
+    sk6812_set_brightness(&p, 40);
+    // a dark ramp: bottom quarter of the input range, with gamma and brightness on top very little of it makes it out.
+    for (int i = 0; i < NumPixels; ++i)
+    {
+        const uint16_t v = (uint16_t) (i * 0x4000 / (NumPixels - 1));
+        in[i] = {v, v, v};
+        sums[i] = 0;
+    }
+
+    uint64_t starttime = time_us_64();
+    for (int frame = 0; frame < NumFrames; ++frame)
+        sink = sink + sk6812_run_pipeline(&p, &in[0], &out[0]);
+    const uint64_t pipeline_us = time_us_64() - starttime;
+
+    // again from scratch, untimed, for what the eye would average over.
+    init_sk6812_pipeline(&p);
+    sk6812_set_brightness(&p, 40);
+    for (int frame = 0; frame < 256; ++frame)
+    {
+        sk6812_run_pipeline(&p, &in[0], &out[0]);
+        for (int i = 0; i < NumPixels; ++i)
+            sums[i] += (out[i] >> 16) & 0xFF;
+    }
+
+    starttime = time_us_64();
+    for (int frame = 0; frame < NumFrames; ++frame)
+    {
+        for (int i = 0; i < NumPixels; ++i)
+        {
+            const uint32_t r = float_channel(in[i].r, 2.2f, 40 / 256.0f);
+            const uint32_t g = float_channel(in[i].g, 2.2f, 40 / 256.0f);
+            const uint32_t b = float_channel(in[i].b, 2.2f, 40 / 256.0f);
+            out[i] = (g << 24) | (r << 16) | (b << 8);
+        }
+        sink = sink + out[NumPixels - 1];
+    }
+    const uint64_t float_us = time_us_64() - starttime;
+
+    // distinct levels along the ramp: averaged over 256 frames with dithering, a single frame's worth without.
+    int numdithered = 1;
+    int numplain = 1;
+    for (int i = 1; i < NumPixels; ++i)
+    {
+        numdithered += (sums[i] != sums[i - 1]) ? 1 : 0;
+        numplain += (float_channel(in[i].r, 2.2f, 40 / 256.0f) != float_channel(in[i - 1].r, 2.2f, 40 / 256.0f)) ? 1 : 0;
+    }
+
+    // in 1/100 ns.
+    const unsigned long long pipelinepp = pipeline_us * 100000 / (NumFrames * NumPixels);
+    const unsigned long long floatpp = float_us * 100000 / (NumFrames * NumPixels);
+    printf("sk6812 pipeline: %d pixels x %d frames, %llu.%02llu ns per pixel, float gamma %llu.%02llu ns per pixel\n",
+        NumPixels, NumFrames, pipelinepp / 100, pipelinepp % 100, floatpp / 100, floatpp % 100);
+    printf("sk6812 pipeline: dark ramp at brightness 40/256, %d distinct levels dithered, %d plain 8-bit\n", numdithered, numplain);
+    (void) sink;
+}
@@ -0,0 +1,117 @@
+#pragma once
+#include <stdint.h>
+
+
+// turns what the app renders, 16 bits per channel, into grbx pixels for a framebuffer:
+// - gamma: a 257-entry table of 16-bit linear values, interpolated between entries. so all 16 input bits count.
+// - global brightness, 0..256.
+// - temporal dithering: each channel of each pixel keeps the 8 bits that didn't make it into the output, and adds them
+//   to the next frame (sigma-delta, one per channel). over 256 frames the average comes out at the full 16 bits.
+//   except right at the top: the output can't go past 255, so full scale averages 255 (65280 over 256 frames, not 65535).
+//   that's what gets rid of the banding at low brightness: a channel at 1.5 out of 255 flickers between 1 and 2,
+//   at a few hundred frames a second, instead of sitting at 1.
+// no sdk calls in here, so that it compiles (and can be checked and timed) on a host too.
+// apart from time_us_64() in the benchmark, a host needs to bring its own.
+//
+// with PICORO_SK6812_INTERP the loop has interp0 do the table addressing. it saves and restores interp0's state, so it
+// can be shared with others, but not with irq handlers that don't save it themselves.
+
+
+#ifndef PICORO_SK6812_INTERP
+#define PICORO_SK6812_INTERP        0
+#endif
+
+
+struct SK6812Pixel16
+{
+    uint16_t    r;
+    uint16_t    g;
+    uint16_t    b;
+};
+
+/**
+ * Common stuff for SK6812Pipeline<>.
+ * Treat as opaque.
+ */
+struct SK6812PipelineHeader
+{
+    uint16_t    gamma[257];
+    uint16_t    brightness;     // 0..256
+    uint8_t*    residuals;      // 3 per pixel, r g b.
+    int         numpixels;
+};
+
+template <int NumPixels_ = 166>
+struct SK6812Pipeline : SK6812PipelineHeader
+{
+    static const int NumPixels = NumPixels_;
+    static_assert(NumPixels > 0);
+
+    uint8_t     residualstorage[NumPixels * 3];
+};
+
+
+/** @internal */
+extern void init_pipeline(SK6812PipelineHeader* p, uint8_t* residuals, int numpixels);
+
+/**
+ * @brief Full brightness, gamma 2.2, nothing carried over yet.
+ */
+template <int NumPixels>
+void init_sk6812_pipeline(SK6812Pipeline<NumPixels>* p)
+{
+    init_pipeline(p, &p->residualstorage[0], NumPixels);
+}
+
+/**
+ * @brief Refills the gamma table. 1.0 is linear. Uses floats, don't call per frame.
+ */
+extern void sk6812_set_gamma(SK6812PipelineHeader* p, float gamma);
+
+/**
+ * @brief 256 is full brightness.
+ */
+static inline void sk6812_set_brightness(SK6812PipelineHeader* p, uint16_t brightness)
+{
+    p->brightness = (brightness > 256) ? 256 : brightness;
+}
+
+static inline uint32_t sk6812_apply_gamma(const SK6812PipelineHeader* p, uint16_t v)
+{
+    const uint32_t a = p->gamma[v >> 8];
+    const uint32_t b = p->gamma[(v >> 8) + 1];
+    return a + (((b - a) * (v & 0xFF)) >> 8);
+}
+
+static inline uint32_t sk6812_apply_brightness(const SK6812PipelineHeader* p, uint32_t linear)
+{
+    return (linear * p->brightness) >> 8;
+}
+
+// adds what was left over last time, returns the 8 bits that go out and keeps the rest for next time.
+static inline uint32_t sk6812_dither(uint32_t linear, uint8_t* residual)
+{
+    uint32_t v = linear + *residual;
+    if (v > 0xFFFF)
+        v = 0xFFFF;
+    *residual = (uint8_t) v;
+    return v >> 8;
+}
+
+/**
+ * @brief Runs p->numpixels of in through the pipeline, into grbx.
+ * grbx is typically a framebuffer's back buffer, or one of the strips of a parallel group.
+ * Call once per frame, per strip: the dithering needs to see every frame.
+ * @return the sum of all channel values that went out, for SK6812FramebufferHeader::sum.
+ */
+extern uint32_t sk6812_run_pipeline(SK6812PipelineHeader* p, const SK6812Pixel16* in, uint32_t* grbx);
+
+/**
+ * @brief Same thing, plain c. What sk6812_run_pipeline() does without PICORO_SK6812_INTERP.
+ */
+extern uint32_t sk6812_run_pipeline_reference(SK6812PipelineHeader* p, const SK6812Pixel16* in, uint32_t* grbx);
+
+extern void sk6812_pipeline_unit_test();
+
+// ns per pixel against per-channel float gamma, and how many levels a dark ramp gets with and without dithering.
+extern void sk6812_pipeline_benchmark();
@@ -0,0 +1,126 @@
+#pragma once
+#include <stdint.h>
+#include <assert.h>
+
+
+// turns eight strips' worth of grbx pixels into what the parallel pio program shifts out: one byte per bit slot, bit n of
+// which goes to the strip on pin base+n. slots go out msb first (g7 .. g0, r7 .. r0, b7 .. b0), four per word, first
+// slot in the top byte. that's 6 words per pixel, for all 8 strips.
+// plain shifts and masks, no sdk calls, so that it compiles (and can be checked and timed) on a host too.
+
+
+#define SK6812_WORDS_PER_PIXEL      6
+
+
+// 4x4 transpose of the bytes in a, b, c, d (a's top byte being the top left corner).
+static inline void sk6812_transpose_bytes(uint32_t& a, uint32_t& b, uint32_t& c, uint32_t& d)
+{
+    // swap the top right and bottom left 2x2 blocks...
+    const uint32_t ac = (a & 0xFFFF0000) | (c >> 16);
+    const uint32_t bd = (b & 0xFFFF0000) | (d >> 16);
+    const uint32_t ca = (a << 16) | (c & 0x0000FFFF);
+    const uint32_t db = (b << 16) | (d & 0x0000FFFF);
+
+    // ...then within each block.
+    a = (ac & 0xFF00FF00) | ((bd >> 8) & 0x00FF00FF);
+    b = ((ac << 8) & 0xFF00FF00) | (bd & 0x00FF00FF);
+    c = (ca & 0xFF00FF00) | ((db >> 8) & 0x00FF00FF);
+    d = ((ca << 8) & 0xFF00FF00) | (db & 0x00FF00FF);
+}
+
+// 8x8 transpose of the bits in hi:lo (Hacker's Delight, transpose8). hi has the top four rows, first row in the top byte.
+static inline void sk6812_transpose_bits(uint32_t& hi, uint32_t& lo)
+{
+    uint32_t t;
+    t = (hi ^ (hi >> 7)) & 0x00AA00AA;  hi ^= t ^ (t << 7);
+    t = (lo ^ (lo >> 7)) & 0x00AA00AA;  lo ^= t ^ (t << 7);
+    t = (hi ^ (hi >> 14)) & 0x0000CCCC; hi ^= t ^ (t << 14);
+    t = (lo ^ (lo >> 14)) & 0x0000CCCC; lo ^= t ^ (t << 14);
+
+    t = (hi & 0xF0F0F0F0) | ((lo >> 4) & 0x0F0F0F0F);
+    lo = ((hi << 4) & 0xF0F0F0F0) | (lo & 0x0F0F0F0F);
+    hi = t;
+}
+
+/**
+ * @brief Interleaves numpixels of strips[0..7] into out, SK6812_WORDS_PER_PIXEL words per pixel.
+ * strips[n] goes to pin base+n. All 8 need to be valid, point unused ones at any of the others.
+ */
+static inline void sk6812_transpose8(const uint32_t* const strips[8], int numpixels, uint32_t* out)
+{
+    for (int i = 0; i < numpixels; ++i)
+    {
+        // the bit transpose puts the first row's bits at the top of each byte, but strip 0 needs to be bit 0.
+        // so rows go in backwards.
+        uint32_t g7 = strips[7][i], g6 = strips[6][i], g5 = strips[5][i], g4 = strips[4][i];
+        uint32_t g3 = strips[3][i], g2 = strips[2][i], g1 = strips[1][i], g0 = strips[0][i];
+
+        // now: g7's bytes are strips 7..4's green, r7's are their red, etc.
+        uint32_t& r7 = g6;  uint32_t& b7 = g5;  uint32_t& x7 = g4;
+        uint32_t& r3 = g2;  uint32_t& b3 = g1;  uint32_t& x3 = g0;
+        sk6812_transpose_bytes(g7, r7, b7, x7);
+        sk6812_transpose_bytes(g3, r3, b3, x3);
+
+        sk6812_transpose_bits(g7, g3);
+        sk6812_transpose_bits(r7, r3);
+        sk6812_transpose_bits(b7, b3);
+
+        out[0] = g7;    out[1] = g3;
+        out[2] = r7;    out[3] = r3;
+        out[4] = b7;    out[5] = b3;
+        out += SK6812_WORDS_PER_PIXEL;
+    }
+}
+
+
+#if !PICO_PRINTF_ALWAYS_INCLUDED
+// if the above symbol is not defined then assert's printf does not work!
+#endif
+// copied from assert macro.
+#define CHECK(__e) ((__e) ? (void)0 : __assert_func(__FILE__, __LINE__, __PRETTY_FUNCTION__, #__e))
+
+// checks the kernel against the obvious bit-by-bit loop.
+static inline void sk6812_transpose_unit_test()
+{
+    static const int    numpixels = 5;
+    static uint32_t     pixels[8][numpixels];
+    static uint32_t     out[numpixels * SK6812_WORDS_PER_PIXEL];
+
+    uint32_t rng = 0x12345678;
+    const uint32_t* strips[8];
+    for (int s = 0; s < 8; ++s)
+    {
+        for (int i = 0; i < numpixels; ++i)
+        {
+            rng = rng * 1664525 + 1013904223;
+            pixels[s][i] = rng;
+        }
+        strips[s] = &pixels[s][0];
+    }
+    // one strip lit up fully, to see where it ends up.
+    pixels[2][0] = 0xFFFFFF00;
+
+    sk6812_transpose8(strips, numpixels, &out[0]);
+
+    for (int i = 0; i < numpixels; ++i)
+    {
+        for (int slot = 0; slot < 24; ++slot)
+        {
+            const uint32_t word = out[i * SK6812_WORDS_PER_PIXEL + slot / 4];
+            const uint8_t  b = (uint8_t) (word >> (24 - (slot % 4) * 8));
+
+            uint8_t expected = 0;
+            for (int s = 0; s < 8; ++s)
+                expected |= ((pixels[s][i] >> (31 - slot)) & 1) << s;
+            CHECK(b == expected);
+
+            if (i == 0)
+                CHECK((b & (1 << 2)) != 0);
+        }
+    }
+}
+
+#undef CHECK
+
+// kernel against that same loop, per pixel, on a 166 pixel frame. in sk6812transposebenchmark.cpp.
+extern void sk6812_transpose_benchmark();
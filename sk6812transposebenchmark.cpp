@@ -0,0 +1,82 @@
+#include "sk6812transpose.h"
+#include "pico/time.h"
+#include <stdio.h>
+
+
+// what sk6812_transpose8() would be without the byte and bit transposes: gather each slot's byte one bit at a time.
+static void naive_transpose8(const uint32_t* const strips[8], int numpixels, uint32_t* out)
+{
+    for (int i = 0; i < numpixels; ++i)
+    {
+        for (int slot = 0; slot < 24; ++slot)
+        {
+            uint32_t b = 0;
+            for (int s = 0; s < 8; ++s)
+                b |= ((strips[s][i] >> (31 - slot)) & 1) << s;
+
+            uint32_t& word = out[i * SK6812_WORDS_PER_PIXEL + slot / 4];
+            if ((slot % 4) == 0)
+                word = 0;
+            word |= b << (24 - (slot % 4) * 8);
+        }
+    }
+}
+
+// a full 8 strip frame of 166 pixels, kernel against the naive loop. times are per pixel, i.e. for all 8 strips.
+// m0+ numbers are what count, but it builds on a host too, with a time_us_64() from somewhere.
+void sk6812_transpose_benchmark()
+{
+    static const int    NumPixels = 166;
+    static const int    KernelFrames = 2000;
+    static const int    NaiveFrames = 100;
+
+    static uint32_t     pixels[8][NumPixels];
+    static uint32_t     kernelout[NumPixels * SK6812_WORDS_PER_PIXEL];
+    static uint32_t     naiveout[NumPixels * SK6812_WORDS_PER_PIXEL];
+    volatile uint32_t   sink = 0;
+
+    uint32_t rng = 0x12345678;
+    const uint32_t* strips[8];
+    for (int s = 0; s < 8; ++s)
+    {
+        for (int i = 0; i < NumPixels; ++i)
+        {
+            rng = rng * 1664525 + 1013904223;
+            pixels[s][i] = rng & 0xFFFFFF00;
+        }
+        strips[s] = &pixels[s][0];
+    }
+
+    // same answer first, otherwise the timings mean nothing.
+    sk6812_transpose8(strips, NumPixels, &kernelout[0]);
+    naive_transpose8(strips, NumPixels, &naiveout[0]);
+    int nummismatched = 0;
+    for (int i = 0; i < NumPixels * SK6812_WORDS_PER_PIXEL; ++i)
+        nummismatched += (kernelout[i] != naiveout[i]) ? 1 : 0;
+
+    // touch a pixel each frame so nothing gets hoisted out of the loop.
+    uint64_t starttime = time_us_64();
+    for (int frame = 0; frame < KernelFrames; ++frame)
+    {
+        pixels[frame & 7][frame % NumPixels] ^= (uint32_t) frame << 8;
+        sk6812_transpose8(strips, NumPixels, &kernelout[0]);
+        sink = sink + kernelout[frame % (NumPixels * SK6812_WORDS_PER_PIXEL)];
+    }
+    const uint64_t kernel_us = time_us_64() - starttime;
+
+    starttime = time_us_64();
+    for (int frame = 0; frame < NaiveFrames; ++frame)
+    {
+        pixels[frame & 7][frame % NumPixels] ^= (uint32_t) frame << 8;
+        naive_transpose8(strips, NumPixels, &naiveout[0]);
+        sink = sink + naiveout[frame % (NumPixels * SK6812_WORDS_PER_PIXEL)];
+    }
+    const uint64_t naive_us = time_us_64() - starttime;
+
+    // in 1/100 ns.
+    const unsigned long long kernelpp = kernel_us * 100000 / (KernelFrames * NumPixels);
+    const unsigned long long naivepp = naive_us * 100000 / (NaiveFrames * NumPixels);
+    printf("sk6812 transpose: %d pixels x 8 strips, %d mismatches, kernel %llu.%02llu ns per pixel, naive %llu.%02llu ns per pixel\n",
+        NumPixels, nummismatched, kernelpp / 100, kernelpp % 100, naivepp / 100, naivepp % 100);
+    (void) sink;
+}
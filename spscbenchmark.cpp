@@ -0,0 +1,48 @@
+#include "spscqueue.h"
+#include "pico/multicore.h"
+#include <stdio.h>
+
+
+// core1 pushes a counting sequence as fast as it can, the calling coro pops it with spsc_pop(). measures what the queue
+// itself costs across cores, and how well the consumerwaiting flag batches wakeups.
+// needs pico_multicore linked in, and core1 must be free: it gets reset afterwards.
+
+static const uint32_t               NumItems = 200000;
+static SpscQueue<uint32_t, 256>     benchqueue;
+
+static void spsc_benchmark_producer()
+{
+    // a full queue counts as a drop, but this one just tries again.
+    for (uint32_t i = 0; i < NumItems; )
+    {
+        if (spsc_push(&benchqueue, i))
+            ++i;
+    }
+    // nothing else to do, and returning from the core1 entry point isn't a thing.
+    while (true)
+        __wfe();
+}
+
+void spsc_benchmark()
+{
+    spsc_init(&benchqueue);
+
+    uint32_t numoutoforder = 0;
+    const uint64_t starttime = time_us_64();
+    multicore_launch_core1(spsc_benchmark_producer);
+
+    for (uint32_t i = 0; i < NumItems; ++i)
+    {
+        uint32_t v;
+        spsc_pop(&benchqueue, &v);
+        numoutoforder += (v != i) ? 1 : 0;
+    }
+    const uint64_t elapsed = time_us_64() - starttime;
+    multicore_reset_core1();
+
+    const uint32_t numsignals = benchqueue.numsignals;
+    printf("spsc: %u items core1 to coro in %llu us, %llu items/s, %u out of order\n",
+        (unsigned) NumItems, (unsigned long long) elapsed, (unsigned long long) NumItems * 1000000 / (elapsed ? elapsed : 1), (unsigned) numoutoforder);
+    printf("spsc: %u signals (1 per %u items), producer found it full %u times\n",
+        (unsigned) numsignals, (unsigned) (NumItems / (numsignals ? numsignals : 1)), (unsigned) benchqueue.numdropped);
+}
@@ -0,0 +1,193 @@
+#pragma once
+#include "pico/stdlib.h"
+#include "hardware/sync.h"
+#include "coroutine.h"
+
+// single-producer single-consumer queue, lock-free.
+// meant for streaming data out of an irq handler (or core1) into a coro: the producer never blocks, the consumer can.
+//
+// each counter has exactly one writer: head only ever gets written by the producer, tail only by the consumer.
+// so there's no need for a critical section, just the right ordering of memory accesses:
+// - producer writes the item, then publishes it by bumping head. consumer reads head, then the item.
+// - consumer reads the item, then frees the slot by bumping tail. producer reads tail, then overwrites the slot.
+// the m0+ does not reorder much on its own but the compiler does, and across cores the bus might. hence __dmb().
+//
+// the consumer only ever sleeps if the queue is empty. it raises consumerwaiting for that, and only if that's raised
+// will the producer signal(). that way a stream of items costs one signal() per empty-to-non-empty transition, not one per item.
+template <typename T, int N>
+struct SpscQueue
+{
+    static_assert(N > 0 && (N & (N - 1)) == 0, "queue size needs to be a power of two");
+    static const uint32_t Capacity = N;
+    static const uint32_t Mask = N - 1;
+
+    volatile uint32_t   head;               // producer only: counts pushed items.
+    volatile uint32_t   numdropped;         // producer only: pushes that found the queue full.
+    volatile uint32_t   numsignals;         // producer only: how often the consumer was woken up.
+    volatile uint32_t   tail;               // consumer only: counts popped items.
+    volatile bool       consumerwaiting;    // raised by consumer, lowered by producer.
+    Waitable            waitable;
+    T                   items[N];
+};
+
+
+template <typename T, int N>
+static inline void spsc_init(SpscQueue<T, N>* q)
+{
+    q->head = 0;
+    q->tail = 0;
+    q->numdropped = 0;
+    q->numsignals = 0;
+    q->consumerwaiting = false;
+    q->waitable.semaphore = 0;
+}
+
+// either side can ask, but the answer might be out of date by the time you look at it.
+template <typename T, int N>
+static inline bool spsc_is_empty(const SpscQueue<T, N>* q)
+{
+    return q->head == q->tail;
+}
+
+/**
+ * @brief Producer side. Safe to call from an IRQ handler, or from core1.
+ * @return false if the queue is full, the item is dropped then.
+ */
+template <typename T, int N>
+static inline bool spsc_push(SpscQueue<T, N>* q, const T& item)
+{
+    const uint32_t head = q->head;
+    if (head - q->tail == (uint32_t) N)
+    {
+        q->numdropped = q->numdropped + 1;
+        return false;
+    }
+
+    q->items[head & SpscQueue<T, N>::Mask] = item;
+    // item needs to be in memory before anyone can see the new head.
+    __dmb();
+    q->head = head + 1;
+
+    // the new head needs to be out before we look at the flag. the consumer does the opposite: flag out, then look at head.
+    // so either it sees our item, or we see its flag. (the other way round both would miss each other and the consumer sleeps forever.)
+    __dmb();
+    if (q->consumerwaiting)
+    {
+        q->consumerwaiting = false;
+        q->numsignals = q->numsignals + 1;
+        signal(&q->waitable);
+        // in case we are on core1 and core0 is sleeping in the scheduler's idle loop.
+        __sev();
+    }
+
+    return true;
+}
+
+/**
+ * @brief Consumer side, does not block.
+ * @return false if the queue is empty.
+ */
+template <typename T, int N>
+static inline bool spsc_try_pop(SpscQueue<T, N>* q, T* item)
+{
+    const uint32_t tail = q->tail;
+    if (q->head == tail)
+        return false;
+
+    // don't read the item before having seen head.
+    __dmb();
+    *item = q->items[tail & SpscQueue<T, N>::Mask];
+    // and be done reading before the producer may overwrite it.
+    __dmb();
+    q->tail = tail + 1;
+    return true;
+}
+
+/**
+ * @brief Consumer side, does not block. Pops up to count items in one go.
+ * @return how many were popped.
+ */
+template <typename T, int N>
+static inline int spsc_try_pop_n(SpscQueue<T, N>* q, T* items, int count)
+{
+    const uint32_t tail = q->tail;
+    const uint32_t n = MIN((uint32_t) count, q->head - tail);
+    if (n == 0)
+        return 0;
+
+    __dmb();
+    for (uint32_t i = 0; i < n; ++i)
+        items[i] = q->items[(tail + i) & SpscQueue<T, N>::Mask];
+    __dmb();
+    q->tail = tail + n;
+    return n;
+}
+
+/**
+ * @brief Consumer side. Yields until there's something to pop.
+ * Call from a coro only.
+ */
+template <typename T, int N>
+static inline void spsc_pop(SpscQueue<T, N>* q, T* item)
+{
+    while (!spsc_try_pop(q, item))
+    {
+        q->consumerwaiting = true;
+        // see spsc_push(): flag out, then look at head.
+        __dmb();
+        if (!spsc_is_empty(q))
+        {
+            // raced with the producer. it might or might not have signalled. if it did, we'll wake up once for nothing later, that's fine.
+            q->consumerwaiting = false;
+            continue;
+        }
+
+        yield_and_wait4signal(&q->waitable);
+    }
+}
+
+
+#if !PICO_PRINTF_ALWAYS_INCLUDED
+// if the above symbol is not defined then assert's printf does not work!
+#endif
+// copied from assert macro.
+#define CHECK(__e) ((__e) ? (void)0 : __assert_func(__FILE__, __LINE__, __PRETTY_FUNCTION__, #__e))
+
+// single-threaded, only checks the bookkeeping.
+// calls signal(), so the scheduler needs to be up: call from a coro.
+static inline void spsc_unit_test()
+{
+    static SpscQueue<int, 4>    q;
+    spsc_init(&q);
+    CHECK(spsc_is_empty(&q));
+
+    int v = 0;
+    CHECK(!spsc_try_pop(&q, &v));
+
+    for (int i = 0; i < 4; ++i)
+        CHECK(spsc_push(&q, i));
+    CHECK(!spsc_push(&q, 4));
+    CHECK(q.numdropped == 1);
+
+    CHECK(spsc_try_pop(&q, &v) && v == 0);
+    CHECK(spsc_push(&q, 5));
+
+    int items[8];
+    CHECK(spsc_try_pop_n(&q, &items[0], 8) == 4);
+    CHECK(items[0] == 1 && items[1] == 2 && items[2] == 3 && items[3] == 5);
+    CHECK(spsc_is_empty(&q));
+
+    // nobody was waiting, so nobody needed waking.
+    CHECK(q.numsignals == 0);
+    q.consumerwaiting = true;
+    CHECK(spsc_push(&q, 6));
+    CHECK(q.numsignals == 1);
+    CHECK(!q.consumerwaiting);
+    CHECK(spsc_push(&q, 7));
+    CHECK(q.numsignals == 1);
+}
+
+#undef CHECK
+
+// core1 producing, calling coro consuming: items/s and signals per item. in spscbenchmark.cpp.
+extern void spsc_benchmark();
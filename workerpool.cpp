@@ -0,0 +1,321 @@
+#include "workerpool.h"
+#include "coroutine.h"
+#include "profiler.h"
+#include "pico/stdlib.h"
+#include "pico/critical_section.h"
+#include "hardware/sync.h"
+#include <stdio.h>
+#include <string.h>
+#if PICORO_WORKERPOOL_CORE1
+#include "pico/multicore.h"
+#endif
+
+
+#if PICORO_WORKERPOOL_CORE1
+// core1 can only ever run one loop, so only one pool gets it.
+static WorkerPoolHeader* volatile   core1pool = NULL;
+#endif
+
+
+static CoroutineHeader* worker_at(WorkerPoolHeader* pool, int index)
+{
+    return (CoroutineHeader*) (((uint8_t*) pool->firstworker) + index * pool->workerstride);
+}
+
+static void run_job(WorkerPoolHeader* pool, Job* job, bool oncore1)
+{
+    PROFILE_THIS_FUNC;
+
+    const absolute_time_t starttime = get_absolute_time();
+    job->result = job->func(job->param);
+    const int64_t busytime = absolute_time_diff_us(starttime, get_absolute_time());
+
+    // job memory belongs to the caller again once either of the signals is out: read what we need first.
+    JobGroup* group = job->group;
+
+    // job first: whoever joins the group might free the jobs as soon as the group looks done.
+    signal(&job->waitable);
+
+    critical_section_enter_blocking(&pool->lock);
+    pool->stats.numcompleted++;
+    if (oncore1)
+        pool->stats.numcompletedcore1++;
+    pool->stats.busytime_us += busytime;
+    if (group != NULL)
+    {
+        // last thing, and still holding the lock: join_jobs() checks outstanding under the same lock,
+        // so the group cannot go out of scope before we are done with it.
+        group->outstanding--;
+        if (group->outstanding == 0)
+            signal(&group->waitable);
+    }
+    critical_section_exit(&pool->lock);
+
+    // core0 might be asleep in the scheduler's idle loop.
+    if (oncore1)
+        __sev();
+}
+
+#if PICORO_WORKERPOOL_CORE1
+static void core1_worker_loop()
+{
+    WorkerPoolHeader* pool = core1pool;
+    assert(pool != NULL);
+
+    // no scheduler on core1. this is just a plain loop, sleeping until core0 submits something.
+    while (true)
+    {
+        critical_section_enter_blocking(&pool->lock);
+        Job* job = LL_ACCESS(job, llentry, ll_pop_front(&pool->jobs));
+        if (job != NULL)
+            pool->stats.numqueued--;
+        critical_section_exit(&pool->lock);
+
+        if (job == NULL)
+        {
+            __wfe();
+            continue;
+        }
+
+        run_job(pool, job, true);
+    }
+}
+#endif
+
+void init_worker_pool(WorkerPoolHeader* pool, int numworkers, CoroutineHeader* firstworker, int workerstride, bool usecore1)
+{
+    PROFILE_THIS_FUNC;
+
+    assert(numworkers > 0 && numworkers <= PICORO_WORKERPOOL_MAX_WORKERS);
+
+    critical_section_init(&pool->lock);
+    ll_init_list(&pool->jobs);
+    pool->idleworkers = 0;
+    pool->numworkers = numworkers;
+    pool->workerstride = workerstride;
+    pool->firstworker = firstworker;
+    pool->usecore1 = usecore1;
+    pool->shouldexit = false;
+    memset(&pool->stats, 0, sizeof(pool->stats));
+
+    if (usecore1)
+    {
+#if PICORO_WORKERPOOL_CORE1
+        assert(core1pool == NULL);
+        core1pool = pool;
+        multicore_launch_core1(core1_worker_loop);
+#else
+        // need PICORO_WORKERPOOL_CORE1 for that.
+        __breakpoint();
+        pool->usecore1 = false;
+#endif
+    }
+}
+
+void worker_loop(WorkerPoolHeader* pool, int index)
+{
+    PROFILE_THIS_FUNC;
+
+    while (true)
+    {
+        critical_section_enter_blocking(&pool->lock);
+        Job* job = LL_ACCESS(job, llentry, ll_pop_front(&pool->jobs));
+        if (job == NULL)
+        {
+            if (pool->shouldexit)
+            {
+                critical_section_exit(&pool->lock);
+                break;
+            }
+
+            // submit_jobs() will take us off the idle list again before waking us.
+            pool->idleworkers |= 1u << index;
+            critical_section_exit(&pool->lock);
+            yield_and_wait4wakeup();
+            continue;
+        }
+        pool->stats.numqueued--;
+        critical_section_exit(&pool->lock);
+
+        run_job(pool, job, false);
+
+        // there might be plenty more jobs queued up, give others a chance to run in between.
+        yield();
+    }
+}
+
+void stop_worker_pool(WorkerPoolHeader* pool)
+{
+    PROFILE_THIS_FUNC;
+
+    // core1 just keeps spinning, there's no stopping it.
+    assert(!pool->usecore1);
+
+    critical_section_enter_blocking(&pool->lock);
+    pool->shouldexit = true;
+    const uint32_t idle = pool->idleworkers;
+    pool->idleworkers = 0;
+    critical_section_exit(&pool->lock);
+
+    for (int i = 0; i < pool->numworkers; ++i)
+    {
+        if (idle & (1u << i))
+            wakeup(worker_at(pool, i));
+    }
+
+    for (int i = 0; i < pool->numworkers; ++i)
+        yield_and_wait4signal(&worker_at(pool, i)->waitable);
+}
+
+void submit_jobs(WorkerPoolHeader* pool, Job* jobs, int numjobs, JobGroup* group)
+{
+    PROFILE_THIS_FUNC;
+
+    if (numjobs <= 0)
+        return;
+
+    uint32_t towake = 0;
+
+    critical_section_enter_blocking(&pool->lock);
+    assert(!pool->shouldexit);
+    for (int i = 0; i < numjobs; ++i)
+    {
+        assert(jobs[i].func != NULL);
+        jobs[i].group = group;
+        // left over from a previous run if nobody waited on it.
+        jobs[i].waitable.semaphore = 0;
+        ll_push_back(&pool->jobs, &jobs[i].llentry);
+    }
+    if (group != NULL)
+        group->outstanding += numjobs;
+
+    pool->stats.numsubmitted += numjobs;
+    pool->stats.numqueued += numjobs;
+    if (pool->stats.numqueued > pool->stats.maxqueued)
+        pool->stats.maxqueued = pool->stats.numqueued;
+
+    // one worker per job is enough, the others can stay asleep.
+    for (int i = 0; (i < numjobs) && (pool->idleworkers != 0); ++i)
+    {
+        const uint32_t lowestbit = pool->idleworkers & -pool->idleworkers;
+        pool->idleworkers &= ~lowestbit;
+        towake |= lowestbit;
+    }
+    critical_section_exit(&pool->lock);
+
+    for (int i = 0; towake != 0; ++i, towake >>= 1)
+    {
+        if (towake & 1)
+            wakeup(worker_at(pool, i));
+    }
+
+    if (pool->usecore1)
+        __sev();
+}
+
+Waitable* submit_job(WorkerPoolHeader* pool, Job* job, jobfp_t func, uint32_t param, JobGroup* group)
+{
+    job->func = func;
+    job->param = param;
+    submit_jobs(pool, job, 1, group);
+    return &job->waitable;
+}
+
+void join_jobs(WorkerPoolHeader* pool, JobGroup* group)
+{
+    PROFILE_THIS_FUNC;
+
+    // the semaphore might have counts left over from earlier rounds, so outstanding is what matters.
+    while (true)
+    {
+        critical_section_enter_blocking(&pool->lock);
+        const bool done = group->outstanding == 0;
+        critical_section_exit(&pool->lock);
+        if (done)
+            break;
+
+        yield_and_wait4signal(&group->waitable);
+    }
+}
+
+void fork_join(WorkerPoolHeader* pool, Job* jobs, int numjobs, jobfp_t func)
+{
+    PROFILE_THIS_FUNC;
+
+    JobGroup    group;
+
+    for (int i = 0; i < numjobs; ++i)
+    {
+        jobs[i].func = func;
+        jobs[i].param = i;
+    }
+
+    submit_jobs(pool, jobs, numjobs, &group);
+    join_jobs(pool, &group);
+}
+
+void get_worker_pool_stats(WorkerPoolHeader* pool, WorkerPoolStats* stats)
+{
+    critical_section_enter_blocking(&pool->lock);
+    *stats = pool->stats;
+    critical_section_exit(&pool->lock);
+}
+
+
+static uint8_t  benchmarkdata[256];
+
+// something cpu-bound: bitwise crc32 over benchmarkdata.
+static uint32_t benchmark_crc_job(uint32_t param)
+{
+    uint32_t crc = ~param;
+    for (unsigned int i = 0; i < count_of(benchmarkdata); ++i)
+    {
+        crc ^= benchmarkdata[i];
+        for (int b = 0; b < 8; ++b)
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+    return ~crc;
+}
+
+// something io-bound: pretend to wait for a peripheral.
+static uint32_t benchmark_wait_job(uint32_t param)
+{
+    yield_and_wait4time(make_timeout_time_us(500));
+    return param;
+}
+
+template <int NumWorkers>
+static void run_benchmark(WorkerPool<NumWorkers>* pool)
+{
+    static Job  jobs[64];
+
+    start_worker_pool(pool);
+
+    const jobfp_t   funcs[] = {benchmark_crc_job, benchmark_wait_job};
+    const char*     names[] = {"crc", "wait"};
+    for (unsigned int f = 0; f < count_of(funcs); ++f)
+    {
+        const absolute_time_t starttime = get_absolute_time();
+        fork_join(pool, &jobs[0], count_of(jobs), funcs[f]);
+        const int64_t elapsed = absolute_time_diff_us(starttime, get_absolute_time());
+
+        printf("workerpool: %d workers, %s: %d jobs in %lld us, %lld jobs/s\n",
+            NumWorkers, names[f], (int) count_of(jobs), elapsed, (count_of(jobs) * 1000000ll) / (elapsed > 0 ? elapsed : 1));
+    }
+
+    stop_worker_pool(pool);
+}
+
+void workerpool_benchmark()
+{
+    static WorkerPool<1>    pool1;
+    static WorkerPool<2>    pool2;
+    static WorkerPool<4>    pool4;
+
+    for (unsigned int i = 0; i < count_of(benchmarkdata); ++i)
+        benchmarkdata[i] = (uint8_t) (i * 7);
+
+    run_benchmark(&pool1);
+    run_benchmark(&pool2);
+    run_benchmark(&pool4);
+}
@@ -0,0 +1,146 @@
+#pragma once
+#include "coroutine.h"
+#include "pico/critical_section.h"
+
+
+// define to allow a pool to also hand jobs to core1.
+// needs pico_multicore linked in, and core1 must not be used for anything else.
+#ifndef PICORO_WORKERPOOL_CORE1
+#define PICORO_WORKERPOOL_CORE1     0
+#endif
+
+// idle workers are tracked in a 32-bit mask.
+#define PICORO_WORKERPOOL_MAX_WORKERS   32
+
+
+/**
+ * Job function, gets the param from submit_job() and its return value ends up in Job::result.
+ * Should be short: it runs on a worker coro, i.e. cooperatively with everyone else.
+ * It may yield (e.g. wait for an i2c transfer), that's what having more than one worker is good for.
+ * @warning If the pool uses core1 then a job may run there, where it must not call any yield() function.
+ */
+typedef uint32_t (*jobfp_t)(uint32_t param);
+
+/**
+ * Counts outstanding jobs, for fork-join.
+ * The Waitable signals when the count drops to zero.
+ */
+struct JobGroup
+{
+    Waitable        waitable;
+    int             outstanding;
+
+    JobGroup()
+        : outstanding(0)
+    {
+    }
+};
+
+/**
+ * Caller-owned job. Needs to stay alive until it has completed.
+ * Treat as opaque, apart from result.
+ */
+struct Job
+{
+    struct LinkedListEntry  llentry;
+    jobfp_t                 func;
+    uint32_t                param;
+    JobGroup*               group;
+    Waitable                waitable;       // signals when the job has completed.
+    uint32_t                result;         // valid once completed.
+};
+
+struct WorkerPoolStats
+{
+    uint32_t    numsubmitted;
+    uint32_t    numcompleted;
+    uint32_t    numcompletedcore1;  // subset of numcompleted.
+    uint32_t    numqueued;          // waiting for a worker, right now.
+    uint32_t    maxqueued;
+    uint64_t    busytime_us;        // time spent in job functions, summed over all workers.
+};
+
+/**
+ * Common stuff for WorkerPool<>.
+ * Treat as opaque.
+ */
+struct WorkerPoolHeader
+{
+    critical_section_t      lock;
+    struct LinkedList       jobs;
+    uint32_t                idleworkers;    // bit per worker.
+    int                     numworkers;
+    int                     workerstride;   // bytes between workers.
+    CoroutineHeader*        firstworker;
+    bool                    usecore1;
+    bool                    shouldexit;
+    WorkerPoolStats         stats;
+};
+
+template <int NumWorkers_ = 2, int StackSize_ = 256>
+struct WorkerPool : WorkerPoolHeader
+{
+    static const int NumWorkers = NumWorkers_;
+    static const int StackSize = StackSize_;
+    static_assert(NumWorkers > 0);
+    static_assert(NumWorkers <= PICORO_WORKERPOOL_MAX_WORKERS);
+
+    Coroutine<StackSize>    workers[NumWorkers];
+};
+
+
+/** @internal Entry point for each worker coro. */
+extern void worker_loop(WorkerPoolHeader* pool, int index);
+/** @internal */
+extern void init_worker_pool(WorkerPoolHeader* pool, int numworkers, CoroutineHeader* firstworker, int workerstride, bool usecore1);
+
+/**
+ * @brief Starts the worker coros of pool (and yields while doing so).
+ * @param usecore1 core1 takes jobs too. Only one pool can do that. Needs PICORO_WORKERPOOL_CORE1.
+ */
+template <int NumWorkers, int StackSize>
+void start_worker_pool(WorkerPool<NumWorkers, StackSize>* pool, bool usecore1 = false)
+{
+    init_worker_pool(pool, NumWorkers, &pool->workers[0], sizeof(pool->workers[0]), usecore1);
+
+    for (int i = 0; i < NumWorkers; ++i)
+        yield_and_start([pool, i]() { worker_loop(pool, i); }, &pool->workers[i]);
+}
+
+/**
+ * @brief Tells the workers to exit once the queue has drained, and waits for them to do so.
+ * Does not work for pools that use core1.
+ */
+extern void stop_worker_pool(WorkerPoolHeader* pool);
+
+/**
+ * @brief Queues numjobs jobs in one go. Each needs func and param filled in.
+ * If group is non-null then it counts these jobs as outstanding, see join_jobs().
+ * Call from a coro only, not from an IRQ handler. Does not yield.
+ */
+extern void submit_jobs(WorkerPoolHeader* pool, Job* jobs, int numjobs, JobGroup* group = NULL);
+
+/**
+ * @brief Queues a single job. Returns something to yield_and_wait4signal() on.
+ * Call from a coro only, not from an IRQ handler. Does not yield.
+ */
+extern Waitable* submit_job(WorkerPoolHeader* pool, Job* job, jobfp_t func, uint32_t param, JobGroup* group = NULL);
+
+/**
+ * @brief Yields until all jobs counted by group have completed.
+ */
+extern void join_jobs(WorkerPoolHeader* pool, JobGroup* group);
+
+/**
+ * @brief Fork-join: runs func(0) .. func(numjobs - 1) on the pool and waits for all of them.
+ * jobs needs to have room for numjobs. The results are in there afterwards.
+ */
+extern void fork_join(WorkerPoolHeader* pool, Job* jobs, int numjobs, jobfp_t func);
+
+extern void get_worker_pool_stats(WorkerPoolHeader* pool, WorkerPoolStats* stats);
+
+/**
+ * @brief Prints jobs/sec for pools of 1, 2 and 4 workers, for a compute-only job and a job that mostly waits.
+ * Needs about 7 kB ram for the pools' stacks. Call from a coro.
+ */
+extern void workerpool_benchmark();